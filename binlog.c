@@ -107,7 +107,7 @@ void bl_do_set_auth_key (struct tgl_state *TLS, int num, unsigned char *buf) /*
 
   memcpy (TLS->DC_list[num]->auth_key, buf, 256);
   
-  static unsigned char sha1_buffer[20];
+  unsigned char sha1_buffer[20];
   TGLC_sha1 ((void *)TLS->DC_list[num]->auth_key, 256, sha1_buffer);
   TLS->DC_list[num]->auth_key_id = *(long long *)(sha1_buffer + 12);
 
@@ -516,7 +516,7 @@ void bl_do_encr_chat_exchange (struct tgl_state *TLS, tgl_peer_id_t id, long lon
     P->encr_chat.exchange_id = *exchange_id;
   }
 
-  static unsigned char sha_buffer[20];
+  unsigned char sha_buffer[20];
   switch (P->encr_chat.exchange_state) {
   case tgl_sce_requested:
     memcpy (P->encr_chat.exchange_key, key, 256);
@@ -852,7 +852,7 @@ void bl_do_encr_chat (struct tgl_state *TLS, int id, long long *access_hash, int
       if (Us) {
         U->print_name = TLS->callback.create_print_name (TLS, TGL_MK_ENCR_CHAT (id), "!", Us->user.first_name, Us->user.last_name, 0);
       } else {
-        static char buf[100];
+        char buf[100];
         tsnprintf (buf, 99, "user#%d", U->user_id);
         U->print_name = TLS->callback.create_print_name (TLS, TGL_MK_ENCR_CHAT (id), "!", buf, 0, 0);
       }
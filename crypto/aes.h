@@ -33,10 +33,26 @@ typedef struct TGLC_aes_key {
               244
 #endif
               ];
+  /* AES-NI round keys, used instead of the backend when _ni_rounds is set */
+  unsigned char _ni_rk[15 * 16];
+  int _ni_rounds;
 } TGLC_aes_key;
 
 void TGLC_aes_set_encrypt_key (const unsigned char *userKey, const int bits, TGLC_aes_key *key);
 void TGLC_aes_set_decrypt_key (const unsigned char *userKey, const int bits, TGLC_aes_key *key);
 void TGLC_aes_ige_encrypt (const unsigned char *in, unsigned char *out, size_t length, const TGLC_aes_key *key, unsigned char *ivec, const int enc);
 
+/* One independent stream for TGLC_aes_ige_encrypt_many */
+typedef struct TGLC_aes_ige_job {
+  const unsigned char *in;
+  unsigned char *out;
+  size_t length;
+  const TGLC_aes_key *key;
+  unsigned char *ivec;
+} TGLC_aes_ige_job;
+
+/* Same as TGLC_aes_ige_encrypt on every job, but blocks of different jobs
+ * are interleaved, so that one stream waits for AES rounds of the others. */
+void TGLC_aes_ige_encrypt_many (TGLC_aes_ige_job *jobs, int n, const int enc);
+
 #endif
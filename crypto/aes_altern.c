@@ -31,6 +31,7 @@
 #include <gcrypt.h>
 
 #include "aes.h"
+#include "aes_ni.h"
 #include "meta.h"
 #include "rand.h"
 
@@ -39,15 +40,18 @@
 #define AES_KEY_BITS 256
 #define AES_KEY_BYTES (AES_KEY_BITS/8)
 
-typedef char check_struct_sizes[(sizeof (TGLC_aes_key) == AES_KEY_BYTES) - 1];
+typedef char check_struct_sizes[(sizeof (((TGLC_aes_key *)0)->_dummy) == AES_KEY_BYTES) - 1];
 
 void TGLC_aes_set_encrypt_key (const unsigned char *userKey, const int bits, TGLC_aes_key *key) {
   assert (bits == AES_KEY_BITS);
   memcpy (key->_dummy, userKey, AES_KEY_BYTES);
+  TGLC_aes_ni_set_key (userKey, bits, key, 1);
 }
 
 void TGLC_aes_set_decrypt_key (const unsigned char *userKey, const int bits, TGLC_aes_key *key) {
-  TGLC_aes_set_encrypt_key (userKey, bits, key);
+  assert (bits == AES_KEY_BITS);
+  memcpy (key->_dummy, userKey, AES_KEY_BYTES);
+  TGLC_aes_ni_set_key (userKey, bits, key, 0);
 }
 
 // TODO: Try to use gcrypt's internal buf_xor?
@@ -141,6 +145,11 @@ static gcry_error_t do_ige_decrypt (const unsigned char *in, unsigned char *out,
 void TGLC_aes_ige_encrypt (const unsigned char *in, unsigned char *out, size_t length, const TGLC_aes_key *key, unsigned char *ivec, const int enc) {
   assert (!(length % AES_BLOCK_BYTES));
 
+  if (key->_ni_rounds) {
+    TGLC_aes_ni_ige_encrypt (in, out, length, key, ivec, enc);
+    return;
+  }
+
   /* Set it up. */
   gcry_cipher_hd_t cipher;
   gcry_error_t gcry_error = gcry_cipher_open (&cipher, GCRY_CIPHER_AES256, GCRY_CIPHER_MODE_ECB, 0);
@@ -0,0 +1,314 @@
+/* 
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Vitaly Valtman 2013-2015
+*/
+
+#include "../config.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "aes_ni.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+
+#include <cpuid.h>
+#include <wmmintrin.h>
+
+#define AES_NI_ROUNDS 14
+#define AES_NI_TARGET __attribute__ ((target ("aes,sse2")))
+
+static int aes_ni_supported = -1;
+
+// may be called from several threads, so the result is stored once
+static int aes_ni_check (void) {
+  int r = __atomic_load_n (&aes_ni_supported, __ATOMIC_RELAXED);
+  if (r < 0) {
+    unsigned a, b, c, d;
+    r = __get_cpuid (1, &a, &b, &c, &d) && (c & bit_AES) ? 1 : 0;
+    __atomic_store_n (&aes_ni_supported, r, __ATOMIC_RELAXED);
+  }
+  return r;
+}
+
+/* One step of AES-256 key expansion (Intel AES-NI white paper, fig. 28). */
+static inline __m128i AES_NI_TARGET aes_ni_expand (__m128i k, __m128i t) {
+  k = _mm_xor_si128 (k, _mm_slli_si128 (k, 4));
+  k = _mm_xor_si128 (k, _mm_slli_si128 (k, 4));
+  k = _mm_xor_si128 (k, _mm_slli_si128 (k, 4));
+  return _mm_xor_si128 (k, t);
+}
+
+#define AES_NI_EXPAND_PAIR(i,rcon) \
+  rk[i] = aes_ni_expand (rk[i - 2], _mm_shuffle_epi32 (_mm_aeskeygenassist_si128 (rk[i - 1], rcon), 0xff)); \
+  rk[i + 1] = aes_ni_expand (rk[i - 1], _mm_shuffle_epi32 (_mm_aeskeygenassist_si128 (rk[i], 0), 0xaa));
+
+static void AES_NI_TARGET aes_ni_expand_key (const unsigned char *userKey, __m128i *rk, const int enc) {
+  rk[0] = _mm_loadu_si128 ((const __m128i *) userKey);
+  rk[1] = _mm_loadu_si128 ((const __m128i *) (userKey + 16));
+  AES_NI_EXPAND_PAIR (2, 0x01);
+  AES_NI_EXPAND_PAIR (4, 0x02);
+  AES_NI_EXPAND_PAIR (6, 0x04);
+  AES_NI_EXPAND_PAIR (8, 0x08);
+  AES_NI_EXPAND_PAIR (10, 0x10);
+  AES_NI_EXPAND_PAIR (12, 0x20);
+  rk[14] = aes_ni_expand (rk[12], _mm_shuffle_epi32 (_mm_aeskeygenassist_si128 (rk[13], 0x40), 0xff));
+  if (!enc) {
+    /* equivalent inverse cipher: reversed order, InvMixColumns on inner keys */
+    __m128i ek[AES_NI_ROUNDS + 1];
+    memcpy (ek, rk, sizeof (ek));
+    int i;
+    rk[0] = ek[AES_NI_ROUNDS];
+    for (i = 1; i < AES_NI_ROUNDS; i++) {
+      rk[i] = _mm_aesimc_si128 (ek[AES_NI_ROUNDS - i]);
+    }
+    rk[AES_NI_ROUNDS] = ek[0];
+  }
+}
+
+int TGLC_aes_ni_set_key (const unsigned char *userKey, const int bits, TGLC_aes_key *key, const int enc) {
+  key->_ni_rounds = 0;
+  if (bits != 256 || !aes_ni_check ()) {
+    return 0;
+  }
+  __m128i rk[AES_NI_ROUNDS + 1];
+  aes_ni_expand_key (userKey, rk, enc);
+  memcpy (key->_ni_rk, rk, sizeof (rk));
+  key->_ni_rounds = AES_NI_ROUNDS;
+  return 1;
+}
+
+/* IGE is sequential in both directions, so blocks go one by one,
+ * but round keys and chaining values never leave the registers. */
+static void AES_NI_TARGET aes_ni_ige (const unsigned char *in, unsigned char *out, size_t blocks, const unsigned char *key, unsigned char *ivec, const int enc) {
+  __m128i rk[AES_NI_ROUNDS + 1];
+  int i;
+  for (i = 0; i <= AES_NI_ROUNDS; i++) {
+    rk[i] = _mm_loadu_si128 ((const __m128i *) (key + 16 * i));
+  }
+  /* encryption: ivec holds y_0, x_0; decryption: roles of plain and cipher text are swapped */
+  __m128i iv1 = _mm_loadu_si128 ((const __m128i *) ivec);
+  __m128i iv2 = _mm_loadu_si128 ((const __m128i *) (ivec + 16));
+  while (blocks --) {
+    __m128i x = _mm_loadu_si128 ((const __m128i *) in);
+    __m128i t;
+    if (enc) {
+      t = _mm_xor_si128 (_mm_xor_si128 (x, iv1), rk[0]);
+      for (i = 1; i < AES_NI_ROUNDS; i++) {
+        t = _mm_aesenc_si128 (t, rk[i]);
+      }
+      t = _mm_aesenclast_si128 (t, rk[AES_NI_ROUNDS]);
+      t = _mm_xor_si128 (t, iv2);
+      iv1 = t;
+      iv2 = x;
+    } else {
+      t = _mm_xor_si128 (_mm_xor_si128 (x, iv2), rk[0]);
+      for (i = 1; i < AES_NI_ROUNDS; i++) {
+        t = _mm_aesdec_si128 (t, rk[i]);
+      }
+      t = _mm_aesdeclast_si128 (t, rk[AES_NI_ROUNDS]);
+      t = _mm_xor_si128 (t, iv1);
+      iv1 = x;
+      iv2 = t;
+    }
+    _mm_storeu_si128 ((__m128i *) out, t);
+    in += 16;
+    out += 16;
+  }
+  /* ivec is updated in both directions, as OpenSSL does */
+  _mm_storeu_si128 ((__m128i *) ivec, iv1);
+  _mm_storeu_si128 ((__m128i *) (ivec + 16), iv2);
+}
+
+void TGLC_aes_ni_ige_encrypt (const unsigned char *in, unsigned char *out, size_t length, const TGLC_aes_key *key, unsigned char *ivec, const int enc) {
+  assert (key->_ni_rounds == AES_NI_ROUNDS && !(length & 15));
+  aes_ni_ige (in, out, length / 16, key->_ni_rk, ivec, enc);
+}
+
+/* AES rounds have latency of several cycles and throughput of one or two per cycle,
+ * so up to eight independent blocks are kept in flight. */
+#define AES_NI_LANES 8
+
+struct aes_ni_lane {
+  const unsigned char *in;
+  unsigned char *out;
+  size_t blocks;
+  int stride;
+  const unsigned char *rk;
+  unsigned char *ivec;
+  __m128i iv1, iv2;
+};
+
+/* Lanes are unrolled by hand, so that their state stays in registers. */
+#define AES_NI_X4(op) op(0) op(1) op(2) op(3)
+#define AES_NI_X8(op) AES_NI_X4(op) op(4) op(5) op(6) op(7)
+
+#define AES_NI_RK(i,r) _mm_loadu_si128 ((const __m128i *) (rk##i + 16 * (r)))
+#define AES_NI_LOAD(i) \
+  const unsigned char *in##i = L[i].in, *rk##i = L[i].rk; \
+  unsigned char *out##i = L[i].out; \
+  __m128i iv1_##i = L[i].iv1, iv2_##i = L[i].iv2, x##i, t##i;
+#define AES_NI_ENC_FIRST(i) \
+  x##i = _mm_loadu_si128 ((const __m128i *) in##i); \
+  t##i = _mm_xor_si128 (_mm_xor_si128 (x##i, iv1_##i), AES_NI_RK (i, 0));
+#define AES_NI_ENC_ROUND(i) t##i = _mm_aesenc_si128 (t##i, AES_NI_RK (i, r));
+#define AES_NI_ENC_LAST(i) \
+  t##i = _mm_xor_si128 (_mm_aesenclast_si128 (t##i, AES_NI_RK (i, AES_NI_ROUNDS)), iv2_##i); \
+  iv1_##i = t##i; \
+  iv2_##i = x##i;
+#define AES_NI_DEC_FIRST(i) \
+  x##i = _mm_loadu_si128 ((const __m128i *) in##i); \
+  t##i = _mm_xor_si128 (_mm_xor_si128 (x##i, iv2_##i), AES_NI_RK (i, 0));
+#define AES_NI_DEC_ROUND(i) t##i = _mm_aesdec_si128 (t##i, AES_NI_RK (i, r));
+#define AES_NI_DEC_LAST(i) \
+  t##i = _mm_xor_si128 (_mm_aesdeclast_si128 (t##i, AES_NI_RK (i, AES_NI_ROUNDS)), iv1_##i); \
+  iv1_##i = x##i; \
+  iv2_##i = t##i;
+#define AES_NI_STORE(i) \
+  _mm_storeu_si128 ((__m128i *) out##i, t##i); \
+  in##i += L[i].stride; \
+  out##i += L[i].stride;
+#define AES_NI_SAVE(i) \
+  L[i].in = in##i; \
+  L[i].out = out##i; \
+  L[i].iv1 = iv1_##i; \
+  L[i].iv2 = iv2_##i;
+
+/* Runs blocks blocks on each of W lanes. */
+#define AES_NI_STEP(W) \
+static void AES_NI_TARGET aes_ni_step##W (struct aes_ni_lane *L, size_t blocks, const int enc) { \
+  int r; \
+  AES_NI_X##W (AES_NI_LOAD) \
+  while (blocks --) { \
+    if (enc) { \
+      AES_NI_X##W (AES_NI_ENC_FIRST) \
+      for (r = 1; r < AES_NI_ROUNDS; r++) { \
+        AES_NI_X##W (AES_NI_ENC_ROUND) \
+      } \
+      AES_NI_X##W (AES_NI_ENC_LAST) \
+    } else { \
+      AES_NI_X##W (AES_NI_DEC_FIRST) \
+      for (r = 1; r < AES_NI_ROUNDS; r++) { \
+        AES_NI_X##W (AES_NI_DEC_ROUND) \
+      } \
+      AES_NI_X##W (AES_NI_DEC_LAST) \
+    } \
+    AES_NI_X##W (AES_NI_STORE) \
+  } \
+  AES_NI_X##W (AES_NI_SAVE) \
+}
+
+AES_NI_STEP (4)
+AES_NI_STEP (8)
+
+static void AES_NI_TARGET aes_ni_lane_done (struct aes_ni_lane *L) {
+  _mm_storeu_si128 ((__m128i *) L->ivec, L->iv1);
+  _mm_storeu_si128 ((__m128i *) (L->ivec + 16), L->iv2);
+}
+
+/*
+ * Jobs are put to lanes and all lanes advance till the shortest one is done.
+ * The finished lane is replaced by the next job. Free lanes of a step spin
+ * on a scratch block. The last job is finished alone.
+ */
+static void AES_NI_TARGET aes_ni_ige_many (TGLC_aes_ige_job *jobs, int n, const int enc) {
+  struct aes_ni_lane L[AES_NI_LANES];
+  unsigned char scratch[16];
+  int active = 0, next = 0, i;
+  memset (scratch, 0, 16);
+  while (1) {
+    while (active < AES_NI_LANES && next < n) {
+      TGLC_aes_ige_job *J = &jobs[next ++];
+      if (!J->key->_ni_rounds || J->length < 16) { continue; }
+      assert (!(J->length & 15));
+      struct aes_ni_lane *A = &L[active ++];
+      A->in = J->in;
+      A->out = J->out;
+      A->blocks = J->length / 16;
+      A->stride = 16;
+      A->rk = J->key->_ni_rk;
+      A->ivec = J->ivec;
+      A->iv1 = _mm_loadu_si128 ((const __m128i *) J->ivec);
+      A->iv2 = _mm_loadu_si128 ((const __m128i *) (J->ivec + 16));
+    }
+    if (!active) { break; }
+    if (active == 1 && next == n) {
+      aes_ni_lane_done (&L[0]);
+      aes_ni_ige (L[0].in, L[0].out, L[0].blocks, L[0].rk, L[0].ivec, enc);
+      break;
+    }
+
+    int width = active > 4 ? 8 : 4;
+    size_t blocks = L[0].blocks;
+    for (i = 1; i < active; i++) {
+      if (L[i].blocks < blocks) { blocks = L[i].blocks; }
+    }
+    for (i = active; i < width; i++) {
+      L[i].in = scratch;
+      L[i].out = scratch;
+      L[i].stride = 0;
+      L[i].rk = L[0].rk;
+      L[i].iv1 = L[i].iv2 = _mm_setzero_si128 ();
+    }
+    if (width == 8) {
+      aes_ni_step8 (L, blocks, enc);
+    } else {
+      aes_ni_step4 (L, blocks, enc);
+    }
+
+    for (i = 0; i < active; i++) {
+      L[i].blocks -= blocks;
+      if (!L[i].blocks) {
+        aes_ni_lane_done (&L[i]);
+        L[i --] = L[-- active];
+      }
+    }
+  }
+}
+
+void TGLC_aes_ige_encrypt_many (TGLC_aes_ige_job *jobs, int n, const int enc) {
+  int i;
+  if (aes_ni_check ()) {
+    aes_ni_ige_many (jobs, n, enc);
+  }
+  for (i = 0; i < n; i++) {
+    if (!jobs[i].key->_ni_rounds) {
+      TGLC_aes_ige_encrypt (jobs[i].in, jobs[i].out, jobs[i].length, jobs[i].key, jobs[i].ivec, enc);
+    }
+  }
+}
+
+#else
+
+int TGLC_aes_ni_set_key (const unsigned char *userKey, const int bits, TGLC_aes_key *key, const int enc) {
+  key->_ni_rounds = 0;
+  return 0;
+}
+
+void TGLC_aes_ni_ige_encrypt (const unsigned char *in, unsigned char *out, size_t length, const TGLC_aes_key *key, unsigned char *ivec, const int enc) {
+  assert (0);
+}
+
+void TGLC_aes_ige_encrypt_many (TGLC_aes_ige_job *jobs, int n, const int enc) {
+  int i;
+  for (i = 0; i < n; i++) {
+    TGLC_aes_ige_encrypt (jobs[i].in, jobs[i].out, jobs[i].length, jobs[i].key, jobs[i].ivec, enc);
+  }
+}
+
+#endif
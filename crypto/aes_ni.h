@@ -0,0 +1,36 @@
+/* 
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Vitaly Valtman 2013-2015
+*/
+
+/* Native AES-256-IGE on top of AES-NI, shared by both crypto backends.
+ * The backends call these first and fall back to their own code
+ * when the cpu has no AES instructions.
+ * TGLC_aes_ige_encrypt_many lives there too, for both backends. */
+
+#ifndef __TGL_CRYPTO_AES_NI_H__
+#define __TGL_CRYPTO_AES_NI_H__
+
+#include "aes.h"
+
+/* Returns 1 and fills native round keys in key if AES-NI can be used, 0 otherwise. */
+int TGLC_aes_ni_set_key (const unsigned char *userKey, const int bits, TGLC_aes_key *key, const int enc);
+/* key must have been set up by TGLC_aes_ni_set_key. */
+void TGLC_aes_ni_ige_encrypt (const unsigned char *in, unsigned char *out, size_t length, const TGLC_aes_key *key, unsigned char *ivec, const int enc);
+
+#endif
@@ -25,23 +25,34 @@
 #include <openssl/aes.h>
 
 #include "aes.h"
+#include "aes_ni.h"
 #include "meta.h"
 
-typedef char check_struct_sizes[(sizeof (AES_KEY) == sizeof (TGLC_aes_key)) - 1];
+typedef char check_struct_sizes[(sizeof (AES_KEY) == sizeof (((TGLC_aes_key *)0)->_dummy)) - 1];
 
 TGLC_WRAPPER_ASSOC(aes_key,AES_KEY)
 
 void TGLC_aes_set_encrypt_key (const unsigned char *userKey, const int bits, TGLC_aes_key *key) {
+  if (TGLC_aes_ni_set_key (userKey, bits, key, 1)) {
+    return;
+  }
   int success = AES_set_encrypt_key(userKey, bits, unwrap_aes_key (key));
   assert (0 == success);
 }
 
 void TGLC_aes_set_decrypt_key (const unsigned char *userKey, const int bits, TGLC_aes_key *key) {
+  if (TGLC_aes_ni_set_key (userKey, bits, key, 0)) {
+    return;
+  }
   int success = AES_set_decrypt_key(userKey, bits, unwrap_aes_key (key));
   assert (0 == success);
 }
 
 void TGLC_aes_ige_encrypt (const unsigned char *in, unsigned char *out, size_t length, const TGLC_aes_key *key, unsigned char *ivec, const int enc) {
+  if (key->_ni_rounds) {
+    TGLC_aes_ni_ige_encrypt (in, out, length, key, ivec, enc);
+    return;
+  }
   AES_ige_encrypt (in, out, length, unwrap_aes_key (key), ivec, enc);
 }
 
@@ -26,4 +26,7 @@
 void TGLC_sha1 (const unsigned char *d, size_t n, unsigned char *md);
 void TGLC_sha256 (const unsigned char *d, size_t n, unsigned char *md);
 
+/* Four SHA-1 of messages of the same length at once, for key derivation. */
+void TGLC_sha1_x4 (const unsigned char *d[4], size_t n, unsigned char *md[4]);
+
 #endif
@@ -30,11 +30,20 @@
 #include <gcrypt.h>
 
 #include "sha.h"
+#include "sha_ni.h"
 
 void TGLC_sha1 (const unsigned char *d, size_t n, unsigned char *md) {
+  if (TGLC_sha_ni_available ()) {
+    TGLC_sha1_ni (d, n, md);
+    return;
+  }
   gcry_md_hash_buffer (GCRY_MD_SHA1, md, d, n);
 }
 void TGLC_sha256 (const unsigned char *d, size_t n, unsigned char *md) {
+  if (TGLC_sha_ni_available ()) {
+    TGLC_sha256_ni (d, n, md);
+    return;
+  }
   gcry_md_hash_buffer (GCRY_MD_SHA256, md, d, n);
 }
 
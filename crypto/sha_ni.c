@@ -0,0 +1,287 @@
+/* 
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Vitaly Valtman 2013-2015
+*/
+
+#include "../config.h"
+
+#include <string.h>
+
+#include "sha.h"
+#include "sha_ni.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+#ifndef bit_SHA
+#define bit_SHA (1 << 29)
+#endif
+
+static const unsigned int sha256_k[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* Pads last n % 64 bytes of the message of n bytes to tail, returns number of tail blocks. */
+static int sha_tail (const unsigned char *d, size_t n, unsigned char tail[128]) {
+  int r = n & 63;
+  int blocks = r < 56 ? 1 : 2;
+  memset (tail, 0, 128);
+  memcpy (tail, d + n - r, r);
+  tail[r] = 0x80;
+  unsigned long long bits = (unsigned long long) n << 3;
+  int i;
+  for (i = 0; i < 8; i++) {
+    tail[64 * blocks - 1 - i] = bits >> (8 * i);
+  }
+  return blocks;
+}
+
+static void sha_store_be (unsigned char *md, const unsigned int *state, int words) {
+  int i;
+  for (i = 0; i < words; i++) {
+    md[4 * i] = state[i] >> 24;
+    md[4 * i + 1] = state[i] >> 16;
+    md[4 * i + 2] = state[i] >> 8;
+    md[4 * i + 3] = state[i];
+  }
+}
+
+#define SHA_NI_TARGET __attribute__ ((target ("sha,sse4.1")))
+#define SHA_SSE2_TARGET __attribute__ ((target ("sse2")))
+
+static int sha_ni_supported = -1;
+
+// may be called from several threads, so the result is stored once
+int TGLC_sha_ni_available (void) {
+  int r = __atomic_load_n (&sha_ni_supported, __ATOMIC_RELAXED);
+  if (r < 0) {
+    unsigned a, b, c, d;
+    r = 0;
+    if (__get_cpuid_max (0, 0) >= 7 && __get_cpuid (1, &a, &b, &c, &d) && (c & bit_SSSE3) && (c & bit_SSE4_1)) {
+      __cpuid_count (7, 0, a, b, c, d);
+      r = (b & bit_SHA) ? 1 : 0;
+    }
+    __atomic_store_n (&sha_ni_supported, r, __ATOMIC_RELAXED);
+  }
+  return r;
+}
+
+/*
+ * Four rounds of SHA-1 for g-th quarter of a block. Message schedule of the next
+ * rounds is computed on the fly, as in the Intel SHA extensions paper.
+ */
+#define SHA1_NI_GROUP(g,E,F) \
+  E = (g) ? _mm_sha1nexte_epu32 (E, M[(g) & 3]) : _mm_add_epi32 (E, M[0]); \
+  F = ABCD; \
+  if ((g) >= 3 && (g) <= 18) { M[((g) + 1) & 3] = _mm_sha1msg2_epu32 (M[((g) + 1) & 3], M[(g) & 3]); } \
+  ABCD = _mm_sha1rnds4_epu32 (ABCD, E, (g) / 5); \
+  if ((g) >= 1 && (g) <= 16) { M[((g) + 3) & 3] = _mm_sha1msg1_epu32 (M[((g) + 3) & 3], M[(g) & 3]); } \
+  if ((g) >= 2 && (g) <= 17) { M[((g) + 2) & 3] = _mm_xor_si128 (M[((g) + 2) & 3], M[(g) & 3]); }
+
+static void SHA_NI_TARGET sha1_ni_blocks (unsigned int state[5], const unsigned char *d, size_t blocks) {
+  const __m128i MASK = _mm_set_epi64x (0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i ABCD = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) state), 0x1b);
+  __m128i E0 = _mm_set_epi32 (state[4], 0, 0, 0), E1;
+  __m128i M[4];
+  int i;
+  while (blocks --) {
+    __m128i ABCD_SAVE = ABCD, E0_SAVE = E0;
+    for (i = 0; i < 4; i++) {
+      M[i] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (d + 16 * i)), MASK);
+    }
+    SHA1_NI_GROUP (0, E0, E1) SHA1_NI_GROUP (1, E1, E0) SHA1_NI_GROUP (2, E0, E1) SHA1_NI_GROUP (3, E1, E0)
+    SHA1_NI_GROUP (4, E0, E1) SHA1_NI_GROUP (5, E1, E0) SHA1_NI_GROUP (6, E0, E1) SHA1_NI_GROUP (7, E1, E0)
+    SHA1_NI_GROUP (8, E0, E1) SHA1_NI_GROUP (9, E1, E0) SHA1_NI_GROUP (10, E0, E1) SHA1_NI_GROUP (11, E1, E0)
+    SHA1_NI_GROUP (12, E0, E1) SHA1_NI_GROUP (13, E1, E0) SHA1_NI_GROUP (14, E0, E1) SHA1_NI_GROUP (15, E1, E0)
+    SHA1_NI_GROUP (16, E0, E1) SHA1_NI_GROUP (17, E1, E0) SHA1_NI_GROUP (18, E0, E1) SHA1_NI_GROUP (19, E1, E0)
+    E0 = _mm_sha1nexte_epu32 (E0, E0_SAVE);
+    ABCD = _mm_add_epi32 (ABCD, ABCD_SAVE);
+    d += 64;
+  }
+  _mm_storeu_si128 ((__m128i *) state, _mm_shuffle_epi32 (ABCD, 0x1b));
+  state[4] = _mm_extract_epi32 (E0, 3);
+}
+
+/* Four rounds of SHA-256, same scheme. */
+#define SHA256_NI_GROUP(g) \
+  T = _mm_add_epi32 (M[(g) & 3], _mm_loadu_si128 ((const __m128i *) (sha256_k + 4 * (g)))); \
+  S1 = _mm_sha256rnds2_epu32 (S1, S0, T); \
+  if ((g) >= 3 && (g) <= 14) { \
+    M[((g) + 1) & 3] = _mm_add_epi32 (M[((g) + 1) & 3], _mm_alignr_epi8 (M[(g) & 3], M[((g) + 3) & 3], 4)); \
+    M[((g) + 1) & 3] = _mm_sha256msg2_epu32 (M[((g) + 1) & 3], M[(g) & 3]); \
+  } \
+  S0 = _mm_sha256rnds2_epu32 (S0, S1, _mm_shuffle_epi32 (T, 0x0e)); \
+  if ((g) >= 1 && (g) <= 12) { M[((g) + 3) & 3] = _mm_sha256msg1_epu32 (M[((g) + 3) & 3], M[(g) & 3]); }
+
+static void SHA_NI_TARGET sha256_ni_blocks (unsigned int state[8], const unsigned char *d, size_t blocks) {
+  const __m128i MASK = _mm_set_epi64x (0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+  __m128i T = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) state), 0xb1);
+  __m128i S1 = _mm_shuffle_epi32 (_mm_loadu_si128 ((const __m128i *) (state + 4)), 0x1b);
+  __m128i S0 = _mm_alignr_epi8 (T, S1, 8);
+  S1 = _mm_blend_epi16 (S1, T, 0xf0);
+  __m128i M[4];
+  int i;
+  while (blocks --) {
+    __m128i S0_SAVE = S0, S1_SAVE = S1;
+    for (i = 0; i < 4; i++) {
+      M[i] = _mm_shuffle_epi8 (_mm_loadu_si128 ((const __m128i *) (d + 16 * i)), MASK);
+    }
+    SHA256_NI_GROUP (0) SHA256_NI_GROUP (1) SHA256_NI_GROUP (2) SHA256_NI_GROUP (3)
+    SHA256_NI_GROUP (4) SHA256_NI_GROUP (5) SHA256_NI_GROUP (6) SHA256_NI_GROUP (7)
+    SHA256_NI_GROUP (8) SHA256_NI_GROUP (9) SHA256_NI_GROUP (10) SHA256_NI_GROUP (11)
+    SHA256_NI_GROUP (12) SHA256_NI_GROUP (13) SHA256_NI_GROUP (14) SHA256_NI_GROUP (15)
+    S0 = _mm_add_epi32 (S0, S0_SAVE);
+    S1 = _mm_add_epi32 (S1, S1_SAVE);
+    d += 64;
+  }
+  T = _mm_shuffle_epi32 (S0, 0x1b);
+  S1 = _mm_shuffle_epi32 (S1, 0xb1);
+  _mm_storeu_si128 ((__m128i *) state, _mm_blend_epi16 (T, S1, 0xf0));
+  _mm_storeu_si128 ((__m128i *) (state + 4), _mm_alignr_epi8 (S1, T, 8));
+}
+
+void TGLC_sha1_ni (const unsigned char *d, size_t n, unsigned char *md) {
+  unsigned int state[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+  unsigned char tail[128];
+  sha1_ni_blocks (state, d, n / 64);
+  sha1_ni_blocks (state, tail, sha_tail (d, n, tail));
+  sha_store_be (md, state, 5);
+}
+
+void TGLC_sha256_ni (const unsigned char *d, size_t n, unsigned char *md) {
+  unsigned int state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+  unsigned char tail[128];
+  sha256_ni_blocks (state, d, n / 64);
+  sha256_ni_blocks (state, tail, sha_tail (d, n, tail));
+  sha_store_be (md, state, 8);
+}
+
+/*
+ * Without SHA extensions the four hashes go in four 32-bit lanes of SSE2 registers.
+ */
+#define SHA_X4_ROTL(x,n) _mm_or_si128 (_mm_slli_epi32 (x, n), _mm_srli_epi32 (x, 32 - (n)))
+
+static void SHA_SSE2_TARGET sha1_x4_sse2 (const unsigned char *d[4], size_t n, unsigned char *md[4]) {
+  static const unsigned int K[4] = { 0x5a827999, 0x6ed9eba1, 0x8f1bbcdc, 0xca62c1d6 };
+  unsigned char tail[4][128];
+  int tail_blocks = 0, l, t;
+  for (l = 0; l < 4; l++) {
+    tail_blocks = sha_tail (d[l], n, tail[l]);
+  }
+  __m128i H[5] = {
+    _mm_set1_epi32 (0x67452301), _mm_set1_epi32 (0xefcdab89), _mm_set1_epi32 (0x98badcfe),
+    _mm_set1_epi32 (0x10325476), _mm_set1_epi32 (0xc3d2e1f0)
+  };
+  size_t full = n / 64, blk;
+  for (blk = 0; blk < full + tail_blocks; blk++) {
+    const unsigned char *p[4];
+    for (l = 0; l < 4; l++) {
+      p[l] = blk < full ? d[l] + 64 * blk : tail[l] + 64 * (blk - full);
+    }
+    __m128i W[16];
+    for (t = 0; t < 16; t++) {
+      unsigned int w[4];
+      for (l = 0; l < 4; l++) {
+        const unsigned char *q = p[l] + 4 * t;
+        w[l] = ((unsigned) q[0] << 24) | ((unsigned) q[1] << 16) | ((unsigned) q[2] << 8) | q[3];
+      }
+      W[t] = _mm_set_epi32 (w[3], w[2], w[1], w[0]);
+    }
+    __m128i a = H[0], b = H[1], c = H[2], e = H[4], dd = H[3];
+    for (t = 0; t < 80; t++) {
+      if (t >= 16) {
+        __m128i x = _mm_xor_si128 (_mm_xor_si128 (W[(t - 3) & 15], W[(t - 8) & 15]), _mm_xor_si128 (W[(t - 14) & 15], W[t & 15]));
+        W[t & 15] = SHA_X4_ROTL (x, 1);
+      }
+      __m128i f;
+      if (t < 20) {
+        f = _mm_xor_si128 (dd, _mm_and_si128 (b, _mm_xor_si128 (c, dd)));
+      } else if (t < 40 || t >= 60) {
+        f = _mm_xor_si128 (_mm_xor_si128 (b, c), dd);
+      } else {
+        f = _mm_or_si128 (_mm_and_si128 (b, c), _mm_and_si128 (dd, _mm_or_si128 (b, c)));
+      }
+      __m128i x = _mm_add_epi32 (_mm_add_epi32 (SHA_X4_ROTL (a, 5), f), _mm_add_epi32 (e, W[t & 15]));
+      x = _mm_add_epi32 (x, _mm_set1_epi32 (K[t / 20]));
+      e = dd;
+      dd = c;
+      c = SHA_X4_ROTL (b, 30);
+      b = a;
+      a = x;
+    }
+    H[0] = _mm_add_epi32 (H[0], a);
+    H[1] = _mm_add_epi32 (H[1], b);
+    H[2] = _mm_add_epi32 (H[2], c);
+    H[3] = _mm_add_epi32 (H[3], dd);
+    H[4] = _mm_add_epi32 (H[4], e);
+  }
+  unsigned int out[5][4];
+  for (t = 0; t < 5; t++) {
+    _mm_storeu_si128 ((__m128i *) out[t], H[t]);
+  }
+  for (l = 0; l < 4; l++) {
+    unsigned int state[5];
+    for (t = 0; t < 5; t++) {
+      state[t] = out[t][l];
+    }
+    sha_store_be (md[l], state, 5);
+  }
+}
+
+void TGLC_sha1_x4 (const unsigned char *d[4], size_t n, unsigned char *md[4]) {
+  int i;
+  if (TGLC_sha_ni_available ()) {
+    for (i = 0; i < 4; i++) {
+      TGLC_sha1_ni (d[i], n, md[i]);
+    }
+  } else {
+    sha1_x4_sse2 (d, n, md);
+  }
+}
+
+#else
+
+int TGLC_sha_ni_available (void) {
+  return 0;
+}
+
+void TGLC_sha1_ni (const unsigned char *d, size_t n, unsigned char *md) {
+  TGLC_sha1 (d, n, md);
+}
+
+void TGLC_sha256_ni (const unsigned char *d, size_t n, unsigned char *md) {
+  TGLC_sha256 (d, n, md);
+}
+
+void TGLC_sha1_x4 (const unsigned char *d[4], size_t n, unsigned char *md[4]) {
+  int i;
+  for (i = 0; i < 4; i++) {
+    TGLC_sha1 (d[i], n, md[i]);
+  }
+}
+
+#endif
@@ -0,0 +1,33 @@
+/* 
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Vitaly Valtman 2013-2015
+*/
+
+/* SHA-1 and SHA-256 on top of SHA extensions, shared by both crypto backends.
+ * The backends use them when TGLC_sha_ni_available () says so. */
+
+#ifndef __TGL_CRYPTO_SHA_NI_H__
+#define __TGL_CRYPTO_SHA_NI_H__
+
+#include "sha.h"
+
+int TGLC_sha_ni_available (void);
+void TGLC_sha1_ni (const unsigned char *d, size_t n, unsigned char *md);
+void TGLC_sha256_ni (const unsigned char *d, size_t n, unsigned char *md);
+
+#endif
@@ -25,11 +25,20 @@
 #include <openssl/sha.h>
 
 #include "sha.h"
+#include "sha_ni.h"
 
 void TGLC_sha1 (const unsigned char *d, size_t n, unsigned char *md) {
+  if (TGLC_sha_ni_available ()) {
+    TGLC_sha1_ni (d, n, md);
+    return;
+  }
   SHA1 (d, n, md);
 }
 void TGLC_sha256 (const unsigned char *d, size_t n, unsigned char *md) {
+  if (TGLC_sha_ni_available ()) {
+    TGLC_sha256_ni (d, n, md);
+    return;
+  }
   SHA256 (d, n, md);
 }
 
@@ -65,6 +65,9 @@
 #include "tgl-methods-in.h"
 
 #include "mtproto-common.h"
+#include "tgl-crypto-pool.h"
+#include "tgl-inflate.h"
+#include "tgl-timer-wheel.h"
 
 #define MAX_NET_RES        (1L << 16)
 //extern int log_level;
@@ -73,13 +76,14 @@ static long long generate_next_msg_id (struct tgl_state *TLS, struct tgl_dc *DC,
 static double get_server_time (struct tgl_dc *DC);
 
 // for statistic only
-static int total_packets_sent;
-static long long total_data_sent;
+static TGL_THREAD int total_packets_sent;
+static TGL_THREAD long long total_data_sent;
 
 
 static int rpc_execute (struct tgl_state *TLS, struct connection *c, int op, int len);
 static int rpc_becomes_ready (struct tgl_state *TLS, struct connection *c);
 static int rpc_close (struct tgl_state *TLS, struct connection *c);
+static void fail_connection (struct tgl_state *TLS, struct connection *c);
 
 static double get_utime (int clock_id) {
   struct timespec T;
@@ -118,17 +122,26 @@ static TGLC_rsa *rsa_load_public_key (struct tgl_state *TLS, const char *public_
  */
 
 #define ENCRYPT_BUFFER_INTS        16384
-static int encrypt_buffer[ENCRYPT_BUFFER_INTS];
+static TGL_THREAD int *encrypt_buffer;
 
 #define DECRYPT_BUFFER_INTS        16384
-static int decrypt_buffer[ENCRYPT_BUFFER_INTS];
+static TGL_THREAD int *decrypt_buffer;
+
+static void init_crypt_buffers (void) {
+  if (!encrypt_buffer) {
+    encrypt_buffer = talloc (ENCRYPT_BUFFER_INTS * 4);
+    decrypt_buffer = talloc (DECRYPT_BUFFER_INTS * 4);
+  }
+}
 
 static int encrypt_packet_buffer (struct tgl_state *TLS, struct tgl_dc *DC) {
+  init_crypt_buffers ();
   TGLC_rsa *key = TLS->rsa_key_loaded[DC->rsa_key_idx];
   return tgl_pad_rsa_encrypt (TLS, (char *) packet_buffer, (packet_ptr - packet_buffer) * 4, (char *) encrypt_buffer, ENCRYPT_BUFFER_INTS * 4, TGLC_rsa_n (key), TGLC_rsa_e (key));
 }
 
 static int encrypt_packet_buffer_aes_unauth (const char server_nonce[16], const char hidden_client_nonce[32]) {
+  init_crypt_buffers ();
   tgl_init_aes_unauth (server_nonce, hidden_client_nonce, 1);
   return tgl_pad_aes_encrypt ((char *) packet_buffer, (packet_ptr - packet_buffer) * 4, (char *) encrypt_buffer, ENCRYPT_BUFFER_INTS * 4);
 }
@@ -137,11 +150,11 @@ static int encrypt_packet_buffer_aes_unauth (const char server_nonce[16], const
 // Used in unauthorized part of protocol
 //
 static int rpc_send_packet (struct tgl_state *TLS, struct connection *c) {
-  static struct {
+  struct {
     long long auth_key_id;
     long long out_msg_id;
     int msg_len;
-  } unenc_msg_header;
+  } unenc_msg_header = { 0 };
 
   int len = (packet_ptr - packet_buffer) * 4;
   TLS->net_methods->incr_out_packet_num (c);
@@ -171,26 +184,6 @@ static int rpc_send_packet (struct tgl_state *TLS, struct connection *c) {
   return 1;
 }
 
-static int rpc_send_message (struct tgl_state *TLS, struct connection *c, void *data, int len) {
-  assert (len > 0 && !(len & 0xfc000003));
-
-  int total_len = len >> 2;
-  if (total_len < 0x7f) {
-    assert (TLS->net_methods->write_out (c, &total_len, 1) == 1);
-  } else {
-    total_len = (total_len << 8) | 0x7f;
-    assert (TLS->net_methods->write_out (c, &total_len, 4) == 4);
-  }
-
-  TLS->net_methods->incr_out_packet_num (c);
-  assert (TLS->net_methods->write_out (c, data, len) == len);
-  TLS->net_methods->flush_out (c);
-
-  total_packets_sent ++;
-  total_data_sent += total_len;
-  return 1;
-}
-
 //
 // State machine. See description at
 // https://core.telegram.org/mtproto/auth_key
@@ -212,6 +205,27 @@ static int check_unauthorized_header (struct tgl_state *TLS) {
   return 0;
 }
 
+/*
+ * The next temporary key is negotiated on a side session while the current one
+ * is still in use. Its state, key and salt live in next_temp_* fields of the DC,
+ * nonces are shared: the main handshake is idle while the DC is authorized.
+ */
+static enum tgl_dc_state *session_state (struct tgl_session *S) {
+  return (S->flags & TGLSF_NEXT_TEMP_KEY) ? &S->dc->next_temp_state : &S->dc->state;
+}
+
+static char *session_temp_key (struct tgl_session *S) {
+  return (S->flags & TGLSF_NEXT_TEMP_KEY) ? S->dc->next_temp_auth_key : S->dc->temp_auth_key;
+}
+
+static long long *session_temp_key_id (struct tgl_session *S) {
+  return (S->flags & TGLSF_NEXT_TEMP_KEY) ? &S->dc->next_temp_auth_key_id : &S->dc->temp_auth_key_id;
+}
+
+static long long *session_server_salt (struct tgl_session *S) {
+  return (S->flags & TGLSF_NEXT_TEMP_KEY) ? &S->dc->next_temp_server_salt : &S->dc->server_salt;
+}
+
 /* {{{ REQ_PQ */
 // req_pq#60469778 nonce:int128 = ResPQ
 static int send_req_pq_packet (struct tgl_state *TLS, struct connection *c) {
@@ -231,7 +245,8 @@ static int send_req_pq_packet (struct tgl_state *TLS, struct connection *c) {
 // req_pq#60469778 nonce:int128 = ResPQ
 static int send_req_pq_temp_packet (struct tgl_state *TLS, struct connection *c) {
   struct tgl_dc *DC = TLS->net_methods->get_dc (c);
-  assert (DC->state == st_authorized);
+  struct tgl_session *S = TLS->net_methods->get_session (c);
+  assert (*session_state (S) == st_authorized);
 
   tglt_secure_random (DC->nonce, 16);
   clear_packet ();
@@ -239,7 +254,7 @@ static int send_req_pq_temp_packet (struct tgl_state *TLS, struct connection *c)
   out_ints ((int *)DC->nonce, 4);
   rpc_send_packet (TLS, c);
 
-  DC->state = st_reqpq_sent_temp;
+  *session_state (S) = st_reqpq_sent_temp;
   return 1;
 }
 /* }}} */
@@ -248,12 +263,17 @@ static int send_req_pq_temp_packet (struct tgl_state *TLS, struct connection *c)
 // req_DH_params#d712e4be nonce:int128 server_nonce:int128 p:string q:string public_key_fingerprint:long encrypted_data:string = Server_DH_Params;
 // p_q_inner_data#83c95aec pq:string p:string q:string nonce:int128 server_nonce:int128 new_nonce:int256 = P_Q_inner_data;
 // p_q_inner_data_temp#3c6a84d4 pq:string p:string q:string nonce:int128 server_nonce:int128 new_nonce:int256 expires_in:int = P_Q_inner_data;
-static void send_req_dh_packet (struct tgl_state *TLS, struct connection *c, TGLC_bn *pq, int temp_key) {
+// returns -1 if pq can not be factorized
+static int send_req_dh_packet (struct tgl_state *TLS, struct connection *c, TGLC_bn *pq, int temp_key) {
   struct tgl_dc *DC = TLS->net_methods->get_dc (c);
 
   TGLC_bn *p = TGLC_bn_new ();
   TGLC_bn *q = TGLC_bn_new ();
-  assert (bn_factorize (pq, p, q) >= 0);
+  if (bn_factorize (pq, p, q) < 0) {
+    TGLC_bn_free (p);
+    TGLC_bn_free (q);
+    return -1;
+  }
 
   clear_packet ();
   packet_ptr += 5;
@@ -286,8 +306,9 @@ static void send_req_dh_packet (struct tgl_state *TLS, struct connection *c, TGL
 
   TGLC_bn_free (p);
   TGLC_bn_free (q);
-  DC->state = temp_key ? st_reqdh_sent_temp : st_reqdh_sent;
+  *session_state (TLS->net_methods->get_session (c)) = temp_key ? st_reqdh_sent_temp : st_reqdh_sent;
   rpc_send_packet (TLS, c);
+  return 0;
 }
 /* }}} */
 
@@ -296,6 +317,7 @@ static void send_req_dh_packet (struct tgl_state *TLS, struct connection *c, TGL
 // client_DH_inner_data#6643b654 nonce:int128 server_nonce:int128 retry_id:long g_b:string = Client_DH_Inner_Data
 static void send_dh_params (struct tgl_state *TLS, struct connection *c, TGLC_bn *dh_prime, TGLC_bn *g_a, int g, int temp_key) {
   struct tgl_dc *DC = TLS->net_methods->get_dc (c);
+  struct tgl_session *S = TLS->net_methods->get_session (c);
 
   clear_packet ();
   packet_ptr += 5;
@@ -307,7 +329,7 @@ static void send_dh_params (struct tgl_state *TLS, struct connection *c, TGLC_bn
   TGLC_bn *dh_g = TGLC_bn_new ();
   ensure (TGLC_bn_set_word (dh_g, g));
 
-  static unsigned char s_power[256];
+  unsigned char s_power[256];
   tglt_secure_random (s_power, 256);
   TGLC_bn *dh_power = TGLC_bn_bin2bn ((unsigned char *)s_power, 256, 0);
   ensure_ptr (dh_power);
@@ -322,9 +344,9 @@ static void send_dh_params (struct tgl_state *TLS, struct connection *c, TGLC_bn
   ensure (TGLC_bn_mod_exp (auth_key_num, g_a, dh_power, dh_prime, TLS->TGLC_bn_ctx));
   int l = TGLC_bn_num_bytes (auth_key_num);
   assert (l >= 250 && l <= 256);
-  assert (TGLC_bn_bn2bin (auth_key_num, (unsigned char *)(temp_key ? DC->temp_auth_key : DC->auth_key)));
+  char *key = temp_key ? session_temp_key (S) : DC->auth_key;
+  assert (TGLC_bn_bn2bin (auth_key_num, (unsigned char *)key));
   if (l < 256) {
-    char *key = temp_key ? DC->temp_auth_key : DC->auth_key;
     memmove (key + 256 - l, key, l);
     memset (key, 0, 256 - l);
   }
@@ -343,25 +365,26 @@ static void send_dh_params (struct tgl_state *TLS, struct connection *c, TGLC_bn
   out_ints ((int *) DC->server_nonce, 4);
   out_cstring ((char *) encrypt_buffer, l);
 
-  DC->state = temp_key ? st_client_dh_sent_temp : st_client_dh_sent;;
+  *session_state (S) = temp_key ? st_client_dh_sent_temp : st_client_dh_sent;
   rpc_send_packet (TLS, c);
 }
 /* }}} */
 
 /* {{{ RECV RESPQ */
 // resPQ#05162463 nonce:int128 server_nonce:int128 pq:string server_public_key_fingerprints:Vector long = ResPQ
+// returns -1 if the connection is failed (and freed)
 static int process_respq_answer (struct tgl_state *TLS, struct connection *c, char *packet, int len, int temp_key) {
   assert (!(len & 3));
   in_ptr = (int *)packet;
   in_end = in_ptr + (len / 4);
   if (check_unauthorized_header (TLS) < 0) {
-    return -1;
+    return 0;
   }
 
   int *in_save = in_ptr;
   if (skip_type_any (TYPE_TO_PARAM (res_p_q)) < 0 || in_ptr != in_end) {
     vlogprintf (E_ERROR, "can not parse req_p_q answer\n");
-    return -1;
+    return 0;
   }
   in_ptr = in_save;
 
@@ -369,11 +392,11 @@ static int process_respq_answer (struct tgl_state *TLS, struct connection *c, ch
 
   assert (fetch_int() == CODE_res_p_q);
 
-  static int tmp[4];
+  int tmp[4];
   fetch_ints (tmp, 4);
   if (memcmp (tmp, DC->nonce, 16)) {
     vlogprintf (E_ERROR, "nonce mismatch\n");
-    return -1;
+    return 0;
   }
   fetch_ints (DC->server_nonce, 4);
 
@@ -401,10 +424,16 @@ static int process_respq_answer (struct tgl_state *TLS, struct connection *c, ch
   assert (in_ptr == in_end);
   if (DC->rsa_key_idx == -1) {
     vlogprintf (E_ERROR, "fatal: don't have any matching keys\n");
-    return -1;
+    TGLC_bn_free (pq);
+    return 0;
   }
 
-  send_req_dh_packet (TLS, c, pq, temp_key);
+  if (send_req_dh_packet (TLS, c, pq, temp_key) < 0) {
+    vlogprintf (E_ERROR, "can not factorize pq from dc %d, restarting handshake\n", DC->id);
+    TGLC_bn_free (pq);
+    fail_connection (TLS, c);
+    return -1;
+  }
 
   TGLC_bn_free (pq);
   return 1;
@@ -462,6 +491,7 @@ static int process_dh_answer (struct tgl_state *TLS, struct connection *c, char
     vlogprintf (E_ERROR, "non-empty encrypted part expected\n");
     return -1;
   }
+  init_crypt_buffers ();
   l = tgl_pad_aes_decrypt (fetch_str (l), l, (char *) decrypt_buffer, DECRYPT_BUFFER_INTS * 4 - 16);
   assert (in_ptr == in_end);
 
@@ -505,7 +535,7 @@ static int process_dh_answer (struct tgl_state *TLS, struct connection *c, char
   int server_time = fetch_int ();
   assert (in_ptr <= in_end);
 
-  static char sha1_buffer[20];
+  char sha1_buffer[20];
   TGLC_sha1 ((unsigned char *) decrypt_buffer + 20, (in_ptr - decrypt_buffer - 5) * 4, (unsigned char *) sha1_buffer);
   if (memcmp (decrypt_buffer, sha1_buffer, 20)) {
     vlogprintf (E_ERROR, "bad encrypted message SHA1\n");
@@ -534,7 +564,7 @@ static void create_temp_auth_key (struct tgl_state *TLS, struct connection *c) {
 }
 
 int tglmp_encrypt_inner_temp (struct tgl_state *TLS, struct connection *c, int *msg, int msg_ints, int useful, void *data, long long msg_id);
-static long long msg_id_override;
+static TGL_THREAD long long msg_id_override;
 static void mpc_on_get_config (struct tgl_state *TLS, void *extra, int success);
 static void bind_temp_auth_key (struct tgl_state *TLS, struct connection *c);
 
@@ -545,6 +575,7 @@ static void bind_temp_auth_key (struct tgl_state *TLS, struct connection *c);
 // dh_gen_fail#a69dae02 nonce:int128 server_nonce:int128 new_nonce_hash3:int128 = Set_client_DH_params_answer;
 static int process_auth_complete (struct tgl_state *TLS, struct connection *c, char *packet, int len, int temp_key) {
   struct tgl_dc *DC = TLS->net_methods->get_dc (c);
+  struct tgl_session *S = TLS->net_methods->get_session (c);
 
   assert (!(len & 3));
   in_ptr = (int *)packet;
@@ -581,13 +612,13 @@ static int process_auth_complete (struct tgl_state *TLS, struct connection *c, c
 
   fetch_ints (tmp, 4);
 
-  static unsigned char th[44], sha1_buffer[20];
+  unsigned char th[44], sha1_buffer[20];
   memcpy (th, DC->new_nonce, 32);
   th[32] = 1;
   if (!temp_key) {
     TGLC_sha1 ((unsigned char *)DC->auth_key, 256, sha1_buffer);
   } else {
-    TGLC_sha1 ((unsigned char *)DC->temp_auth_key, 256, sha1_buffer);
+    TGLC_sha1 ((unsigned char *)session_temp_key (S), 256, sha1_buffer);
   }
   memcpy (th + 33, sha1_buffer, 8);
   TGLC_sha1 (th, 41, sha1_buffer);
@@ -600,13 +631,13 @@ static int process_auth_complete (struct tgl_state *TLS, struct connection *c, c
     bl_do_set_auth_key (TLS, DC->id, (unsigned char *)DC->auth_key);
     TGLC_sha1 ((unsigned char *)DC->auth_key, 256, sha1_buffer);
   } else {
-    TGLC_sha1 ((unsigned char *)DC->temp_auth_key, 256, sha1_buffer);
-    DC->temp_auth_key_id = *(long long *)(sha1_buffer + 12);
+    TGLC_sha1 ((unsigned char *)session_temp_key (S), 256, sha1_buffer);
+    *session_temp_key_id (S) = *(long long *)(sha1_buffer + 12);
   }
 
-  DC->server_salt = *(long long *)DC->server_nonce ^ *(long long *)DC->new_nonce;
+  *session_server_salt (S) = *(long long *)DC->server_nonce ^ *(long long *)DC->new_nonce;
 
-  DC->state = st_authorized;
+  *session_state (S) = st_authorized;
 
   vlogprintf (E_DEBUG, "Auth success\n");
   if (temp_key) {
@@ -632,10 +663,12 @@ static int process_auth_complete (struct tgl_state *TLS, struct connection *c, c
 
 static void bind_temp_auth_key (struct tgl_state *TLS, struct connection *c) {
   struct tgl_dc *DC = TLS->net_methods->get_dc (c);
-  if (DC->temp_auth_key_bind_query_id) {
-    tglq_query_delete (TLS, DC->temp_auth_key_bind_query_id);
-  }
   struct tgl_session *S = TLS->net_methods->get_session (c);
+  int next = S->flags & TGLSF_NEXT_TEMP_KEY;
+  long long *bind_query_id = next ? &DC->next_temp_bind_query_id : &DC->temp_auth_key_bind_query_id;
+  if (*bind_query_id) {
+    tglq_query_delete (TLS, *bind_query_id);
+  }
   long long msg_id = generate_next_msg_id (TLS, DC, S);
 
   clear_packet ();
@@ -643,7 +676,7 @@ static void bind_temp_auth_key (struct tgl_state *TLS, struct connection *c) {
   long long rand;
   tglt_secure_random (&rand, 8);
   out_long (rand);
-  out_long (DC->temp_auth_key_id);
+  out_long (*session_temp_key_id (S));
   out_long (DC->auth_key_id);
 
   if (!S->session_id) {
@@ -653,11 +686,11 @@ static void bind_temp_auth_key (struct tgl_state *TLS, struct connection *c) {
   int expires = time (0) + DC->server_time_delta + TLS->temp_key_expire_time;
   out_int (expires);
 
-  static int data[1000];
+  int data[1000];
   int len = tglmp_encrypt_inner_temp (TLS, c, packet_buffer, packet_ptr - packet_buffer, 0, data, msg_id);
   msg_id_override = msg_id;
-  DC->temp_auth_key_bind_query_id = msg_id;
-  tgl_do_send_bind_temp_key (TLS, DC, rand, expires, (void *)data, len, msg_id);
+  *bind_query_id = msg_id;
+  tgl_do_send_bind_temp_key (TLS, DC, rand, expires, (void *)data, len, msg_id, next ? QUERY_NEXT_TEMP_KEY : 0);
   msg_id_override = 0;
 }
 
@@ -667,8 +700,6 @@ static void bind_temp_auth_key (struct tgl_state *TLS, struct connection *c) {
  *
  */
 
-static struct encrypted_message enc_msg;
-
 static double get_server_time (struct tgl_dc *DC) {
   //if (!DC->server_time_udelta) {
   //  DC->server_time_udelta = get_utime (CLOCK_REALTIME) - get_utime (CLOCK_MONOTONIC);
@@ -686,48 +717,286 @@ static long long generate_next_msg_id (struct tgl_state *TLS, struct tgl_dc *DC,
   return next_id;
 }
 
-static void init_enc_msg (struct tgl_state *TLS, struct tgl_session *S, int useful) {
+static void init_enc_msg_header (struct tgl_state *TLS, struct tgl_session *S, struct encrypted_header *H) {
   struct tgl_dc *DC = S->dc;
-  assert (DC->state == st_authorized);
-  assert (DC->temp_auth_key_id);
-  vlogprintf (E_DEBUG, "temp_auth_key_id = 0x%016" INT64_PRINTF_MODIFIER "x, auth_key_id = 0x%016" INT64_PRINTF_MODIFIER "x\n", DC->temp_auth_key_id, DC->auth_key_id);
-  enc_msg.auth_key_id = DC->temp_auth_key_id;
-  enc_msg.server_salt = DC->server_salt;
+  assert (*session_state (S) == st_authorized);
+  assert (*session_temp_key_id (S));
+  vlogprintf (E_DEBUG, "temp_auth_key_id = 0x%016" INT64_PRINTF_MODIFIER "x, auth_key_id = 0x%016" INT64_PRINTF_MODIFIER "x\n", *session_temp_key_id (S), DC->auth_key_id);
+  H->auth_key_id = *session_temp_key_id (S);
+  H->server_salt = *session_server_salt (S);
   if (!S->session_id) {
     tglt_secure_random (&S->session_id, 8);
   }
-  enc_msg.session_id = S->session_id;
-  enc_msg.msg_id = msg_id_override ? msg_id_override : generate_next_msg_id (TLS, DC, S);
-  enc_msg.seq_no = S->seq_no;
+  H->session_id = S->session_id;
+}
+
+static void init_enc_msg (struct tgl_state *TLS, struct tgl_session *S, struct encrypted_header *H, int useful) {
+  struct tgl_dc *DC = S->dc;
+  init_enc_msg_header (TLS, S, H);
+  H->msg_id = msg_id_override ? msg_id_override : generate_next_msg_id (TLS, DC, S);
+  H->seq_no = S->seq_no;
   if (useful) {
-    enc_msg.seq_no |= 1;
+    H->seq_no |= 1;
   }
   S->seq_no += 2;
 };
 
-static void init_enc_msg_inner_temp (struct tgl_dc *DC, long long msg_id) {
-  enc_msg.auth_key_id = DC->auth_key_id;
-  tglt_secure_random (&enc_msg.server_salt, 8);
-  tglt_secure_random (&enc_msg.session_id, 8);
-  enc_msg.msg_id = msg_id;
-  enc_msg.seq_no = 0;
+static void init_enc_msg_inner_temp (struct tgl_dc *DC, struct encrypted_header *H, long long msg_id) {
+  H->auth_key_id = DC->auth_key_id;
+  tglt_secure_random (&H->server_salt, 8);
+  tglt_secure_random (&H->session_id, 8);
+  H->msg_id = msg_id;
+  H->seq_no = 0;
 };
 
+static int enc_packet_size (int msg_len) {
+  const int UNENCSZ = offsetof (struct encrypted_header, server_salt);
+  return UNENCSZ + (((int)sizeof (struct encrypted_header) - UNENCSZ + msg_len + 15) & -16);
+}
 
-static int aes_encrypt_message (struct tgl_state *TLS, char *key, struct encrypted_message *enc) {
+/*
+ * Serializes header H and message (head followed by body) to buf and sets up J
+ * to encrypt it there. buf must have enc_packet_size (head_len + body_len) bytes,
+ * need not be aligned.
+ */
+static void aes_prepare_message (struct tgl_state *TLS, char *key, struct encrypted_header *H, const void *head, int head_len, const void *body, int body_len, unsigned char *buf, struct tgl_aes_job *J) {
   unsigned char sha1_buffer[20];
-  const int MINSZ = offsetof (struct encrypted_message, message);
-  const int UNENCSZ = offsetof (struct encrypted_message, server_salt);
+  const int MINSZ = sizeof (struct encrypted_header);
+  const int UNENCSZ = offsetof (struct encrypted_header, server_salt);
 
-  int enc_len = (MINSZ - UNENCSZ) + enc->msg_len;
-  assert (enc->msg_len >= 0 && enc->msg_len <= MAX_MESSAGE_INTS * 4 - 16 && !(enc->msg_len & 3));
-  TGLC_sha1 ((unsigned char *) &enc->server_salt, enc_len, sha1_buffer);
+  H->msg_len = head_len + body_len;
+  int enc_len = (MINSZ - UNENCSZ) + H->msg_len;
+  assert (H->msg_len >= 0 && H->msg_len <= MAX_MESSAGE_INTS * 4 - 16 && !(H->msg_len & 3));
+  memcpy (buf, H, MINSZ);
+  if (head_len) {
+    memcpy (buf + MINSZ, head, head_len);
+  }
+  memcpy (buf + MINSZ + head_len, body, body_len);
+
+  TGLC_sha1 (buf + UNENCSZ, enc_len, sha1_buffer);
   vlogprintf (E_DEBUG, "sending message with sha1 %08x\n", *(int *)sha1_buffer);
-  memcpy (enc->msg_key, sha1_buffer + 4, 16);
-  tgl_init_aes_auth (key, enc->msg_key, 1);
-  return tgl_pad_aes_encrypt ((char *) &enc->server_salt, enc_len, (char *) &enc->server_salt, MAX_MESSAGE_INTS * 4 + (MINSZ - UNENCSZ));
+  char *msg_key = (char *)buf + offsetof (struct encrypted_header, msg_key);
+  memcpy (msg_key, sha1_buffer + 4, 16);
+  tgl_init_aes_auth_job (J, key, msg_key, 1);
+  J->data = (char *)buf + UNENCSZ;
+  J->len = enc_len;
+}
+
+// returns size of the packet
+static int aes_encrypt_message (struct tgl_state *TLS, char *key, struct encrypted_header *H, const void *head, int head_len, const void *body, int body_len, unsigned char *buf) {
+  const int UNENCSZ = offsetof (struct encrypted_header, server_salt);
+  struct tgl_aes_job J;
+  aes_prepare_message (TLS, key, H, head, head_len, body, body_len, buf, &J);
+  tgl_pad_aes_encrypt_many (&J, 1);
+  return UNENCSZ + J.len;
+}
+
+// packet which is serialized, but not encrypted yet
+struct out_packet {
+  struct connection *c;
+  unsigned char *buf;
+  int len;
+  int reserved;
+};
+
+/*
+ * Packet is serialized and encrypted right in the output buffer of the connection,
+ * if net methods can reserve space there. Otherwise it goes through a temporary buffer.
+ * Encryption of packets prepared together can be done at once, the connections
+ * must not be flushed till then.
+ */
+static void rpc_prepare_message (struct tgl_state *TLS, struct connection *c, char *key, struct encrypted_header *H, const void *head, int head_len, const void *body, int body_len, struct out_packet *P, struct tgl_aes_job *J) {
+  int len = enc_packet_size (head_len + body_len);
+  assert (len > 0 && !(len & 0xfc000003));
+
+  int total_len = len >> 2;
+  if (total_len < 0x7f) {
+    assert (TLS->net_methods->write_out (c, &total_len, 1) == 1);
+  } else {
+    total_len = (total_len << 8) | 0x7f;
+    assert (TLS->net_methods->write_out (c, &total_len, 4) == 4);
+  }
+
+  TLS->net_methods->incr_out_packet_num (c);
+  P->c = c;
+  P->len = len;
+  P->reserved = TLS->net_methods->reserve_out != NULL;
+  P->buf = P->reserved ? TLS->net_methods->reserve_out (c, len) : talloc (len);
+  aes_prepare_message (TLS, key, H, head, head_len, body, body_len, P->buf, J);
+}
+
+static void rpc_finish_message (struct tgl_state *TLS, struct out_packet *P) {
+  if (!P->reserved) {
+    assert (TLS->net_methods->write_out (P->c, P->buf, P->len) == P->len);
+    tfree (P->buf, P->len);
+  }
+  TLS->net_methods->flush_out (P->c);
+
+  total_packets_sent ++;
+  total_data_sent += P->len >> 2;
 }
 
+static int rpc_send_message (struct tgl_state *TLS, struct connection *c, char *key, struct encrypted_header *H, const void *head, int head_len, const void *body, int body_len) {
+  struct out_packet P;
+  struct tgl_aes_job J;
+  rpc_prepare_message (TLS, c, key, H, head, head_len, body, body_len, &P, &J);
+  tgl_pad_aes_encrypt_many (&J, 1);
+  rpc_finish_message (TLS, &P);
+  return 1;
+}
+
+/*
+ * Messages sent during one iteration of the event loop are collected per session
+ * and go out in one msg_container: one encryption and one write for all of them.
+ * The batch is flushed by a zero timer, when it is full, or before any message
+ * that is sent right away, so that order of messages is kept.
+ */
+#define BATCH_MAX_INTS (1 << 14)
+#define BATCH_MAX_MESSAGES 64
+// queries of a batch dropped while the key is changed are resent after this delay
+#define BATCH_DROP_RESEND_TIMEOUT 0.1
+
+static void batch_drop (struct tgl_state *TLS, struct tgl_session *S) {
+  S->batch_num = 0;
+  S->batch_ints = 0;
+  TLS->timer_methods->remove (S->batch_ev);
+}
+
+// pending acks are added to the batch as one more message
+static void batch_acks (struct tgl_state *TLS, struct tgl_session *S) {
+  int *p = S->batch + S->batch_ints;
+  *(long long *)p = generate_next_msg_id (TLS, S->dc, S);
+  p[2] = S->seq_no;
+  p[3] = (3 + 2 * S->acks_num) * 4;
+  p[4] = CODE_msgs_ack;
+  p[5] = CODE_vector;
+  p[6] = S->acks_num;
+  memcpy (p + 7, S->acks, S->acks_num * 8);
+  S->seq_no += 2;
+  S->batch_ints += 7 + 2 * S->acks_num;
+  S->batch_num ++;
+  S->acks_num = 0;
+  tglw_timer_remove (TLS, &S->ev);
+}
+
+// returns 1 if packet with the batch is prepared
+static int batch_prepare (struct tgl_state *TLS, struct tgl_session *S, struct out_packet *P, struct tgl_aes_job *J) {
+  if (!S->batch_num) { return 0; }
+  struct tgl_dc *DC = S->dc;
+  if (*session_state (S) != st_authorized || !(DC->flags & 4) || !*session_temp_key_id (S)) {
+    // key is being changed, queries of the batch are resent shortly instead of waiting for their timeouts
+    int *p = S->batch;
+    while (p < S->batch + S->batch_ints) {
+      tglq_regen_query_after (TLS, *(long long *)p, BATCH_DROP_RESEND_TIMEOUT);
+      p += 4 + p[3] / 4;
+    }
+    batch_drop (TLS, S);
+    return 0;
+  }
+  if (S->acks_num && S->batch_ints + 7 + 2 * S->acks_num <= BATCH_MAX_INTS) {
+    batch_acks (TLS, S);
+  }
+  struct encrypted_header H;
+  int container[2];
+  int head_len, body_len;
+  if (S->batch_num == 1) {
+    // lone message is sent as is, with msg_id and seq_no it already has
+    init_enc_msg_header (TLS, S, &H);
+    H.msg_id = *(long long *)S->batch;
+    H.seq_no = S->batch[2];
+    head_len = 0;
+    body_len = S->batch[3];
+  } else {
+    container[0] = CODE_msg_container;
+    container[1] = S->batch_num;
+    head_len = 8;
+    body_len = S->batch_ints * 4;
+    init_enc_msg (TLS, S, &H, 0);
+  }
+  vlogprintf (E_DEBUG, "sending batch of %d messages, %d bytes\n", S->batch_num, head_len + body_len);
+  batch_drop (TLS, S);
+
+  rpc_prepare_message (TLS, S->c, session_temp_key (S), &H, container, head_len, head_len ? S->batch : S->batch + 4, body_len, P, J);
+  return 1;
+}
+
+static void batch_flush (struct tgl_state *TLS, struct tgl_session *S) {
+  struct out_packet P;
+  struct tgl_aes_job J;
+  if (batch_prepare (TLS, S, &P, &J)) {
+    tgl_pad_aes_encrypt_many (&J, 1);
+    rpc_finish_message (TLS, &P);
+  }
+}
+
+// sessions of DC with batches, the last one is the side session of the next temp key
+static struct tgl_session *batch_session (struct tgl_dc *DC, int j) {
+  return j < MAX_DC_SESSIONS ? DC->sessions[j] : DC->next_temp_session;
+}
+
+/*
+ * At the end of loop iteration batches of all sessions are flushed together,
+ * so that their packets are encrypted interleaved.
+ */
+static void batch_flush_all (struct tgl_state *TLS) {
+  int i, j, n = 0;
+  for (i = 0; i <= TLS->max_dc_num; i++) if (TLS->DC_list[i]) {
+    for (j = 0; j <= MAX_DC_SESSIONS; j++) {
+      struct tgl_session *S = batch_session (TLS->DC_list[i], j);
+      if (S && S->batch_num) { n ++; }
+    }
+  }
+  if (!n) { return; }
+  struct out_packet *P = talloc (n * sizeof (*P));
+  struct tgl_aes_job *J = talloc (n * sizeof (*J));
+  int k = 0;
+  for (i = 0; i <= TLS->max_dc_num; i++) if (TLS->DC_list[i]) {
+    for (j = 0; j <= MAX_DC_SESSIONS; j++) {
+      struct tgl_session *S = batch_session (TLS->DC_list[i], j);
+      if (S && batch_prepare (TLS, S, &P[k], &J[k])) { k ++; }
+    }
+  }
+  tgl_pad_aes_encrypt_many (J, k);
+  for (i = 0; i < k; i++) {
+    rpc_finish_message (TLS, &P[i]);
+  }
+  tfree (P, n * sizeof (*P));
+  tfree (J, n * sizeof (*J));
+}
+
+static void batch_flush_gateway (struct tgl_state *TLS, void *arg) {
+  batch_flush_all (TLS);
+}
+
+// returns msg_id of the message or 0 if it is too big to be batched
+static long long batch_message (struct tgl_state *TLS, struct tgl_session *S, int *msg, int msg_ints, int useful) {
+  if (msg_ints + 6 > BATCH_MAX_INTS || msg_id_override) {
+    return 0;
+  }
+  if (S->batch_num == BATCH_MAX_MESSAGES || S->batch_ints + msg_ints + 6 > BATCH_MAX_INTS) {
+    batch_flush (TLS, S);
+  }
+  if (!S->batch) {
+    S->batch = talloc (BATCH_MAX_INTS * 4);
+  }
+  long long msg_id = generate_next_msg_id (TLS, S->dc, S);
+  int *p = S->batch + S->batch_ints;
+  *(long long *)p = msg_id;
+  p[2] = S->seq_no | (useful ? 1 : 0);
+  p[3] = msg_ints * 4;
+  memcpy (p + 4, msg, msg_ints * 4);
+  S->seq_no += 2;
+  S->batch_ints += msg_ints + 4;
+  if (!S->batch_num ++) {
+    TLS->timer_methods->insert (S->batch_ev, 0);
+  }
+  return msg_id;
+}
+
+/*
+ * flags: 1 - content-related message, 2 - send even if DC is not configured yet,
+ * 4 - message can be delayed till the end of the loop iteration and sent in a container
+ */
 long long tglmp_encrypt_send_message (struct tgl_state *TLS, struct connection *c, int *msg, int msg_ints, int flags) {
   struct tgl_dc *DC = TLS->net_methods->get_dc (c);
   struct tgl_session *S = TLS->net_methods->get_session (c);
@@ -736,23 +1005,20 @@ long long tglmp_encrypt_send_message (struct tgl_state *TLS, struct connection *
     return generate_next_msg_id (TLS, DC, S);
   }
 
-  const int UNENCSZ = offsetof (struct encrypted_message, server_salt);
-  if (msg_ints <= 0 || msg_ints > MAX_MESSAGE_INTS - 4) {
-    return -1;
-  }
-  if (msg) {
-    memcpy (enc_msg.message, msg, msg_ints * 4);
-    enc_msg.msg_len = msg_ints * 4;
-  } else {
-    if ((enc_msg.msg_len & 0x80000003) || enc_msg.msg_len > MAX_MESSAGE_INTS * 4 - 16) {
-      return -1;
+  if (msg && (flags & 4) && msg_ints > 0) {
+    long long msg_id = batch_message (TLS, S, msg, msg_ints, flags & 1);
+    if (msg_id) {
+      return msg_id;
     }
   }
-  init_enc_msg (TLS, S, flags & 1);
+  if (!msg || msg_ints <= 0 || msg_ints > MAX_MESSAGE_INTS - 4) {
+    return -1;
+  }
+  batch_flush (TLS, S);
 
-  int l = aes_encrypt_message (TLS, DC->temp_auth_key, &enc_msg);
-  assert (l > 0);
-  rpc_send_message (TLS, c, &enc_msg, l + UNENCSZ);
+  struct encrypted_header H;
+  init_enc_msg (TLS, S, &H, flags & 1);
+  rpc_send_message (TLS, c, session_temp_key (S), &H, NULL, 0, msg, msg_ints * 4);
 
   return S->last_msg_id;
 }
@@ -762,21 +1028,14 @@ int tglmp_encrypt_inner_temp (struct tgl_state *TLS, struct connection *c, int *
   struct tgl_session *S = TLS->net_methods->get_session (c);
   assert (S);
 
-  const int UNENCSZ = offsetof (struct encrypted_message, server_salt);
   if (msg_ints <= 0 || msg_ints > MAX_MESSAGE_INTS - 4) {
     return -1;
   }
-  memcpy (enc_msg.message, msg, msg_ints * 4);
-  enc_msg.msg_len = msg_ints * 4;
 
-  init_enc_msg_inner_temp (DC, msg_id);
+  struct encrypted_header H;
+  init_enc_msg_inner_temp (DC, &H, msg_id);
 
-  int l = aes_encrypt_message (TLS, DC->auth_key, &enc_msg);
-  assert (l > 0);
-  //rpc_send_message (c, &enc_msg, l + UNENCSZ);
-  memcpy (data, &enc_msg, l + UNENCSZ);
-
-  return l + UNENCSZ;
+  return aes_encrypt_message (TLS, DC->auth_key, &H, NULL, 0, msg, msg_ints * 4, data);
 }
 
 static int rpc_execute_answer (struct tgl_state *TLS, struct connection *c, long long msg_id);
@@ -812,11 +1071,11 @@ static int work_new_session_created (struct tgl_state *TLS, struct connection *c
   assert (fetch_int () == (int)CODE_new_session_created);
   fetch_long (); // first message id
   fetch_long (); // unique_id
-  TLS->net_methods->get_dc (c)->server_salt = fetch_long ();
+  *session_server_salt (S) = fetch_long ();
 
   tglq_regen_queries_from_old_session (TLS, DC, S);
 
-  if (TLS->started && !(TLS->locks & TGL_LOCK_DIFF) && (TLS->DC_working->flags & TGLDCF_LOGGED_IN)) {
+  if (S == DC->sessions[0] && TLS->started && !(TLS->locks & TGL_LOCK_DIFF) && (TLS->DC_working->flags & TGLDCF_LOGGED_IN)) {
     tgl_do_get_difference (TLS, 0, 0, 0);
   }
   return 0;
@@ -848,27 +1107,38 @@ static int work_rpc_result (struct tgl_state *TLS, struct connection *c, long lo
   }
 }
 
-#define MAX_PACKED_SIZE (1 << 24)
 static int work_packed (struct tgl_state *TLS, struct connection *c, long long msg_id) {
   assert (fetch_int () == CODE_gzip_packed);
-  static int in_gzip;
-  static int buf[MAX_PACKED_SIZE >> 2];
+  static TGL_THREAD int in_gzip;
   assert (!in_gzip);
-  in_gzip = 1;
 
   int l = prefetch_strlen ();
   char *s = fetch_str (l);
 
-  int total_out = tgl_inflate (s, l, buf, MAX_PACKED_SIZE);
+  struct tgl_inflate_buf *B = tgl_inflate_packed (TLS, s, l);
+  if (!B) {
+    return -1;
+  }
+  const char *name = "packed message";
+  if (B->len >= 12 && B->data[0] == (int)CODE_rpc_result) {
+    struct query *q = tglq_query_get (TLS, *(long long *)(B->data + 1));
+    if (q) {
+      name = q->methods->name;
+    }
+  }
+  tgl_inflate_account (TLS, name, B);
+
+  in_gzip = 1;
   int *end = in_ptr;
   int *eend = in_end;
   //assert (total_out % 4 == 0);
-  in_ptr = buf;
-  in_end = in_ptr + total_out / 4;
+  in_ptr = B->data;
+  in_end = in_ptr + B->len / 4;
   int r = rpc_execute_answer (TLS, c, msg_id);
   in_ptr = end;
   in_end = eend;
   in_gzip = 0;
+  tgl_inflate_release (TLS, B);
   return r;
 }
 
@@ -878,7 +1148,7 @@ static int work_bad_server_salt (struct tgl_state *TLS, struct connection *c, lo
   fetch_int (); // seq_no
   fetch_int (); // error_code
   long long new_server_salt = fetch_long ();
-  TLS->net_methods->get_dc (c)->server_salt = new_server_salt;
+  *session_server_salt (TLS->net_methods->get_session (c)) = new_server_salt;
   tglq_query_restart (TLS, id);
   return 0;
 }
@@ -1015,14 +1285,18 @@ static char *get_ipv6 (struct tgl_state *TLS, int num) {
 }
 */
 
+static int dc_has_media_option (struct tgl_state *TLS, struct tgl_dc *DC) {
+  return DC->options[TLS->ipv6_enabled ? 3 : 2] != NULL;
+}
+
 static void create_session_connect (struct tgl_state *TLS, struct tgl_session *S) {
   struct tgl_dc *DC = S->dc;
 
-  if (TLS->ipv6_enabled) {
-    S->c = TLS->net_methods->create_connection (TLS, DC->options[1]->ip, DC->options[1]->port, S, DC, &mtproto_methods);
-  } else {
-    S->c = TLS->net_methods->create_connection (TLS, DC->options[0]->ip, DC->options[0]->port, S, DC, &mtproto_methods);
+  int o = TLS->ipv6_enabled ? 1 : 0;
+  if ((S->flags & TGLSF_MEDIA) && DC->options[o + 2]) {
+    o += 2;
   }
+  S->c = TLS->net_methods->create_connection (TLS, DC->options[o]->ip, DC->options[o]->port, S, DC, &mtproto_methods);
 }
 
 static void fail_connection (struct tgl_state *TLS, struct connection *c) {
@@ -1034,61 +1308,76 @@ static void fail_connection (struct tgl_state *TLS, struct connection *c) {
 static void fail_session (struct tgl_state *TLS, struct tgl_session *S) {
   vlogprintf (E_NOTICE, "failing session %" INT64_PRINTF_MODIFIER "d\n", S->session_id);
   struct tgl_dc *DC = S->dc;
+  if (S->flags & TGLSF_NEXT_TEMP_KEY) {
+    // next key is negotiated again on a new connection, till the deadline
+    tglt_secure_random (&S->session_id, 8);
+    S->seq_no = 0;
+    fail_connection (TLS, S->c);
+    return;
+  }
+  int i;
+  for (i = 0; i < MAX_DC_SESSIONS; i++) {
+    if (DC->sessions[i] == S) { break; }
+  }
+  assert (i < MAX_DC_SESSIONS);
   tgls_free_session (TLS, S);
-  DC->sessions[0] = NULL;
-  tglmp_dc_create_session (TLS, DC);
+  DC->sessions[i] = NULL;
+  // extra sessions are recreated on demand by tglmp_dc_get_session
+  if (!i) {
+    tglmp_dc_create_session (TLS, DC);
+  }
 }
 
-static int process_rpc_message (struct tgl_state *TLS, struct connection *c, struct encrypted_message *enc, int len) {
+/*
+ * Decrypts the message in place and checks it. Nothing but the message is touched,
+ * so it may run on a crypto pool worker.
+ * Returns 0, -1 if the length is bad and -2 if msg_key does not match.
+ */
+static int decrypt_rpc_message (char auth_key[192], struct encrypted_message *enc, int len) {
   const int MINSZ = offsetof (struct encrypted_message, message);
   const int UNENCSZ = offsetof (struct encrypted_message, server_salt);
-  vlogprintf (E_DEBUG, "process_rpc_message(), len=%d\n", len);
-  if (len < MINSZ || (len & 15) != (UNENCSZ & 15)) {
-    vlogprintf (E_WARNING, "Incorrect packet from server. Closing connection\n");
-    fail_connection (TLS, c);
+  struct tgl_aes_job J;
+  tgl_init_aes_auth_job (&J, auth_key, enc->msg_key, 0);
+  J.data = (char *)&enc->server_salt;
+  J.len = len - UNENCSZ;
+  tgl_pad_aes_decrypt_many (&J, 1);
+  memset (&J.key, 0, sizeof (J.key));
+
+  if (!(!(enc->msg_len & 3) && enc->msg_len > 0 && enc->msg_len <= len - MINSZ && len - MINSZ - enc->msg_len <= 12)) {
     return -1;
   }
-  assert (len >= MINSZ && (len & 15) == (UNENCSZ & 15));
-  struct tgl_dc *DC = TLS->net_methods->get_dc (c);
-  if (enc->auth_key_id != DC->temp_auth_key_id && enc->auth_key_id != DC->auth_key_id) {
-    vlogprintf (E_WARNING, "received msg from dc %d with auth_key_id %" INT64_PRINTF_MODIFIER "d (perm_auth_key_id %" INT64_PRINTF_MODIFIER "d temp_auth_key_id %" INT64_PRINTF_MODIFIER "d). Dropping\n",
-    DC->id, enc->auth_key_id, DC->auth_key_id, DC->temp_auth_key_id);
-    return 0;
-  }
-  if (enc->auth_key_id == DC->temp_auth_key_id) {
-    assert (enc->auth_key_id == DC->temp_auth_key_id);
-    assert (DC->temp_auth_key_id);
-    tgl_init_aes_auth (DC->temp_auth_key + 8, enc->msg_key, 0);
-  } else {
-    assert (enc->auth_key_id == DC->auth_key_id);
-    assert (DC->auth_key_id);
-    tgl_init_aes_auth (DC->auth_key + 8, enc->msg_key, 0);
-  }
 
-  int l = tgl_pad_aes_decrypt ((char *)&enc->server_salt, len - UNENCSZ, (char *)&enc->server_salt, len - UNENCSZ);
-  assert (l == len - UNENCSZ);
+  unsigned char sha1_buffer[20];
+  TGLC_sha1 ((void *)&enc->server_salt, enc->msg_len + (MINSZ - UNENCSZ), sha1_buffer);
+  if (memcmp (&enc->msg_key, sha1_buffer + 4, 16)) {
+    return -2;
+  }
+  return 0;
+}
 
-  if (!(!(enc->msg_len & 3) && enc->msg_len > 0 && enc->msg_len <= len - MINSZ && len - MINSZ - enc->msg_len <= 12)) {
+// res is the result of decrypt_rpc_message
+static int dispatch_rpc_message (struct tgl_state *TLS, struct connection *c, struct encrypted_message *enc, int len, int res) {
+  const int MINSZ = offsetof (struct encrypted_message, message);
+  const int UNENCSZ = offsetof (struct encrypted_message, server_salt);
+  if (res == -1) {
     vlogprintf (E_WARNING, "Incorrect packet from server. Closing connection\n");
     fail_connection (TLS, c);
     return -1;
   }
   assert (!(enc->msg_len & 3) && enc->msg_len > 0 && enc->msg_len <= len - MINSZ && len - MINSZ - enc->msg_len <= 12);
 
+  struct tgl_dc *DC = TLS->net_methods->get_dc (c);
   struct tgl_session *S = TLS->net_methods->get_session (c);
   if (!S || S->session_id != enc->session_id) {
     vlogprintf (E_WARNING, "Message to bad session. Drop.\n");
     return 0;
   }
 
-  static unsigned char sha1_buffer[20];
-  TGLC_sha1 ((void *)&enc->server_salt, enc->msg_len + (MINSZ - UNENCSZ), sha1_buffer);
-  if (memcmp (&enc->msg_key, sha1_buffer + 4, 16)) {
+  if (res < 0) {
     vlogprintf (E_WARNING, "Incorrect packet from server. Closing connection\n");
     fail_connection (TLS, c);
     return -1;
   }
-  assert (!memcmp (&enc->msg_key, sha1_buffer + 4, 16));
 
   int this_server_time = enc->msg_id >> 32LL;
   if (!S->received_messages) {
@@ -1108,8 +1397,8 @@ static int process_rpc_message (struct tgl_state *TLS, struct connection *c, str
   }
   S->received_messages ++;
 
-  if (DC->server_salt != enc->server_salt) {
-    DC->server_salt = enc->server_salt;
+  if (*session_server_salt (S) != enc->server_salt) {
+    *session_server_salt (S) = enc->server_salt;
   }
 
   assert (this_server_time >= st - 300 && this_server_time <= st + 30);
@@ -1120,7 +1409,7 @@ static int process_rpc_message (struct tgl_state *TLS, struct connection *c, str
   //*(long long *)(longpoll_query + 3) = *(long long *)((char *)(&enc->msg_id) + 0x3c);
   //*(long long *)(longpoll_query + 5) = *(long long *)((char *)(&enc->msg_id) + 0x3c);
 
-  assert (l >= (MINSZ - UNENCSZ) + 8);
+  assert (len - UNENCSZ >= (MINSZ - UNENCSZ) + 8);
   //assert (enc->message[0] == CODE_rpc_result && *(long long *)(enc->message + 1) == client_last_msg_id);
 
   in_ptr = enc->message;
@@ -1139,9 +1428,135 @@ static int process_rpc_message (struct tgl_state *TLS, struct connection *c, str
   return 0;
 }
 
+/*
+ * With a crypto pool, received messages are copied and decrypted on the workers.
+ * They are dispatched on the loop thread at the end of loop iteration,
+ * in the order they were received on the session.
+ */
+struct rpc_frame {
+  struct tgl_crypto_job job;
+  struct rpc_frame *next;
+  char auth_key[192];
+  struct encrypted_message *enc;
+  int len;
+  int res;
+};
+
+static void rpc_frame_run (struct tgl_crypto_job *J) {
+  struct rpc_frame *F = (void *)J;
+  F->res = decrypt_rpc_message (F->auth_key, F->enc, F->len);
+}
+
+static void free_rpc_frame (struct tgl_state *TLS, struct rpc_frame *F) {
+  tgl_crypto_pool_wait (TLS->crypto_pool, &F->job);
+  memset (F->auth_key, 0, sizeof (F->auth_key));
+  tfree (F, sizeof (*F) + F->len);
+}
+
+static int queue_rpc_message (struct tgl_state *TLS, struct connection *c, char auth_key[192], struct encrypted_message *enc, int len) {
+  struct tgl_session *S = TLS->net_methods->get_session (c);
+  if (!S) {
+    vlogprintf (E_WARNING, "Message to bad session. Drop.\n");
+    return 0;
+  }
+  struct rpc_frame *F = talloc (sizeof (*F) + len);
+  F->next = NULL;
+  memcpy (F->auth_key, auth_key, 192);
+  F->enc = (void *)(F + 1);
+  memcpy (F->enc, enc, len);
+  F->len = len;
+  if (S->in_tail) {
+    S->in_tail->next = F;
+  } else {
+    S->in_head = F;
+  }
+  S->in_tail = F;
+  F->job.run = rpc_frame_run;
+  tgl_crypto_pool_submit (TLS->crypto_pool, &F->job);
+  TLS->timer_methods->insert (S->in_ev, 0);
+  return 0;
+}
+
+static void rpc_frames_gateway (struct tgl_state *TLS, void *arg) {
+  struct tgl_session *S = arg;
+  struct rpc_frame *F = S->in_head;
+  S->in_head = S->in_tail = NULL;
+  while (F) {
+    struct rpc_frame *N = F->next;
+    tgl_crypto_pool_wait (TLS->crypto_pool, &F->job);
+    int r = dispatch_rpc_message (TLS, S->c, F->enc, F->len, F->res);
+    free_rpc_frame (TLS, F);
+    F = N;
+    if (r < 0) {
+      // session or its connection is failed (and S may be freed), the rest is dropped
+      while (F) {
+        N = F->next;
+        free_rpc_frame (TLS, F);
+        F = N;
+      }
+    }
+  }
+}
+
+/*
+ * Finishes decryption of all queued frames, so that the crypto pool can be replaced.
+ * Frames stay queued and are dispatched by their sessions' timers as usual.
+ */
+static void wait_session_frames (struct tgl_state *TLS, struct tgl_session *S) {
+  struct rpc_frame *F;
+  for (F = S ? S->in_head : NULL; F; F = F->next) {
+    tgl_crypto_pool_wait (TLS->crypto_pool, &F->job);
+  }
+}
+
+void tglmp_wait_rpc_frames (struct tgl_state *TLS) {
+  int i, j;
+  for (i = 0; i <= TLS->max_dc_num; i++) if (TLS->DC_list[i]) {
+    for (j = 0; j < MAX_DC_SESSIONS; j++) {
+      wait_session_frames (TLS, TLS->DC_list[i]->sessions[j]);
+    }
+    wait_session_frames (TLS, TLS->DC_list[i]->next_temp_session);
+  }
+}
+
+static int process_rpc_message (struct tgl_state *TLS, struct connection *c, struct encrypted_message *enc, int len) {
+  const int MINSZ = offsetof (struct encrypted_message, message);
+  const int UNENCSZ = offsetof (struct encrypted_message, server_salt);
+  vlogprintf (E_DEBUG, "process_rpc_message(), len=%d\n", len);
+  if (len < MINSZ || (len & 15) != (UNENCSZ & 15)) {
+    vlogprintf (E_WARNING, "Incorrect packet from server. Closing connection\n");
+    fail_connection (TLS, c);
+    return -1;
+  }
+  assert (len >= MINSZ && (len & 15) == (UNENCSZ & 15));
+  struct tgl_dc *DC = TLS->net_methods->get_dc (c);
+  struct tgl_session *S = TLS->net_methods->get_session (c);
+  long long temp_auth_key_id = S ? *session_temp_key_id (S) : DC->temp_auth_key_id;
+  if (enc->auth_key_id != temp_auth_key_id && enc->auth_key_id != DC->auth_key_id) {
+    vlogprintf (E_WARNING, "received msg from dc %d with auth_key_id %" INT64_PRINTF_MODIFIER "d (perm_auth_key_id %" INT64_PRINTF_MODIFIER "d temp_auth_key_id %" INT64_PRINTF_MODIFIER "d). Dropping\n",
+    DC->id, enc->auth_key_id, DC->auth_key_id, temp_auth_key_id);
+    return 0;
+  }
+  char *auth_key;
+  if (enc->auth_key_id == temp_auth_key_id) {
+    assert (temp_auth_key_id);
+    auth_key = (S ? session_temp_key (S) : DC->temp_auth_key) + 8;
+  } else {
+    assert (enc->auth_key_id == DC->auth_key_id);
+    assert (DC->auth_key_id);
+    auth_key = DC->auth_key + 8;
+  }
+
+  if (TLS->crypto_pool) {
+    return queue_rpc_message (TLS, c, auth_key, enc, len);
+  }
+  return dispatch_rpc_message (TLS, c, enc, len, decrypt_rpc_message (auth_key, enc, len));
+}
+
 
 static int rpc_execute (struct tgl_state *TLS, struct connection *c, int op, int len) {
   struct tgl_dc *DC = TLS->net_methods->get_dc (c);
+  struct tgl_session *S = TLS->net_methods->get_session (c);
 
   if (len >= MAX_RESPONSE_SIZE/* - 12*/ || len < 0/*12*/) {
     vlogprintf (E_WARNING, "answer too long (%d bytes), skipping\n", len);
@@ -1150,50 +1565,61 @@ static int rpc_execute (struct tgl_state *TLS, struct connection *c, int op, int
 
   int Response_len = len;
 
-  static char Response[MAX_RESPONSE_SIZE];
+  // frame is decrypted in place, so without read_in_ptr it is copied to a temporary buffer
+  char *Response;
+  char *Response_copy = NULL;
   vlogprintf (E_DEBUG, "Response_len = %d\n", Response_len);
-  assert (TLS->net_methods->read_in (c, Response, Response_len) == Response_len);
+  if (TLS->net_methods->read_in_ptr) {
+    Response = TLS->net_methods->read_in_ptr (c, Response_len);
+  } else {
+    Response = Response_copy = talloc (Response_len);
+    assert (TLS->net_methods->read_in (c, Response, Response_len) == Response_len);
+  }
 
 #if !defined(__MACH__) && !defined(__FreeBSD__) && !defined(__OpenBSD__) && !defined (__CYGWIN__)
 //  setsockopt (c->fd, IPPROTO_TCP, TCP_QUICKACK, (int[]){0}, 4);
 #endif
-  int o = DC->state;
+  int o = S ? *session_state (S) : DC->state;
   //if (DC->flags & 1) { o = st_authorized;}
   if (o != st_authorized) {
     vlogprintf (E_DEBUG, "%s: state = %d\n", __func__, o);
   }
+  int res = 0;
   switch (o) {
   case st_reqpq_sent:
-    process_respq_answer (TLS, c, Response/* + 8*/, Response_len/* - 12*/, 0);
-    return 0;
+    res = process_respq_answer (TLS, c, Response/* + 8*/, Response_len/* - 12*/, 0);
+    break;
   case st_reqdh_sent:
     process_dh_answer (TLS, c, Response/* + 8*/, Response_len/* - 12*/, 0);
-    return 0;
+    break;
   case st_client_dh_sent:
     process_auth_complete (TLS, c, Response/* + 8*/, Response_len/* - 12*/, 0);
-    return 0;
+    break;
   case st_reqpq_sent_temp:
-    process_respq_answer (TLS, c, Response/* + 8*/, Response_len/* - 12*/, 1);
-    return 0;
+    res = process_respq_answer (TLS, c, Response/* + 8*/, Response_len/* - 12*/, 1);
+    break;
   case st_reqdh_sent_temp:
     process_dh_answer (TLS, c, Response/* + 8*/, Response_len/* - 12*/, 1);
-    return 0;
+    break;
   case st_client_dh_sent_temp:
     process_auth_complete (TLS, c, Response/* + 8*/, Response_len/* - 12*/, 1);
-    return 0;
+    break;
   case st_authorized:
     if (op < 0 && op >= -999) {
       vlogprintf (E_WARNING, "Server error %d\n", op);
     } else {
-      return process_rpc_message (TLS, c, (void *)(Response/* + 8*/), Response_len/* - 12*/);
+      res = process_rpc_message (TLS, c, (void *)(Response/* + 8*/), Response_len/* - 12*/);
     }
-    return 0;
+    break;
   default:
-    vlogprintf (E_ERROR, "fatal: cannot receive answer in state %d\n", DC->state);
+    vlogprintf (E_ERROR, "fatal: cannot receive answer in state %d\n", o);
     exit (2);
   }
 
-  return 0;
+  if (Response_copy) {
+    tfree (Response_copy, Response_len);
+  }
+  return res;
 }
 
 
@@ -1215,6 +1641,24 @@ static int tc_becomes_ready (struct tgl_state *TLS, struct connection *c) {
   //TLS->net_methods->flush_out (c);
 
   struct tgl_dc *DC = TLS->net_methods->get_dc (c);
+  struct tgl_session *S = TLS->net_methods->get_session (c);
+  if (S->flags & TGLSF_NEXT_TEMP_KEY) {
+    // (re)starts negotiation of the next temporary key, unless it is already bound
+    if (!DC->next_temp_bound) {
+      if (DC->next_temp_bind_query_id) {
+        tglq_query_delete (TLS, DC->next_temp_bind_query_id);
+        DC->next_temp_bind_query_id = 0;
+      }
+      DC->next_temp_auth_key_id = 0;
+      DC->next_temp_state = st_authorized;
+      send_req_pq_temp_packet (TLS, c);
+    }
+    return 0;
+  }
+  if (S != DC->sessions[0]) {
+    // auth key exchange and config are driven by the primary session only
+    return 0;
+  }
   if (DC->flags & 1) { DC->state = st_authorized; }
   int o = DC->state;
   if (o == st_authorized && !TLS->enable_pfs) {
@@ -1305,19 +1749,21 @@ void tgl_dc_authorize (struct tgl_state *TLS, struct tgl_dc *DC) {
   //net_loop (0, auth_ok);
 }
 
-#define long_cmp(a,b) ((a) > (b) ? 1 : (a) == (b) ? 0 : -1)
-DEFINE_TREE(long,long long,long_cmp,0)
-
 static int send_all_acks (struct tgl_state *TLS, struct tgl_session *S) {
+  if (S->batch_num) {
+    // acks go with the pending batch
+    batch_flush (TLS, S);
+    if (!S->acks_num) {
+      return 0;
+    }
+  }
   clear_packet ();
   out_int (CODE_msgs_ack);
   out_int (CODE_vector);
-  out_int (tree_count_long (S->ack_tree));
-  while (S->ack_tree) {
-    long long x = tree_get_min_long (S->ack_tree);
-    out_long (x);
-    S->ack_tree = tree_delete_long (S->ack_tree, x);
-  }
+  out_int (S->acks_num);
+  out_ints ((int *)S->acks, 2 * S->acks_num);
+  S->acks_num = 0;
+  tglw_timer_remove (TLS, &S->ev);
   tglmp_encrypt_send_message (TLS, S->c, packet_buffer, packet_ptr - packet_buffer, 0);
   return 0;
 }
@@ -1327,21 +1773,34 @@ static void send_all_acks_gateway (struct tgl_state *TLS, void *arg) {
 }
 
 
+/*
+ * Acks are kept in a flat array. They go out with the next batch of the session
+ * and only idle sessions send them on their own, after ACK_TIMEOUT.
+ * Duplicates are not looked for, acking a message twice is harmless.
+ */
 void tgln_insert_msg_id (struct tgl_state *TLS, struct tgl_session *S, long long id) {
-  if (!S->ack_tree) {
-    TLS->timer_methods->insert (S->ev, ACK_TIMEOUT);
+  if (!S->acks_num) {
+    tglw_timer_insert (TLS, &S->ev, ACK_TIMEOUT);
   }
-  if (!tree_lookup_long (S->ack_tree, id)) {
-    S->ack_tree = tree_insert_long (S->ack_tree, id, rand ());
+  if (S->acks_num == S->acks_size) {
+    int new_size = S->acks_size ? 2 * S->acks_size : 64;
+    if (S->acks_size) {
+      S->acks = trealloc (S->acks, S->acks_size * 8, new_size * 8);
+    } else {
+      S->acks = talloc (new_size * 8);
+    }
+    S->acks_size = new_size;
+  }
+  S->acks[S->acks_num ++] = id;
+  if (S->acks_num == MAX_ACKS) {
+    send_all_acks (TLS, S);
   }
 }
 
 //extern struct tgl_dc *DC_list[];
 
 
-static void regen_temp_key_gw (struct tgl_state *TLS, void *arg) {
-  tglmp_regenerate_temp_auth_key (TLS, arg);
-}
+static void regen_temp_key_gw (struct tgl_state *TLS, void *arg);
 
 struct tgl_dc *tglmp_alloc_dc (struct tgl_state *TLS, int flags, int id, char *ip, int port) {
   //assert (!TLS->DC_list[id]);
@@ -1388,16 +1847,162 @@ static struct mtproto_methods mtproto_methods = {
   .close = rpc_close
 };
 
-void tglmp_dc_create_session (struct tgl_state *TLS, struct tgl_dc *DC) {
+static struct tgl_session *alloc_session (struct tgl_state *TLS, struct tgl_dc *DC, int flags) {
   struct tgl_session *S = talloc0 (sizeof (*S));
   assert (TGLC_rand_pseudo_bytes ((unsigned char *) &S->session_id, 8) >= 0);
   S->dc = DC;
+  S->flags = flags;
   //S->c = TLS->net_methods->create_connection (TLS, DC->ip, DC->port, S, DC, &mtproto_methods);
 
   create_session_connect (TLS, S);
-  S->ev = TLS->timer_methods->alloc (TLS, send_all_acks_gateway, S);
-  assert (!DC->sessions[0]);
-  DC->sessions[0] = S;
+  tglw_timer_init (&S->ev, send_all_acks_gateway, S);
+  S->batch_ev = TLS->timer_methods->alloc (TLS, batch_flush_gateway, S);
+  S->in_ev = TLS->timer_methods->alloc (TLS, rpc_frames_gateway, S);
+  return S;
+}
+
+// number of sessions used on DC, with media endpoints the last of them is the media one
+static int dc_sessions_num (struct tgl_state *TLS, struct tgl_dc *DC) {
+  int n = TLS->dc_sessions;
+  if (dc_has_media_option (TLS, DC) && n < 2) {
+    n = 2;
+  }
+  return n;
+}
+
+static void dc_create_session (struct tgl_state *TLS, struct tgl_dc *DC, int num) {
+  assert (num >= 0 && num < MAX_DC_SESSIONS);
+  assert (!DC->sessions[num]);
+  int media = num > 0 && num == dc_sessions_num (TLS, DC) - 1 && dc_has_media_option (TLS, DC);
+  DC->sessions[num] = alloc_session (TLS, DC, media ? TGLSF_MEDIA : 0);
+}
+
+void tglmp_dc_create_session (struct tgl_state *TLS, struct tgl_dc *DC) {
+  dc_create_session (TLS, DC, 0);
+}
+
+static void free_next_temp_session (struct tgl_state *TLS, struct tgl_dc *DC) {
+  if (DC->next_temp_bind_query_id) {
+    tglq_query_delete (TLS, DC->next_temp_bind_query_id);
+    DC->next_temp_bind_query_id = 0;
+  }
+  if (DC->next_temp_session) {
+    tgls_free_session (TLS, DC->next_temp_session);
+    DC->next_temp_session = NULL;
+  }
+  DC->next_temp_bound = 0;
+  DC->next_temp_auth_key_id = 0;
+  memset (DC->next_temp_auth_key, 0, 256);
+}
+
+void tglmp_next_temp_auth_key_bound (struct tgl_state *TLS, struct tgl_dc *DC) {
+  DC->next_temp_bind_query_id = 0;
+  DC->next_temp_bound = 1;
+  // side session is being read now, keys are swapped from the timer
+  TLS->timer_methods->insert (DC->ev, 0);
+}
+
+/*
+ * Everything still in batches and acks goes out with the old key. Then sessions
+ * are started anew with the new one and queries in flight are resent.
+ */
+static void swap_temp_auth_key (struct tgl_state *TLS, struct tgl_dc *DC) {
+  vlogprintf (E_NOTICE, "switching dc %d to the next temp auth key\n", DC->id);
+  int i;
+  for (i = 0; i < MAX_DC_SESSIONS; i++) {
+    struct tgl_session *S = DC->sessions[i];
+    if (!S) { continue; }
+    if (S->acks_num) {
+      send_all_acks (TLS, S);
+    } else {
+      batch_flush (TLS, S);
+    }
+  }
+
+  memcpy (DC->temp_auth_key, DC->next_temp_auth_key, 256);
+  DC->temp_auth_key_id = DC->next_temp_auth_key_id;
+  DC->server_salt = DC->next_temp_server_salt;
+  free_next_temp_session (TLS, DC);
+
+  for (i = 0; i < MAX_DC_SESSIONS; i++) {
+    struct tgl_session *S = DC->sessions[i];
+    if (!S) { continue; }
+    tglt_secure_random (&S->session_id, 8);
+    S->seq_no = 0;
+    tglq_regen_queries_from_old_session (TLS, DC, S);
+  }
+
+  tgl_do_help_get_config_dc (TLS, DC, mpc_on_get_config, DC);
+  TLS->timer_methods->insert (DC->ev, TLS->temp_key_expire_time * 0.9);
+}
+
+/*
+ * Fires at 0.9 of temp key lifetime. The next key is negotiated and bound on a side
+ * session while queries still go with the current one, and keys are swapped once the bind
+ * is answered. If that does not happen till the deadline, the key is regenerated
+ * on the primary session, stalling the DC till it is bound.
+ */
+static void regen_temp_key_gw (struct tgl_state *TLS, void *arg) {
+  struct tgl_dc *DC = arg;
+  if (DC->next_temp_bound) {
+    swap_temp_auth_key (TLS, DC);
+    return;
+  }
+  if (!DC->next_temp_session && TLS->enable_pfs && DC->sessions[0] && DC->state == st_authorized && (DC->flags & 7) == 7) {
+    DC->next_temp_session = alloc_session (TLS, DC, TGLSF_NEXT_TEMP_KEY);
+    TLS->timer_methods->insert (DC->ev, TLS->temp_key_expire_time * 0.09);
+    return;
+  }
+  tglmp_regenerate_temp_auth_key (TLS, DC);
+}
+
+/*
+  Picks a session for a new query. Until the DC is fully set up, and for
+  forced (handshake) queries, this is always the primary session. Bulk
+  transfers are spread over the extra sessions, so that file parts do not
+  queue in front of interactive queries; interactive queries go to the
+  least loaded session that has no bulk transfer in flight.
+  If the DC advertises media endpoints, the last session connects there
+  and carries file transfers only; at least one such session is always used.
+  Interactive queries are then placed over the other sessions.
+  Bind of the next temporary key goes to the side session it was negotiated on.
+*/
+struct tgl_session *tglmp_dc_get_session (struct tgl_state *TLS, struct tgl_dc *DC, int flags) {
+  if (flags & QUERY_NEXT_TEMP_KEY) {
+    assert (DC->next_temp_session);
+    return DC->next_temp_session;
+  }
+  if (!DC->sessions[0]) {
+    tglmp_dc_create_session (TLS, DC);
+  }
+  int media = dc_has_media_option (TLS, DC);
+  int n = dc_sessions_num (TLS, DC);
+  if (n <= 1 || (flags & QUERY_FORCE_SEND) || DC->state != st_authorized || (DC->flags & 6) != 6) {
+    return DC->sessions[0];
+  }
+  struct tgl_session *B = NULL;
+  int best = 0;
+  int i;
+  for (i = (flags & QUERY_BULK) ? 1 : 0; i < n; i++) {
+    if (!DC->sessions[i]) {
+      dc_create_session (TLS, DC, i);
+    }
+    struct tgl_session *S = DC->sessions[i];
+    // with media endpoints bulk transfers go to media session only, the rest never do
+    if (media && !(S->flags & TGLSF_MEDIA) != !(flags & QUERY_BULK)) {
+      continue;
+    }
+    int load = S->queries_num;
+    if (!(flags & QUERY_BULK) && S->bulk_queries_num) {
+      load += 1 << 20;
+    }
+    if (!B || load < best) {
+      B = S;
+      best = load;
+    }
+  }
+  // sessions made before media endpoints were known
+  return B ? B : DC->sessions[0];
 }
 
 void tgl_do_send_ping (struct tgl_state *TLS, struct connection *c) {
@@ -1423,6 +2028,7 @@ void tgl_dc_iterator_ex (struct tgl_state *TLS, void (*iterator)(struct tgl_dc *
 
 
 void tglmp_regenerate_temp_auth_key (struct tgl_state *TLS, struct tgl_dc *DC) {
+  free_next_temp_session (TLS, DC);
   DC->flags &= ~6;
   DC->temp_auth_key_id = 0;
   memset (DC->temp_auth_key, 0, 256);
@@ -1432,12 +2038,21 @@ void tglmp_regenerate_temp_auth_key (struct tgl_state *TLS, struct tgl_dc *DC) {
     return;
   }
 
+  int i;
+  for (i = 1; i < MAX_DC_SESSIONS; i++) {
+    if (DC->sessions[i]) {
+      tgls_free_session (TLS, DC->sessions[i]);
+      DC->sessions[i] = NULL;
+    }
+  }
+
   struct tgl_session *S = DC->sessions[0];
+  batch_drop (TLS, S);
   tglt_secure_random (&S->session_id, 8);
   S->seq_no = 0;
 
-  TLS->timer_methods->remove (S->ev);
-  S->ack_tree = tree_clear_long (S->ack_tree);
+  tglw_timer_remove (TLS, &S->ev);
+  S->acks_num = 0;
 
   if (DC->state != st_authorized) {
     return;
@@ -1454,8 +2069,17 @@ void tglmp_regenerate_temp_auth_key (struct tgl_state *TLS, struct tgl_dc *DC) {
 }
 
 void tgls_free_session (struct tgl_state *TLS, struct tgl_session *S) {
-  S->ack_tree = tree_clear_long (S->ack_tree);
-  if (S->ev) { TLS->timer_methods->free (S->ev); }
+  tglq_forget_session (TLS, S);
+  if (S->acks) { tfree (S->acks, S->acks_size * 8); }
+  tglw_timer_remove (TLS, &S->ev);
+  if (S->batch_ev) { TLS->timer_methods->free (S->batch_ev); }
+  if (S->batch) { tfree (S->batch, BATCH_MAX_INTS * 4); }
+  while (S->in_head) {
+    struct rpc_frame *F = S->in_head;
+    S->in_head = F->next;
+    free_rpc_frame (TLS, F);
+  }
+  if (S->in_ev) { TLS->timer_methods->free (S->in_ev); }
   if (S->c) {
     TLS->net_methods->free (S->c);
   }
@@ -1465,10 +2089,12 @@ void tgls_free_session (struct tgl_state *TLS, struct tgl_session *S) {
 void tgls_free_dc (struct tgl_state *TLS, struct tgl_dc *DC) {
   //if (DC->ip) { tfree_str (DC->ip); }
 
-  struct tgl_session *S = DC->sessions[0];
-  if (S) { tgls_free_session (TLS, S); }
-  
   int i;
+  for (i = 0; i < MAX_DC_SESSIONS; i++) {
+    if (DC->sessions[i]) { tgls_free_session (TLS, DC->sessions[i]); }
+  }
+  if (DC->next_temp_session) { tgls_free_session (TLS, DC->next_temp_session); }
+  
   for (i = 0; i < 4; i++) {
     struct tgl_dc_option *O = DC->options[i];
     while (O) {
@@ -41,19 +41,24 @@ struct tgl_dc;
 #define TG_APP_ID 10534
 
 #define ACK_TIMEOUT 1
+// max number of msg_ids in one msgs_ack
+#define MAX_ACKS 8192
 #define MAX_DC_ID 10
 
 struct connection;
 
 long long tglmp_encrypt_send_message (struct tgl_state *TLS, struct connection *c, int *msg, int msg_ints, int flags);
 void tglmp_dc_create_session (struct tgl_state *TLS, struct tgl_dc *DC);
+struct tgl_session *tglmp_dc_get_session (struct tgl_state *TLS, struct tgl_dc *DC, int flags);
 //int tglmp_check_g (struct tgl_state *TLS, unsigned char p[256], BIGNUM *g);
 //int tglmp_check_DH_params (struct tgl_state *TLS, BIGNUM *p, int g);
 struct tgl_dc *tglmp_alloc_dc (struct tgl_state *TLS, int flags, int id, char *ip, int port);
 void tglmp_regenerate_temp_auth_key (struct tgl_state *TLS, struct tgl_dc *D);
+void tglmp_next_temp_auth_key_bound (struct tgl_state *TLS, struct tgl_dc *D);
 
 void tgln_insert_msg_id (struct tgl_state *TLS, struct tgl_session *S, long long id);
 int tglmp_on_start (struct tgl_state *TLS);
+void tglmp_wait_rpc_frames (struct tgl_state *TLS);
 void tgl_dc_authorize (struct tgl_state *TLS, struct tgl_dc *DC);
 void tgls_free_dc (struct tgl_state *TLS, struct tgl_dc *DC);
 void tgls_free_pubkey (struct tgl_state *TLS);
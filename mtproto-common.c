@@ -56,11 +56,15 @@
 #define O_BINARY 0
 #endif
 
-static int __packet_buffer[PACKET_BUFFER_SIZE + 16];
-int *tgl_packet_ptr;
-int *tgl_packet_buffer = __packet_buffer + 16;
+TGL_THREAD int *tgl_packet_ptr;
+TGL_THREAD int *tgl_packet_buffer;
 
-static long long rsa_encrypted_chunks, rsa_decrypted_chunks;
+void tgl_alloc_packet_buffer (void) {
+  assert (!tgl_packet_buffer);
+  tgl_packet_buffer = (int *) talloc ((PACKET_BUFFER_SIZE + 16) * 4) + 16;
+}
+
+static TGL_THREAD long long rsa_encrypted_chunks, rsa_decrypted_chunks;
 
 //int verbosity;
 
@@ -203,8 +207,8 @@ int tgl_serialize_bignum (TGLC_bn *b, char *buffer, int maxlen) {
 
 
 long long tgl_do_compute_rsa_key_fingerprint (TGLC_rsa *key) {
-  static char tempbuff[4096];
-  static unsigned char sha[20]; 
+  char tempbuff[4096];
+  unsigned char sha[20];
   assert (TGLC_rsa_n (key) && TGLC_rsa_e (key));
   int l1 = tgl_serialize_bignum (TGLC_rsa_n (key), tempbuff, 4096);
   assert (l1 > 0);
@@ -264,7 +268,7 @@ void tgl_out_data (const void *data, long len) {
   packet_ptr += len >> 2;
 }
 
-int *tgl_in_ptr, *tgl_in_end;
+TGL_THREAD int *tgl_in_ptr, *tgl_in_end;
 
 int tgl_fetch_bignum (TGLC_bn *x) {
   int l = prefetch_strlen ();
@@ -337,11 +341,11 @@ int tgl_pad_rsa_decrypt (struct tgl_state *TLS, char *from, int from_len, char *
   return chunks * 255;
 }
 
-static unsigned char aes_key_raw[32], aes_iv[32];
-static TGLC_aes_key aes_key;
+static TGL_THREAD unsigned char aes_key_raw[32], aes_iv[32];
+static TGL_THREAD TGLC_aes_key aes_key;
 
 void tgl_init_aes_unauth (const char server_nonce[16], const char hidden_client_nonce[32], int encrypt) {
-  static unsigned char buffer[64], hash[20];
+  unsigned char buffer[64], hash[20];
   memcpy (buffer, hidden_client_nonce, 32);
   memcpy (buffer + 32, server_nonce, 16);
   TGLC_sha1 (buffer, 48, aes_key_raw);
@@ -361,38 +365,43 @@ void tgl_init_aes_unauth (const char server_nonce[16], const char hidden_client_
   memset (aes_key_raw, 0, sizeof (aes_key_raw));
 }
 
-void tgl_init_aes_auth (char auth_key[192], char msg_key[16], int encrypt) {
-  static unsigned char buffer[48], hash[20];
+static void aes_auth_key_iv (char auth_key[192], char msg_key[16], unsigned char aes_key_raw[32], unsigned char aes_iv[32]) {
+  unsigned char buffer[4][48], hash[4][20];
   //  sha1_a = SHA1 (msg_key + substr (auth_key, 0, 32));
   //  sha1_b = SHA1 (substr (auth_key, 32, 16) + msg_key + substr (auth_key, 48, 16));
   //  sha1_с = SHA1 (substr (auth_key, 64, 32) + msg_key);
   //  sha1_d = SHA1 (msg_key + substr (auth_key, 96, 32));
   //  aes_key = substr (sha1_a, 0, 8) + substr (sha1_b, 8, 12) + substr (sha1_c, 4, 12);
   //  aes_iv = substr (sha1_a, 8, 12) + substr (sha1_b, 0, 8) + substr (sha1_c, 16, 4) + substr (sha1_d, 0, 8);
-  memcpy (buffer, msg_key, 16);
-  memcpy (buffer + 16, auth_key, 32);
-  TGLC_sha1 (buffer, 48, hash);
-  memcpy (aes_key_raw, hash, 8);
-  memcpy (aes_iv, hash + 8, 12);
-
-  memcpy (buffer, auth_key + 32, 16);
-  memcpy (buffer + 16, msg_key, 16);
-  memcpy (buffer + 32, auth_key + 48, 16);
-  TGLC_sha1 (buffer, 48, hash);
-  memcpy (aes_key_raw + 8, hash + 8, 12);
-  memcpy (aes_iv + 12, hash, 8);
-
-  memcpy (buffer, auth_key + 64, 32);
-  memcpy (buffer + 32, msg_key, 16);
-  TGLC_sha1 (buffer, 48, hash);
-  memcpy (aes_key_raw + 20, hash + 4, 12);
-  memcpy (aes_iv + 20, hash + 16, 4);
+  memcpy (buffer[0], msg_key, 16);
+  memcpy (buffer[0] + 16, auth_key, 32);
+
+  memcpy (buffer[1], auth_key + 32, 16);
+  memcpy (buffer[1] + 16, msg_key, 16);
+  memcpy (buffer[1] + 32, auth_key + 48, 16);
+
+  memcpy (buffer[2], auth_key + 64, 32);
+  memcpy (buffer[2] + 32, msg_key, 16);
+
+  memcpy (buffer[3], msg_key, 16);
+  memcpy (buffer[3] + 16, auth_key + 96, 32);
+
+  // all four hashes are of the same length, so they are computed at once
+  const unsigned char *d[4] = { buffer[0], buffer[1], buffer[2], buffer[3] };
+  unsigned char *md[4] = { hash[0], hash[1], hash[2], hash[3] };
+  TGLC_sha1_x4 (d, 48, md);
+
+  memcpy (aes_key_raw, hash[0], 8);
+  memcpy (aes_iv, hash[0] + 8, 12);
+  memcpy (aes_key_raw + 8, hash[1] + 8, 12);
+  memcpy (aes_iv + 12, hash[1], 8);
+  memcpy (aes_key_raw + 20, hash[2] + 4, 12);
+  memcpy (aes_iv + 20, hash[2] + 16, 4);
+  memcpy (aes_iv + 24, hash[3], 8);
+}
 
-  memcpy (buffer, msg_key, 16);
-  memcpy (buffer + 16, auth_key + 96, 32);
-  TGLC_sha1 (buffer, 48, hash);
-  memcpy (aes_iv + 24, hash, 8);
-  
+void tgl_init_aes_auth (char auth_key[192], char msg_key[16], int encrypt) {
+  aes_auth_key_iv (auth_key, msg_key, aes_key_raw, aes_iv);
   if (encrypt) {
     TGLC_aes_set_encrypt_key (aes_key_raw, 32*8, &aes_key);
   } else {
@@ -418,3 +427,50 @@ int tgl_pad_aes_decrypt (char *from, int from_len, char *to, int size) {
   TGLC_aes_ige_encrypt ((unsigned char *) from, (unsigned char *) to, from_len, &aes_key, aes_iv, 0);
   return from_len;
 }
+
+void tgl_init_aes_auth_job (struct tgl_aes_job *J, char auth_key[192], char msg_key[16], int encrypt) {
+  unsigned char key_raw[32];
+  aes_auth_key_iv (auth_key, msg_key, key_raw, J->iv);
+  if (encrypt) {
+    TGLC_aes_set_encrypt_key (key_raw, 32*8, &J->key);
+  } else {
+    TGLC_aes_set_decrypt_key (key_raw, 32*8, &J->key);
+  }
+  memset (key_raw, 0, sizeof (key_raw));
+}
+
+static void aes_many (struct tgl_aes_job *J, int n, int encrypt) {
+  if (!n) { return; }
+  TGLC_aes_ige_job *jobs = talloc (n * sizeof (*jobs));
+  int i;
+  for (i = 0; i < n; i++) {
+    jobs[i].in = (unsigned char *) J[i].data;
+    jobs[i].out = (unsigned char *) J[i].data;
+    jobs[i].length = J[i].len;
+    jobs[i].key = &J[i].key;
+    jobs[i].ivec = J[i].iv;
+  }
+  TGLC_aes_ige_encrypt_many (jobs, n, encrypt);
+  tfree (jobs, n * sizeof (*jobs));
+}
+
+void tgl_pad_aes_encrypt_many (struct tgl_aes_job *J, int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    int padded_size = (J[i].len + 15) & -16;
+    assert (J[i].len > 0);
+    if (J[i].len < padded_size) {
+      assert (TGLC_rand_pseudo_bytes ((unsigned char *) J[i].data + J[i].len, padded_size - J[i].len) >= 0);
+    }
+    J[i].len = padded_size;
+  }
+  aes_many (J, n, 1);
+}
+
+void tgl_pad_aes_decrypt_many (struct tgl_aes_job *J, int n) {
+  int i;
+  for (i = 0; i < n; i++) {
+    assert (J[i].len >= 0 && !(J[i].len & 15));
+  }
+  aes_many (J, n, 0);
+}
@@ -24,6 +24,7 @@
 #include <string.h>
 #include "crypto/rsa_pem.h"
 #include "crypto/bn.h"
+#include "crypto/aes.h"
 #include <stdio.h>
 #include <assert.h>
 
@@ -104,6 +105,17 @@
 
 #define PACKET_BUFFER_SIZE	(16384 * 100 + 16) // temp fix
 #pragma pack(push,4)
+// header of struct encrypted_message, used to serialize packets in place
+struct encrypted_header {
+  long long auth_key_id;
+  char msg_key[16];
+  long long server_salt;
+  long long session_id;
+  long long msg_id;
+  int seq_no;
+  int msg_len;
+};
+
 struct encrypted_message {
   // unencrypted header
   long long auth_key_id;
@@ -130,8 +142,10 @@ long long tgl_do_compute_rsa_key_fingerprint (TGLC_rsa *key);
 #define packet_buffer tgl_packet_buffer
 #define packet_ptr tgl_packet_ptr
 
-extern int *tgl_packet_buffer;
-extern int *tgl_packet_ptr;
+extern TGL_THREAD int *tgl_packet_buffer;
+extern TGL_THREAD int *tgl_packet_ptr;
+
+void tgl_alloc_packet_buffer (void);
 
 static inline void out_ints (const int *what, int len) {
   assert (packet_ptr + len <= packet_buffer + PACKET_BUFFER_SIZE);
@@ -159,6 +173,9 @@ static inline void out_double (double x) {
 }
 
 static inline void clear_packet (void) {
+  if (!packet_buffer) {
+    tgl_alloc_packet_buffer ();
+  }
   packet_ptr = packet_buffer;
 }
 
@@ -182,7 +199,7 @@ static inline void out_bignum (TGLC_bn *n) {
 
 #define in_ptr tgl_in_ptr
 #define in_end tgl_in_end
-extern int *tgl_in_ptr, *tgl_in_end;
+extern TGL_THREAD int *tgl_in_ptr, *tgl_in_end;
 
 
 //void fetch_pts (void);
@@ -375,6 +392,20 @@ void tgl_init_aes_unauth (const char server_nonce[16], const char hidden_client_
 void tgl_init_aes_auth (char auth_key[192], char msg_key[16], int encrypt);
 int tgl_pad_aes_encrypt (char *from, int from_len, char *to, int size);
 int tgl_pad_aes_decrypt (char *from, int from_len, char *to, int size);
+
+// independent (key, iv, buffer) job for encryption of many messages at once
+struct tgl_aes_job {
+  TGLC_aes_key key;
+  unsigned char iv[32];
+  char *data;
+  int len;
+};
+
+void tgl_init_aes_auth_job (struct tgl_aes_job *J, char auth_key[192], char msg_key[16], int encrypt);
+// pads data of every job to 16 bytes with random and encrypts it in place, len is set to padded size
+void tgl_pad_aes_encrypt_many (struct tgl_aes_job *J, int n);
+// decrypts data of every job in place, len must be divisible by 16
+void tgl_pad_aes_decrypt_many (struct tgl_aes_job *J, int n);
 /*
 static inline void hexdump_in (void) {
   hexdump (in_ptr, in_end);
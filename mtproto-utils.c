@@ -1,12 +1,29 @@
 #include "config.h"
 #include "crypto/bn.h"
+#include "crypto/sha.h"
 #include "tl-parser/portable_endian.h"
 #include "tgl.h"
+#include "tgl-inner.h"
 #include "tools.h"
 #include "mtproto-utils.h"
 
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
 static unsigned long long gcd (unsigned long long a, unsigned long long b) {
-  return b ? gcd (b, a % b) : a;
+  if (!a || !b) { return a | b; }
+  int s = __builtin_ctzll (a | b);
+  a >>= __builtin_ctzll (a);
+  do {
+    b >>= __builtin_ctzll (b);
+    if (a > b) {
+      unsigned long long t = a; a = b; b = t;
+    }
+    b -= a;
+  } while (b);
+  return a << s;
 }
 
 static int check_prime (struct tgl_state *TLS, TGLC_bn *p) {
@@ -16,6 +33,111 @@ static int check_prime (struct tgl_state *TLS, TGLC_bn *p) {
 }
 
 
+/*
+ * (p,g) pairs that passed tglmp_check_DH_params, shared by all states in the process.
+ * Server almost always sends the same group, so primality of p is tested once.
+ * Pairs are keyed by sha256 of p. If a cache file is set, they are also appended
+ * to it and loaded from it at startup, one record of g and the hash per pair.
+ */
+#define DH_CACHE_SIZE 16
+
+struct dh_cache_entry {
+  int g;
+  unsigned char hash[32];
+};
+
+static struct dh_cache_entry dh_cache[DH_CACHE_SIZE];
+static int dh_cache_num;
+static char *dh_cache_path;
+// guards the fields above, the cache file is accessed without it
+static pthread_mutex_t dh_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void dh_cache_acquire (void) {
+  pthread_mutex_lock (&dh_cache_lock);
+}
+
+static void dh_cache_release (void) {
+  pthread_mutex_unlock (&dh_cache_lock);
+}
+
+// should be called with dh_cache_lock held. Returns 1 if E was added
+static int dh_cache_insert (struct dh_cache_entry *E) {
+  int i;
+  for (i = 0; i < dh_cache_num; i++) {
+    if (!memcmp (&dh_cache[i], E, sizeof (*E))) { return 0; }
+  }
+  if (dh_cache_num == DH_CACHE_SIZE) { return 0; }
+  dh_cache[dh_cache_num ++] = *E;
+  return 1;
+}
+
+static void dh_cache_key (TGLC_bn *p, int g, struct dh_cache_entry *E) {
+  unsigned char s[256];
+  assert (TGLC_bn_num_bytes (p) == 256);
+  TGLC_bn_bn2bin (p, s);
+  memset (E, 0, sizeof (*E));
+  E->g = g;
+  TGLC_sha256 (s, 256, E->hash);
+}
+
+static int dh_cache_lookup (struct dh_cache_entry *E) {
+  int i, r = 0;
+  dh_cache_acquire ();
+  for (i = 0; i < dh_cache_num && !r; i++) {
+    r = !memcmp (&dh_cache[i], E, sizeof (*E));
+  }
+  dh_cache_release ();
+  return r;
+}
+
+static void dh_cache_add (struct dh_cache_entry *E) {
+  char *path = NULL;
+  dh_cache_acquire ();
+  if (dh_cache_insert (E) && dh_cache_path) {
+    path = tstrdup (dh_cache_path);
+  }
+  dh_cache_release ();
+  if (path) {
+    FILE *f = fopen (path, "ab");
+    if (f) {
+      fwrite (E, sizeof (*E), 1, f);
+      fclose (f);
+    }
+    tfree_str (path);
+  }
+}
+
+int tglmp_load_dh_cache (struct tgl_state *TLS, const char *path) {
+  struct dh_cache_entry L[DH_CACHE_SIZE];
+  int l = 0;
+  FILE *f = fopen (path, "rb");
+  if (f) {
+    // file may be appended by several processes, so it can have duplicates
+    while (l < DH_CACHE_SIZE && fread (&L[l], sizeof (L[l]), 1, f) == 1) {
+      int j = 0;
+      while (j < l && memcmp (&L[j], &L[l], sizeof (L[l]))) {
+        j ++;
+      }
+      if (j == l && L[l].g >= 2 && L[l].g <= 7) {
+        l ++;
+      }
+    }
+    fclose (f);
+  }
+  int i, n = 0;
+  dh_cache_acquire ();
+  if (dh_cache_path) {
+    tfree_str (dh_cache_path);
+  }
+  dh_cache_path = tstrdup (path);
+  for (i = 0; i < l; i++) {
+    n += dh_cache_insert (&L[i]);
+  }
+  dh_cache_release ();
+  vlogprintf (E_DEBUG, "loaded %d DH groups from %s\n", n, path);
+  return n;
+}
+
 // Complete set of checks see at https://core.telegram.org/mtproto/security_guidelines
 
 
@@ -23,6 +145,12 @@ static int check_prime (struct tgl_state *TLS, TGLC_bn *p) {
 int tglmp_check_DH_params (struct tgl_state *TLS, TGLC_bn *p, int g) {
   if (g < 2 || g > 7) { return -1; }
   if (TGLC_bn_num_bits (p) != 2048) { return -1; }
+
+  struct dh_cache_entry E;
+  dh_cache_key (p, g, &E);
+  if (dh_cache_lookup (&E)) {
+    return 0;
+  }
   
   TGLC_bn *t = TGLC_bn_new ();
   
@@ -69,6 +197,9 @@ int tglmp_check_DH_params (struct tgl_state *TLS, TGLC_bn *p, int g) {
   }
   TGLC_bn_free (b);
   TGLC_bn_free (t);
+  if (!res) {
+    dh_cache_add (&E);
+  }
   return res;
 }
 
@@ -121,50 +252,116 @@ static void ull2BN (TGLC_bn *b, unsigned long long val) {
   }
 }
 
+#ifdef __SIZEOF_INT128__
+// -n^-1 mod 2^64, n is odd
+static unsigned long long rho_ninv (unsigned long long n) {
+  unsigned long long x = n;
+  int i;
+  for (i = 0; i < 5; i++) {
+    x *= 2 - n * x;
+  }
+  return -x;
+}
+
+/*
+ * Montgomery product a * b / 2^64 mod n. It differs from the true product
+ * by a factor coprime to n, which does not matter for gcds taken by rho.
+ */
+static unsigned long long rho_mul (unsigned long long a, unsigned long long b, unsigned long long n, unsigned long long ninv) {
+  unsigned __int128 t = (unsigned __int128)a * b;
+  unsigned long long m = (unsigned long long)t * ninv;
+  unsigned __int128 u = (t + (unsigned __int128)m * n) >> 64;
+  if (u >= n) {
+    u -= n;
+  }
+  return u;
+}
+#else
+static unsigned long long rho_ninv (unsigned long long n) {
+  return 0;
+}
+
+static unsigned long long rho_mul (unsigned long long a, unsigned long long b, unsigned long long n, unsigned long long ninv) {
+  unsigned long long c = 0;
+  while (b) {
+    if (b & 1) {
+      c += a;
+      if (c >= n) {
+        c -= n;
+      }
+    }
+    a += a;
+    if (a >= n) {
+      a -= n;
+    }
+    b >>= 1;
+  }
+  return c;
+}
+#endif
+
+#define RHO_BATCH 128
+
+/*
+ * Brent's variant of Pollard's rho with x -> x^2 + c. Differences are multiplied
+ * together and gcd is taken once per RHO_BATCH steps.
+ * Returns a divisor of odd n < 2^63, which is n itself if this c failed.
+ */
+static unsigned long long pollard_brent (unsigned long long n, unsigned long long c, unsigned long long y) {
+  unsigned long long ninv = rho_ninv (n);
+  unsigned long long x = y, ys = y, q = 1, g = 1;
+  long long r = 1, k, i;
+  do {
+    x = y;
+    for (i = 0; i < r; i++) {
+      y = rho_mul (y, y, n, ninv) + c;
+      if (y >= n) { y -= n; }
+    }
+    for (k = 0; k < r && g == 1; k += RHO_BATCH) {
+      ys = y;
+      for (i = 0; i < RHO_BATCH && i < r - k; i++) {
+        y = rho_mul (y, y, n, ninv) + c;
+        if (y >= n) { y -= n; }
+        q = rho_mul (q, x > y ? x - y : y - x, n, ninv);
+      }
+      g = gcd (q, n);
+    }
+    r *= 2;
+  } while (g == 1);
+  if (g == n) {
+    // batch went past the factor, redo it step by step
+    do {
+      ys = rho_mul (ys, ys, n, ninv) + c;
+      if (ys >= n) { ys -= n; }
+      g = gcd (x > ys ? x - ys : ys - x, n);
+    } while (g == 1);
+  }
+  return g;
+}
+
 int bn_factorize (TGLC_bn *pq, TGLC_bn *p, TGLC_bn *q) {
-  // Should work in any case
-  // Rewrite this code
   unsigned long long what = BN2ull (pq);
+  if (what < 4 || what >= (1ull << 63)) {
+    return -1;
+  }
 
-  int it = 0;
-  
   unsigned long long g = 0;
+  if (!(what & 1)) {
+    g = 2;
+  }
   int i;
-  for (i = 0; i < 3 || it < 1000; i++) {
-    int q = ((rand() & 15) + 17) % what;
-    unsigned long long x = (long long)rand () % (what - 1) + 1, y = x;
-    int lim = 1 << (i + 18);
-    int j;
-    for (j = 1; j < lim; j++) {
-      ++it;
-      unsigned long long a = x, b = x, c = q;
-      while (b) {
-        if (b & 1) {
-          c += a;
-          if (c >= what) {
-            c -= what;
-          }
-        }
-        a += a;
-        if (a >= what) {
-          a -= what;
-        }
-        b >>= 1;
-      }
-      x = c;
-      unsigned long long z = x < y ? what + x - y : x - y;
-      g = gcd (z, what);
-      if (g != 1) {
-        break;
-      }
-      if (!(j & (j - 1))) {
-        y = x;
-      }
+  for (i = 0; i < 64 && !g; i++) {
+    unsigned long long c = (unsigned long long)rand () % (what - 1) + 1;
+    unsigned long long y = (unsigned long long)rand () % what;
+    unsigned long long d = pollard_brent (what, c, y);
+    if (d > 1 && d < what) {
+      g = d;
     }
-    if (g > 1 && g < what) break;
+  }
+  if (!g) {
+    return -1;
   }
 
-  assert (g > 1 && g < what);
   unsigned long long p1 = g;
   unsigned long long p2 = what / g;
   if (p1 > p2) {
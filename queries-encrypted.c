@@ -1,21 +1,20 @@
 
 /* {{{ Encrypt decrypted */
-static int *encr_extra;
-static int *encr_ptr;
-static int *encr_end;
-
-static char *encrypt_decrypted_message (struct tgl_secret_chat *E) {
-  static int msg_key[4];
-  static unsigned char sha1a_buffer[20];
-  static unsigned char sha1b_buffer[20];
-  static unsigned char sha1c_buffer[20];
-  static unsigned char sha1d_buffer[20];
+static TGL_THREAD int *encr_extra;
+static TGL_THREAD int *encr_ptr;
+static TGL_THREAD int *encr_end;
+
+static void encrypt_decrypted_message (struct tgl_secret_chat *E, int msg_key[4]) {
+  unsigned char sha1a_buffer[20];
+  unsigned char sha1b_buffer[20];
+  unsigned char sha1c_buffer[20];
+  unsigned char sha1d_buffer[20];
   int x = *(encr_ptr);  
   assert (x >= 0 && !(x & 3));
   TGLC_sha1 ((void *)encr_ptr, 4 + x, sha1a_buffer);
   memcpy (msg_key, sha1a_buffer + 4, 16);
  
-  static unsigned char buf[64];
+  unsigned char buf[64];
   memcpy (buf, msg_key, 16);
   memcpy (buf + 16, E->key, 32);
   TGLC_sha1 (buf, 48, sha1a_buffer);
@@ -33,12 +32,12 @@ static char *encrypt_decrypted_message (struct tgl_secret_chat *E) {
   memcpy (buf + 16, E->key + 24, 32);
   TGLC_sha1 (buf, 48, sha1d_buffer);
 
-  static unsigned char key[32];
+  unsigned char key[32];
   memcpy (key, sha1a_buffer + 0, 8);
   memcpy (key + 8, sha1b_buffer + 8, 12);
   memcpy (key + 20, sha1c_buffer + 4, 12);
 
-  static unsigned char iv[32];
+  unsigned char iv[32];
   memcpy (iv, sha1a_buffer + 8, 12);
   memcpy (iv + 12, sha1b_buffer + 0, 8);
   memcpy (iv + 20, sha1c_buffer + 16, 4);
@@ -48,8 +47,6 @@ static char *encrypt_decrypted_message (struct tgl_secret_chat *E) {
   TGLC_aes_set_encrypt_key (key, 256, &aes_key);
   TGLC_aes_ige_encrypt ((void *)encr_ptr, (void *)encr_ptr, 4 * (encr_end - encr_ptr), &aes_key, iv, 1);
   memset (&aes_key, 0, sizeof (aes_key));
-
-  return (void *)msg_key;
 }
 
 static void encr_start (void) {
@@ -76,7 +73,7 @@ static void encr_finish (struct tgl_secret_chat *E) {
   encr_extra[4] = l * 4;
   encr_ptr = encr_extra + 4;
   encr_end = packet_ptr;
-  memcpy (encr_extra, encrypt_decrypted_message (E), 16);
+  encrypt_decrypted_message (E, encr_extra);
 }
 /* }}} */
 
@@ -96,7 +93,8 @@ void tgl_do_send_encr_action (struct tgl_state *TLS, struct tgl_secret_chat *E,
 }
 
 void tgl_do_send_encr_chat_layer (struct tgl_state *TLS, struct tgl_secret_chat *E) {
-  static struct tl_ds_decrypted_message_action A;
+  struct tl_ds_decrypted_message_action A;
+  memset (&A, 0, sizeof (A));
   A.magic = CODE_decrypted_message_action_notify_layer;
   int layer = TGL_ENCRYPTED_LAYER;
   A.layer = &layer;
@@ -105,7 +103,8 @@ void tgl_do_send_encr_chat_layer (struct tgl_state *TLS, struct tgl_secret_chat
 }
 
 void tgl_do_set_encr_chat_ttl (struct tgl_state *TLS, struct tgl_secret_chat *E, int ttl, void (*callback)(struct tgl_state *TLS, void *callback_extra, int success, struct tgl_message *M), void *callback_extra) {
-  static struct tl_ds_decrypted_message_action A;
+  struct tl_ds_decrypted_message_action A;
+  memset (&A, 0, sizeof (A));
   A.magic = CODE_decrypted_message_action_set_message_t_t_l;
   A.layer = &ttl;
 
@@ -562,10 +561,10 @@ void tgl_do_send_accept_encr_chat (struct tgl_state *TLS, struct tgl_secret_chat
   TGLC_bn *r = TGLC_bn_new ();
   ensure_ptr (r);
   ensure (TGLC_bn_mod_exp (r, g_a, b, p, TLS->TGLC_bn_ctx));
-  static unsigned char kk[256];
+  unsigned char kk[256];
   memset (kk, 0, sizeof (kk));
   TGLC_bn_bn2bin (r, kk + (256 - TGLC_bn_num_bytes (r)));
-  static unsigned char sha_buffer[20];
+  unsigned char sha_buffer[20];
   TGLC_sha1 (kk, 256, sha_buffer);
 
   long long fingerprint = *(long long *)(sha_buffer + 12);
@@ -592,7 +591,7 @@ void tgl_do_send_accept_encr_chat (struct tgl_state *TLS, struct tgl_secret_chat
   
   ensure (TGLC_bn_set_word (g_a, TLS->encr_root));
   ensure (TGLC_bn_mod_exp (r, g_a, b, p, TLS->TGLC_bn_ctx));
-  static unsigned char buf[256];
+  unsigned char buf[256];
   memset (buf, 0, sizeof (buf));
   TGLC_bn_bn2bin (r, buf + (256 - TGLC_bn_num_bytes (r)));
   out_cstring ((void *)buf, 256);
@@ -625,7 +624,7 @@ void tgl_do_create_keys_end (struct tgl_state *TLS, struct tgl_secret_chat *U) {
   memset (U->key, 0, sizeof (U->key));
   TGLC_bn_bn2bin (r, (void *)(((char *)(U->key)) + (256 - TGLC_bn_num_bytes (r))));
   
-  static unsigned char sha_buffer[20];
+  unsigned char sha_buffer[20];
   TGLC_sha1 ((void *)U->key, 256, sha_buffer);
   long long k = *(long long *)(sha_buffer + 12);
   if (k != U->key_fingerprint) {
@@ -666,7 +665,7 @@ void tgl_do_send_create_encr_chat (struct tgl_state *TLS, void *x, unsigned char
 
   TGLC_bn_clear_free (a);
 
-  static char g_a[256];
+  char g_a[256];
   memset (g_a, 0, 256);
 
   TGLC_bn_bn2bin (r, (void *)(g_a + (256 - TGLC_bn_num_bytes (r))));
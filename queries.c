@@ -52,6 +52,8 @@
 #include "no-preview.h"
 #include "tgl-binlog.h"
 #include "updates.h"
+#include "tgl-inflate.h"
+#include "tgl-timer-wheel.h"
 #include "auto.h"
 #include "auto/auto-types.h"
 #include "auto/auto-skip.h"
@@ -115,8 +117,83 @@ struct send_file {
   int channel;
 };
 
-#define memcmp8(a,b) memcmp ((a), (b), 8)
-DEFINE_TREE (query, struct query *, memcmp8, 0) ;
+/*
+ * Queries in flight are indexed by msg_id in an open addressing table with linear probing.
+ * msg_id is kept next to the pointer, so a lookup does not touch the queries it skips.
+ * The table is at most half full and never shrinks.
+ */
+struct tgl_query_slot {
+  long long msg_id;
+  struct query *q;
+};
+
+#define QUERY_INDEX_MIN_SIZE 256
+
+static unsigned query_index_hash (struct tgl_state *TLS, long long msg_id) {
+  // low bits of msg_id are almost constant, high bits are time
+  return (unsigned)(((unsigned long long)msg_id * 0x9e3779b97f4a7c15ull) >> 32) & (TLS->queries_index_size - 1);
+}
+
+static void query_index_add (struct tgl_state *TLS, struct query *q) {
+  unsigned mask = TLS->queries_index_size - 1;
+  unsigned h = query_index_hash (TLS, q->msg_id);
+  while (TLS->queries_index[h].q) {
+    h = (h + 1) & mask;
+  }
+  TLS->queries_index[h].msg_id = q->msg_id;
+  TLS->queries_index[h].q = q;
+}
+
+static void query_index_insert (struct tgl_state *TLS, struct query *q) {
+  if (2 * (TLS->queries_index_num + 1) > TLS->queries_index_size) {
+    struct tgl_query_slot *old = TLS->queries_index;
+    int old_size = TLS->queries_index_size;
+    TLS->queries_index_size = old_size ? 2 * old_size : QUERY_INDEX_MIN_SIZE;
+    TLS->queries_index = talloc0 (TLS->queries_index_size * sizeof (struct tgl_query_slot));
+    int i;
+    for (i = 0; i < old_size; i++) if (old[i].q) {
+      query_index_add (TLS, old[i].q);
+    }
+    if (old) {
+      tfree (old, old_size * sizeof (struct tgl_query_slot));
+    }
+  }
+  query_index_add (TLS, q);
+  TLS->queries_index_num ++;
+}
+
+static int query_index_find (struct tgl_state *TLS, long long msg_id) {
+  if (!TLS->queries_index_num) { return -1; }
+  unsigned mask = TLS->queries_index_size - 1;
+  unsigned h = query_index_hash (TLS, msg_id);
+  while (TLS->queries_index[h].q) {
+    if (TLS->queries_index[h].msg_id == msg_id) {
+      return h;
+    }
+    h = (h + 1) & mask;
+  }
+  return -1;
+}
+
+// does nothing for queries not in the index
+static void query_index_delete (struct tgl_state *TLS, struct query *q) {
+  int p = query_index_find (TLS, q->msg_id);
+  if (p < 0 || TLS->queries_index[p].q != q) { return; }
+  TLS->queries_index_num --;
+  // entries after the hole are moved back unless they are already at their place
+  unsigned mask = TLS->queries_index_size - 1;
+  unsigned i = p, j = p;
+  while (1) {
+    j = (j + 1) & mask;
+    if (!TLS->queries_index[j].q) { break; }
+    unsigned h = query_index_hash (TLS, TLS->queries_index[j].msg_id);
+    if (((j - h) & mask) >= ((j - i) & mask)) {
+      TLS->queries_index[i] = TLS->queries_index[j];
+      i = j;
+    }
+  }
+  TLS->queries_index[i].q = NULL;
+}
 
 static int mystreq1 (const char *a, const char *b, int l) {
   if ((int)strlen (a) != l) { return 1; }
@@ -126,16 +203,86 @@ static int mystreq1 (const char *a, const char *b, int l) {
 /* {{{ COMMON */
 
 struct query *tglq_query_get (struct tgl_state *TLS, long long id) {
-  return tree_lookup_query (TLS->queries_tree, (void *)&id);
+  int p = query_index_find (TLS, id);
+  return p >= 0 ? TLS->queries_index[p].q : NULL;
+}
+
+// queries of a DC are kept in a list, so a DC or session can be walked without the whole index
+static void query_set_dc (struct query *q, struct tgl_dc *DC) {
+  struct tgl_dc *O = q->DC;
+  if (O == DC) { return; }
+  if (O) {
+    if (q->dc_prev) {
+      q->dc_prev->dc_next = q->dc_next;
+    } else {
+      O->queries = q->dc_next;
+    }
+    if (q->dc_next) {
+      q->dc_next->dc_prev = q->dc_prev;
+    }
+  }
+  q->DC = DC;
+  q->dc_prev = NULL;
+  q->dc_next = NULL;
+  if (DC) {
+    q->dc_next = DC->queries;
+    if (DC->queries) {
+      DC->queries->dc_prev = q;
+    }
+    DC->queries = q;
+  }
+}
+
+static void query_set_session (struct query *q, struct tgl_session *S) {
+  struct tgl_session *O = q->session;
+  if (O == S) { return; }
+  if (O) {
+    if (q->session_prev) {
+      q->session_prev->session_next = q->session_next;
+    } else {
+      O->queries = q->session_next;
+    }
+    if (q->session_next) {
+      q->session_next->session_prev = q->session_prev;
+    }
+    O->queries_num --;
+    if (q->flags & QUERY_BULK) {
+      O->bulk_queries_num --;
+    }
+  }
+  q->session = S;
+  q->session_prev = NULL;
+  q->session_next = NULL;
+  if (S) {
+    q->session_next = S->queries;
+    if (S->queries) {
+      S->queries->session_prev = q;
+    }
+    S->queries = q;
+    S->queries_num ++;
+    if (q->flags & QUERY_BULK) {
+      S->bulk_queries_num ++;
+    }
+  }
+}
+
+void tglq_forget_session (struct tgl_state *TLS, struct tgl_session *S) {
+  while (S->queries) {
+    query_set_session (S->queries, NULL);
+  }
+}
+
+static int query_session_alive (struct query *q) {
+  return q->session && q->session_id && q->DC && q->session->dc == q->DC && q->session->session_id == q->session_id;
 }
 
 static int alarm_query (struct tgl_state *TLS, struct query *q) {
   assert (q);
   vlogprintf (E_DEBUG - 2, "Alarm query %" INT64_PRINTF_MODIFIER "d (type '%s')\n", q->msg_id, q->methods->name);
 
-  TLS->timer_methods->insert (q->ev, q->methods->timeout ? q->methods->timeout : QUERY_TIMEOUT);
+  tglw_timer_insert (TLS, &q->ev, q->methods->timeout ? q->methods->timeout : QUERY_TIMEOUT);
 
-  if (q->session && q->session_id && q->DC && q->DC->sessions[0] == q->session && q->session->session_id == q->session_id) {
+  if (query_session_alive (q)) {
     clear_packet ();
     out_int (CODE_msg_container);
     out_int (1);
@@ -147,14 +294,12 @@ static int alarm_query (struct tgl_state *TLS, struct query *q) {
     tglmp_encrypt_send_message (TLS, q->session->c, packet_buffer, packet_ptr - packet_buffer, q->flags & QUERY_FORCE_SEND);
   } else {
     q->flags &= ~QUERY_ACK_RECEIVED;
-    if (tree_lookup_query (TLS->queries_tree, q)) {
-      TLS->queries_tree = tree_delete_query (TLS->queries_tree, q);
-    }
-    q->session = q->DC->sessions[0];
+    query_index_delete (TLS, q);
+    query_set_session (q, tglmp_dc_get_session (TLS, q->DC, q->flags));
     long long old_id = q->msg_id;
-    q->msg_id = tglmp_encrypt_send_message (TLS, q->session->c, q->data, q->data_len, (q->flags & QUERY_FORCE_SEND) | 1);
+    q->msg_id = tglmp_encrypt_send_message (TLS, q->session->c, q->data, q->data_len, 1 | ((q->flags & QUERY_FORCE_SEND) ? 2 : 4));
     vlogprintf (E_NOTICE, "Resent query #%" INT64_PRINTF_MODIFIER "d as #%" INT64_PRINTF_MODIFIER "d of size %d to DC %d\n", old_id, q->msg_id, 4 * q->data_len, q->DC->id);
-    TLS->queries_tree = tree_insert_query (TLS->queries_tree, q, rand ());
+    query_index_insert (TLS, q);
     q->session_id = q->session->session_id;
     if (!(q->session->dc->flags & 4) && !(q->flags & QUERY_FORCE_SEND)) {
       q->session_id = 0;
@@ -164,11 +309,15 @@ static int alarm_query (struct tgl_state *TLS, struct query *q) {
 }
 
 void tglq_regen_query (struct tgl_state *TLS, long long id) {
+  tglq_regen_query_after (TLS, id, 0.001);
+}
+
+void tglq_regen_query_after (struct tgl_state *TLS, long long id, double timeout) {
   struct query *q = tglq_query_get (TLS, id);
   if (!q) { return; }
   q->flags &= ~QUERY_ACK_RECEIVED;
 
-  if (!(q->session && q->session_id && q->DC && q->DC->sessions[0] == q->session && q->session->session_id == q->session_id)) {
+  if (!query_session_alive (q)) {
     q->session_id = 0;
   } else {
     if (!(q->session->dc->flags & 4) && !(q->flags & QUERY_FORCE_SEND)) {
@@ -176,40 +325,28 @@ void tglq_regen_query (struct tgl_state *TLS, long long id) {
     }
   }
   vlogprintf (E_NOTICE, "regen query %" INT64_PRINTF_MODIFIER "d\n", id);
-  TLS->timer_methods->insert (q->ev, 0.001);
+  tglw_timer_insert (TLS, &q->ev, timeout);
 }
 
-struct regen_tmp_struct {
-  struct tgl_state *TLS;
-  struct tgl_dc *DC;
-  struct tgl_session *S;
-};
-
-void tglq_regen_query_from_old_session (struct query *q, void *ex) {
-  struct regen_tmp_struct *T = ex;
-  struct tgl_state *TLS = T->TLS;
-  if (q->DC == T->DC) {
-    if (!q->session || q->session_id != T->S->session_id || q->session != T->S) {
-      q->session_id = 0;
-      vlogprintf (E_NOTICE, "regen query from old session %" INT64_PRINTF_MODIFIER "d\n", q->msg_id);
-      TLS->timer_methods->insert (q->ev, q->methods->timeout ? 0.001 : 0.1);
+void tglq_regen_queries_from_old_session (struct tgl_state *TLS, struct tgl_dc *DC, struct tgl_session *S) {
+  struct query *q;
+  for (q = DC->queries; q; q = q->dc_next) {
+    // queries out of the index are waiting for a resend on their own
+    if ((!q->session || q->session == S) && tglq_query_get (TLS, q->msg_id) == q) {
+      if (!q->session || q->session_id != S->session_id) {
+        q->session_id = 0;
+        vlogprintf (E_NOTICE, "regen query from old session %" INT64_PRINTF_MODIFIER "d\n", q->msg_id);
+        tglw_timer_insert (TLS, &q->ev, q->methods->timeout ? 0.001 : 0.1);
+      }
     }
   }
 }
 
-void tglq_regen_queries_from_old_session (struct tgl_state *TLS, struct tgl_dc *DC, struct tgl_session *S) {
-  struct regen_tmp_struct T;
-  T.TLS = TLS;
-  T.DC = DC;
-  T.S = S;
-  tree_act_ex_query (TLS->queries_tree, tglq_regen_query_from_old_session, &T);
-}
-
 void tglq_query_restart (struct tgl_state *TLS, long long id) {
   struct query *q = tglq_query_get (TLS, id);
   if (q) {
     vlogprintf (E_NOTICE, "restarting query %" INT64_PRINTF_MODIFIER "d\n", id);
-    TLS->timer_methods->remove (q->ev);
+    tglw_timer_remove (TLS, &q->ev);
     alarm_query (TLS, q);
   }
 }
@@ -219,19 +356,44 @@ static void alarm_query_gateway (struct tgl_state *TLS, void *arg) {
 }
 
 
+/*
+ * Wraps the query into gzip_packed, if that saves at least 1/8 of it.
+ * Packed query is left in packet_buffer. Returns its length in ints or 0.
+ */
+static int gzip_query (struct tgl_state *TLS, void *data, int ints) {
+  int max_len = 4 * ints - ints / 2 - 12;
+  if (max_len <= 0) { return 0; }
+  char *buf = talloc (max_len);
+  int l = tgl_deflate (data, 4 * ints, buf, max_len);
+  if (l > 0) {
+    clear_packet ();
+    out_int (CODE_gzip_packed);
+    out_cstring (buf, l);
+    vlogprintf (E_DEBUG, "packed query of %d bytes to %d\n", 4 * ints, l);
+  }
+  tfree (buf, max_len);
+  return l > 0 ? packet_ptr - packet_buffer : 0;
+}
+
 struct query *tglq_send_query_ex (struct tgl_state *TLS, struct tgl_dc *DC, int ints, void *data, struct query_methods *methods, void *extra, void *callback, void *callback_extra, int flags) {
   assert (DC);
   assert (DC->auth_key_id);
-  if (!DC->sessions[0]) {
-    tglmp_dc_create_session (TLS, DC);
+  if (TLS->gzip_threshold > 0 && 4 * ints >= TLS->gzip_threshold && !methods->no_gzip && !(flags & QUERY_FORCE_SEND)) {
+    int l = gzip_query (TLS, data, ints);
+    if (l) {
+      data = packet_buffer;
+      ints = l;
+    }
   }
+  struct tgl_session *S = tglmp_dc_get_session (TLS, DC, flags);
   vlogprintf (E_DEBUG, "Sending query of size %d to DC %d\n", 4 * ints, DC->id);
   struct query *q = talloc0 (sizeof (*q));
   q->data_len = ints;
   q->data = talloc (4 * ints);
   memcpy (q->data, data, 4 * ints);
-  q->msg_id = tglmp_encrypt_send_message (TLS, DC->sessions[0]->c, data, ints, 1 | (flags & QUERY_FORCE_SEND));
-  q->session = DC->sessions[0];
+  q->flags = flags & (QUERY_FORCE_SEND | QUERY_BULK | QUERY_NEXT_TEMP_KEY);
+  q->msg_id = tglmp_encrypt_send_message (TLS, S->c, data, ints, 1 | ((flags & QUERY_FORCE_SEND) ? 2 : 4));
+  query_set_session (q, S);
   q->seq_no = q->session->seq_no - 1;
   q->session_id = q->session->session_id;
   if (!(DC->flags & 4) && !(flags & QUERY_FORCE_SEND)) {
@@ -241,15 +403,11 @@ struct query *tglq_send_query_ex (struct tgl_state *TLS, struct tgl_dc *DC, int
   vlogprintf (E_NOTICE, "Sent query #%" INT64_PRINTF_MODIFIER "d of size %d to DC %d\n", q->msg_id, 4 * ints, DC->id);
   q->methods = methods;
   q->type = methods->type;
-  q->DC = DC;
-  q->flags = flags & QUERY_FORCE_SEND;
-  if (TLS->queries_tree) {
-    vlogprintf (E_DEBUG + 2, "%" INT64_PRINTF_MODIFIER "d %" INT64_PRINTF_MODIFIER "d\n", q->msg_id, TLS->queries_tree->x->msg_id);
-  }
-  TLS->queries_tree = tree_insert_query (TLS->queries_tree, q, rand ());
+  query_set_dc (q, DC);
+  query_index_insert (TLS, q);
 
-  q->ev = TLS->timer_methods->alloc (TLS, alarm_query_gateway, q);
-  TLS->timer_methods->insert (q->ev, q->methods->timeout ? q->methods->timeout : QUERY_TIMEOUT);  
+  tglw_timer_init (&q->ev, alarm_query_gateway, q);
+  tglw_timer_insert (TLS, &q->ev, q->methods->timeout ? q->methods->timeout : QUERY_TIMEOUT);
 
   q->extra = extra;
   q->callback = callback;
@@ -273,7 +431,7 @@ void tglq_query_ack (struct tgl_state *TLS, long long id) {
   if (q && !(q->flags & QUERY_ACK_RECEIVED)) {
     assert (q->msg_id == id);
     q->flags |= QUERY_ACK_RECEIVED;
-    TLS->timer_methods->remove (q->ev);
+    tglw_timer_remove (TLS, &q->ev);
   }
 }
 
@@ -282,12 +440,11 @@ void tglq_query_delete (struct tgl_state *TLS, long long id) {
   if (!q) {
     return;
   }
-  if (!(q->flags & QUERY_ACK_RECEIVED)) {
-    TLS->timer_methods->remove (q->ev);
-  }
-  TLS->queries_tree = tree_delete_query (TLS->queries_tree, q);
+  query_index_delete (TLS, q);
+  query_set_session (q, NULL);
+  query_set_dc (q, NULL);
   tfree (q->data, q->data_len * 4);
-  TLS->timer_methods->free (q->ev);
+  tglw_timer_remove (TLS, &q->ev);
   TLS->active_queries --;
 }
 
@@ -295,16 +452,23 @@ static void resend_query_cb (struct tgl_state *TLS, void *_q, int success);
 
 void tglq_free_query (struct query *q, void *extra) {
   struct tgl_state *TLS = extra;
-  if (!(q->flags & QUERY_ACK_RECEIVED)) {
-    TLS->timer_methods->remove (q->ev);
-  }
+  query_set_session (q, NULL);
+  query_set_dc (q, NULL);
   tfree (q->data, q->data_len * 4);
-  TLS->timer_methods->free (q->ev);
+  tglw_timer_remove (TLS, &q->ev);
 }
 
 void tglq_query_free_all (struct tgl_state *TLS) {
-  tree_act_ex_query (TLS->queries_tree, tglq_free_query, TLS);
-  TLS->queries_tree = tree_clear_query (TLS->queries_tree);
+  int i;
+  for (i = 0; i < TLS->queries_index_size; i++) if (TLS->queries_index[i].q) {
+    tglq_free_query (TLS->queries_index[i].q, TLS);
+  }
+  if (TLS->queries_index) {
+    tfree (TLS->queries_index, TLS->queries_index_size * sizeof (struct tgl_query_slot));
+  }
+  TLS->queries_index = NULL;
+  TLS->queries_index_size = 0;
+  TLS->queries_index_num = 0;
 }
 
 int tglq_query_error (struct tgl_state *TLS, long long id) {
@@ -318,9 +482,9 @@ int tglq_query_error (struct tgl_state *TLS, long long id) {
     vlogprintf (E_WARNING, "No such query\n");
   } else {
     if (!(q->flags & QUERY_ACK_RECEIVED)) {
-      TLS->timer_methods->remove (q->ev);
+      tglw_timer_remove (TLS, &q->ev);
     }
-    TLS->queries_tree = tree_delete_query (TLS->queries_tree, q);
+    query_index_delete (TLS, q);
     int res = 0;
 
     int error_handled = 0;
@@ -353,8 +517,8 @@ int tglq_query_error (struct tgl_state *TLS, long long id) {
             //if (!(DC->flags & 4) && !(q->flags & QUERY_FORCE_SEND)) {
             q->session_id = 0;
             //}
-            q->DC = TLS->DC_working;
-            TLS->timer_methods->insert (q->ev, 0);
+            query_set_dc (q, TLS->DC_working);
+            tglw_timer_insert (TLS, &q->ev, 0);
             error_handled = 1;
             res = 1;
           }
@@ -398,7 +562,7 @@ int tglq_query_error (struct tgl_state *TLS, long long id) {
           wait = atoll (error + 11);
         }
         q->flags &= ~QUERY_ACK_RECEIVED;
-        TLS->timer_methods->insert (q->ev, wait);
+        tglw_timer_insert (TLS, &q->ev, wait);
         struct tgl_dc *DC = q->DC;
         if (!(DC->flags & 4) && !(q->flags & QUERY_FORCE_SEND)) {
           q->session_id = 0;
@@ -418,8 +582,10 @@ int tglq_query_error (struct tgl_state *TLS, long long id) {
     }
 
     if (res <= 0) {
+      query_set_session (q, NULL);
+      query_set_dc (q, NULL);
       tfree (q->data, q->data_len * 4);
-      TLS->timer_methods->free (q->ev);
+      tglw_timer_remove (TLS, &q->ev);
     }
 
     if (res == -11) {
@@ -432,34 +598,38 @@ int tglq_query_error (struct tgl_state *TLS, long long id) {
   return 0;
 }
 
-#define MAX_PACKED_SIZE (1 << 24)
-static int packed_buffer[MAX_PACKED_SIZE / 4];
-
 int tglq_query_result (struct tgl_state *TLS, long long id) {
   vlogprintf (E_DEBUG, "result for query #%" INT64_PRINTF_MODIFIER "d. Size %ld bytes\n", id, (long)4 * (in_end - in_ptr));
   int op = prefetch_int ();
   int *end = 0;
   int *eend = 0;
+  struct tgl_inflate_buf *B = NULL;
   if (op == CODE_gzip_packed) {
     fetch_int ();
     int l = prefetch_strlen ();
     char *s = fetch_str (l);
-    int total_out = tgl_inflate (s, l, packed_buffer, MAX_PACKED_SIZE);
-    vlogprintf (E_DEBUG, "inflated %d bytes\n", total_out);
+    B = tgl_inflate_packed (TLS, s, l);
+    if (!B) {
+      // the query stays in place and is resent once the session is restored
+      return -1;
+    }
     end = in_ptr;
     eend = in_end;
-    in_ptr = packed_buffer;
-    in_end = in_ptr + total_out / 4;
+    in_ptr = B->data;
+    in_end = in_ptr + B->len / 4;
   }
   struct query *q = tglq_query_get (TLS, id);
+  if (B) {
+    tgl_inflate_account (TLS, q ? q->methods->name : "unknown query", B);
+  }
   if (!q) {
     vlogprintf (E_WARNING, "No such query\n");
     in_ptr = in_end;
   } else {
     if (!(q->flags & QUERY_ACK_RECEIVED)) {
-      TLS->timer_methods->remove (q->ev);
+      tglw_timer_remove (TLS, &q->ev);
     }
-    TLS->queries_tree = tree_delete_query (TLS->queries_tree, q);
+    query_index_delete (TLS, q);
     if (q->methods && q->methods->on_answer) {
       assert (q->type);
       int *save = in_ptr;
@@ -481,8 +651,10 @@ int tglq_query_result (struct tgl_state *TLS, long long id) {
 
       assert (in_ptr == in_end);
     }
+    query_set_session (q, NULL);
+    query_set_dc (q, NULL);
     tfree (q->data, 4 * q->data_len);
-    TLS->timer_methods->free (q->ev);
+    tglw_timer_remove (TLS, &q->ev);
     tfree (q, sizeof (*q));
 
   }
@@ -490,13 +662,16 @@ int tglq_query_result (struct tgl_state *TLS, long long id) {
     in_ptr = end;
     in_end = eend;
   }
+  if (B) {
+    tgl_inflate_release (TLS, B);
+  }
   TLS->active_queries --;
   return 0;
 }
 
 static void out_random (int n) {
   assert (n <= 32);
-  static char buf[32];
+  char buf[32];
   tglt_secure_random (buf, n);
   out_cstring (buf, n);
 }
@@ -512,7 +687,7 @@ void tgl_do_insert_header (struct tgl_state *TLS) {
     struct utsname st;
     uname (&st);
     out_string (st.machine);
-    static char buf[4096];
+    char buf[4096];
     tsnprintf (buf, sizeof (buf) - 1, "%.999s %.999s %.999s", st.sysname, st.release, st.version);
     out_string (buf);
     tsnprintf (buf, sizeof (buf) - 1, "%s (TGL %s)", TLS->app_version, TGL_VERSION);
@@ -521,7 +696,7 @@ void tgl_do_insert_header (struct tgl_state *TLS) {
   } else {
     out_string ("x86");
     out_string ("Linux");
-    static char buf[4096];
+    char buf[4096];
     tsnprintf (buf, sizeof (buf) - 1, "%s (TGL %s)", TLS->app_version, TGL_VERSION);
     out_string (buf);
     out_string ("en");
@@ -529,7 +704,7 @@ void tgl_do_insert_header (struct tgl_state *TLS) {
 #else
     out_string ("x86");
     out_string ("Windows");
-    static char buf[4096];
+    char buf[4096];
     tsnprintf (buf, sizeof (buf) - 1, "%s (TGL %s)", TLS->app_version, TGL_VERSION);
     out_string (buf);
     out_string ("en");
@@ -538,7 +713,7 @@ void tgl_do_insert_header (struct tgl_state *TLS) {
 
 void tgl_set_query_error (struct tgl_state *TLS, int error_code, const char *format, ...) __attribute__ ((format (printf, 3, 4)));
 void tgl_set_query_error (struct tgl_state *TLS, int error_code, const char *format, ...) {
-  static char s[1001];
+  char s[1001];
 
   va_list ap;
   va_start (ap, format);
@@ -1263,7 +1438,10 @@ void tgl_do_send_text (struct tgl_state *TLS, tgl_peer_id_t id, const char *file
     }
     return;
   }
-  static char buf[(1 << 20) + 1];
+  static TGL_THREAD char *buf;
+  if (!buf) {
+    buf = talloc ((1 << 20) + 1);
+  }
   int x = read (fd, buf, (1 << 20) + 1);
   if (x < 0) {
     tgl_set_query_error (TLS, EBADF, "Can not read from file: %s", strerror(errno));
@@ -1844,7 +2022,8 @@ static struct query_methods send_file_part_methods = {
   .on_answer = send_file_part_on_answer,
   .on_error = send_file_part_on_error,
   .type = TYPE_TO_PARAM(bool),
-  .name = "send file part"
+  .name = "send file part",
+  .no_gzip = 1
 };
 
 static struct query_methods set_photo_methods = {
@@ -2034,7 +2213,10 @@ static void send_part (struct tgl_state *TLS, struct send_file *f, void *callbac
       out_int (f->part_num ++);
       out_int ((f->size + f->part_size - 1) / f->part_size);
     }
-    static char buf[512 << 10];
+    static TGL_THREAD char *buf;
+    if (!buf) {
+      buf = talloc (512 << 10);
+    }
     int x = read (f->fd, buf, f->part_size);
     assert (x > 0);
     f->offset += x;
@@ -2061,7 +2243,7 @@ static void send_part (struct tgl_state *TLS, struct send_file *f, void *callbac
       assert (f->part_size == x);
     }
     //update_prompt ();
-    tglq_send_query (TLS, TLS->DC_working, packet_ptr - packet_buffer, packet_buffer, &send_file_part_methods, f, callback, callback_extra);
+    tglq_send_query_ex (TLS, TLS->DC_working, packet_ptr - packet_buffer, packet_buffer, &send_file_part_methods, f, callback, callback_extra, QUERY_BULK);
   } else {
     send_file_end (TLS, f, callback, callback_extra);
   }
@@ -3063,8 +3245,10 @@ static void resend_query_cb (struct tgl_state *TLS, void *_q, int success) {
   out_int (CODE_input_user_self);
   tglq_send_query (TLS, q->DC, packet_ptr - packet_buffer, packet_buffer, &user_info_methods, 0, q->callback, q->callback_extra);
 
+  query_set_session (q, NULL);
+  query_set_dc (q, NULL);
   tfree (q->data, 4 * q->data_len);
-  TLS->timer_methods->free (q->ev);
+  tglw_timer_remove (TLS, &q->ev);
   tfree (q, sizeof (*q));
 }
 /* }}} */
@@ -3199,7 +3383,7 @@ static struct query_methods download_methods = {
 
 static void load_next_part (struct tgl_state *TLS, struct download *D, void *callback, void *callback_extra) {
   if (!D->offset) {
-    static char buf[PATH_MAX];
+    char buf[PATH_MAX];
     int l;
     if (!D->id) {
       l = tsnprintf (buf, sizeof (buf), "%s/download_%" INT64_PRINTF_MODIFIER "d_%d.jpg", TLS->downloads_directory, D->volume, D->local_id);
@@ -3250,7 +3434,7 @@ static void load_next_part (struct tgl_state *TLS, struct download *D, void *cal
   }
   out_int (D->offset);
   out_int (D->size ? (1 << 14) : (1 << 19));
-  tglq_send_query (TLS, TLS->DC_list[D->dc], packet_ptr - packet_buffer, packet_buffer, &download_methods, D, callback, callback_extra);
+  tglq_send_query_ex (TLS, TLS->DC_list[D->dc], packet_ptr - packet_buffer, packet_buffer, &download_methods, D, callback, callback_extra, QUERY_BULK);
   //tglq_send_query (TLS, TLS->DC_working, packet_ptr - packet_buffer, packet_buffer, &download_methods, D);
 }
 
@@ -3730,9 +3914,7 @@ static int get_difference_on_answer (struct tgl_state *TLS, struct query *q, voi
 
     int el_pos = DS_LVAL (DS_UD->new_encrypted_messages->cnt);
     struct tgl_message **EL = talloc (el_pos * sizeof (void *));
-    for (i = 0; i < el_pos; i++) {
-      EL[i] = tglf_fetch_alloc_encrypted_message (TLS, DS_UD->new_encrypted_messages->data[i]);
-    }
+    tglf_fetch_alloc_encrypted_messages (TLS, DS_UD->new_encrypted_messages->data, el_pos, EL);
 
     for (i = 0; i < DS_LVAL (DS_UD->other_updates->cnt); i++) {
       tglu_work_update (TLS, 1, DS_UD->other_updates->data[i]);
@@ -4351,11 +4533,10 @@ static int get_messages_on_answer (struct tgl_state *TLS, struct query *q, void
   }
 
   struct tgl_message **ML;
+  struct tgl_message *M = NULL;
   if (q->extra) {
     ML = talloc0 (sizeof (void *) * DS_LVAL (DS_MM->messages->cnt));
   } else {
-    static struct tgl_message *M;
-    M = NULL;
     ML = &M;
     assert (DS_LVAL (DS_MM->messages->cnt) <= 1);
   }
@@ -4544,8 +4725,8 @@ static struct query_methods set_password_methods = {
 
 static void tgl_do_act_set_password (struct tgl_state *TLS, const char *current_password, int current_password_len, const char *new_password, int new_password_len, const char *current_salt, int current_salt_len, const char *new_salt, int new_salt_len, const char *hint, int hint_len, void (*callback)(struct tgl_state *TLS, void *callback_extra, int success), void *callback_extra) {
   clear_packet ();
-  static char s[512];
-  static unsigned char shab[32];
+  char s[512];
+  unsigned char shab[32];
 
   assert (current_salt_len <= 128);
   assert (current_password_len <= 128);
@@ -4569,7 +4750,7 @@ static void tgl_do_act_set_password (struct tgl_state *TLS, const char *current_
   if (new_password_len) {
     out_int (1);
 
-    static char d[256];
+    char d[256];
     memcpy (d, new_salt, new_salt_len);
 
     int l = new_salt_len;
@@ -4675,7 +4856,7 @@ static int set_get_password_on_answer (struct tgl_state *TLS, struct query *q, v
   if (DS_AP->magic == CODE_account_no_password) {
     TLS->callback.get_values (TLS, tgl_new_password, "new password: ", 2, tgl_on_new_pwd, E);
   } else {
-    static char s[512];
+    static TGL_THREAD char s[512];
     snprintf (s, 511, "old password (hint %.*s): ", DS_RSTR (DS_AP->hint));
     TLS->callback.get_values (TLS, tgl_cur_and_new_password, s, 3, tgl_on_old_pwd, E);
   }
@@ -4739,8 +4920,8 @@ static void tgl_pwd_got (struct tgl_state *TLS, const char *pwd[], void *_T) {
   struct check_password_extra *E = _T;
 
   clear_packet ();
-  static char s[512];
-  static unsigned char shab[32];
+  char s[512];
+  unsigned char shab[32];
 
   assert (E->current_salt_len <= 128);
   assert (strlen (pwd[0]) <= 128);
@@ -4784,7 +4965,7 @@ static int check_get_password_on_answer (struct tgl_state *TLS, struct query *q,
     TLS->locks ^= TGL_LOCK_PASSWORD;
     return 0;
   }
-  static char s[512];
+  static TGL_THREAD char s[512];
   snprintf (s, 511, "type password (hint %.*s): ", DS_RSTR (DS_AP->hint));
 
   struct check_password_extra *E = talloc0 (sizeof (*E));
@@ -5004,6 +5185,12 @@ static void set_flag_4 (struct tgl_state *TLS, void *_D, int success) {
 
 static int send_bind_temp_on_answer (struct tgl_state *TLS, struct query *q, void *D) {
   struct tgl_dc *DC = q->extra;
+  if (q->flags & QUERY_NEXT_TEMP_KEY) {
+    // keys are swapped and config is requested once the bind answer is processed
+    tglmp_next_temp_auth_key_bound (TLS, DC);
+    vlogprintf (E_DEBUG, "Bind of next temp key successful in dc %d\n", DC->id);
+    return 0;
+  }
   DC->flags |= 2;
   tgl_do_help_get_config_dc (TLS, DC, set_flag_4, DC);
   vlogprintf (E_DEBUG, "Bind successful in dc %d\n", DC->id);
@@ -5025,14 +5212,14 @@ static struct query_methods send_bind_temp_methods = {
   .name = "bind temp auth key"
 };
 
-void tgl_do_send_bind_temp_key (struct tgl_state *TLS, struct tgl_dc *D, long long nonce, int expires_at, void *data, int len, long long msg_id) {
+void tgl_do_send_bind_temp_key (struct tgl_state *TLS, struct tgl_dc *D, long long nonce, int expires_at, void *data, int len, long long msg_id, int flags) {
   clear_packet ();
   out_int (CODE_auth_bind_temp_auth_key);
   out_long (D->auth_key_id);
   out_long (nonce);
   out_int (expires_at);
   out_cstring (data, len);
-  struct query *q = tglq_send_query_ex (TLS, D, packet_ptr - packet_buffer, packet_buffer, &send_bind_temp_methods, D, 0, 0, 2);
+  struct query *q = tglq_send_query_ex (TLS, D, packet_ptr - packet_buffer, packet_buffer, &send_bind_temp_methods, D, 0, 0, QUERY_FORCE_SEND | flags);
   assert (q->msg_id == msg_id);
 }
 
@@ -26,6 +26,8 @@
 
 #define QUERY_ACK_RECEIVED 1
 #define QUERY_FORCE_SEND 2
+#define QUERY_BULK 4
+#define QUERY_NEXT_TEMP_KEY 8
 
 struct query;
 struct query_methods {
@@ -35,6 +37,8 @@ struct query_methods {
   struct paramed_type *type;
   char *name;
   double timeout;
+  // never send this query gzip_packed
+  int no_gzip;
 };
 
 struct query {
@@ -45,9 +49,11 @@ struct query {
   long long session_id;
   void *data;
   struct query_methods *methods;
-  struct tgl_timer *ev;
+  struct tgl_wheel_timer ev;
   struct tgl_dc *DC;
   struct tgl_session *session;
+  struct query *session_next, *session_prev;
+  struct query *dc_next, *dc_prev;
   struct paramed_type *type;
   void *extra;
   void *callback;
@@ -56,6 +62,7 @@ struct query {
 
 
 struct query *tglq_send_query (struct tgl_state *TLS, struct tgl_dc *DC, int len, void *data, struct query_methods *methods, void *extra, void *callback, void *callback_extra);
+struct query *tglq_query_get (struct tgl_state *TLS, long long id);
 void tglq_query_ack (struct tgl_state *TLS, long long id);
 int tglq_query_error (struct tgl_state *TLS, long long id);
 int tglq_query_result (struct tgl_state *TLS, long long id);
@@ -68,7 +75,7 @@ void tglq_query_restart (struct tgl_state *TLS, long long id);
 
 double get_double_time (void);
 
-void tgl_do_send_bind_temp_key (struct tgl_state *TLS, struct tgl_dc *D, long long nonce, int expires_at, void *data, int len, long long msg_id);
+void tgl_do_send_bind_temp_key (struct tgl_state *TLS, struct tgl_dc *D, long long nonce, int expires_at, void *data, int len, long long msg_id, int flags);
 
 void tgl_do_request_exchange (struct tgl_state *TLS, struct tgl_secret_chat *E);
 void tgl_do_confirm_exchange (struct tgl_state *TLS, struct tgl_secret_chat *E, int sen_nop);
@@ -77,9 +84,12 @@ void tgl_do_commit_exchange (struct tgl_state *TLS, struct tgl_secret_chat *E, u
 void tgl_do_abort_exchange (struct tgl_state *TLS, struct tgl_secret_chat *E);
 
 void tglq_regen_query (struct tgl_state *TLS, long long id);
+void tglq_regen_query_after (struct tgl_state *TLS, long long id, double timeout);
 void tglq_query_delete (struct tgl_state *TLS, long long id);
 void tglq_query_free_all (struct tgl_state *TLS);
 void tglq_regen_queries_from_old_session (struct tgl_state *TLS, struct tgl_dc *DC, struct tgl_session *S);
+void tglq_forget_session (struct tgl_state *TLS, struct tgl_session *S);
+struct query *tglq_send_query_ex (struct tgl_state *TLS, struct tgl_dc *DC, int ints, void *data, struct query_methods *methods, void *extra, void *callback, void *callback_extra, int flags);
 // For binlog
 
 //int get_dh_config_on_answer (struct query *q);
@@ -37,6 +37,9 @@
 #include "tgl-methods-in.h"
 #include "updates.h"
 #include "mtproto-client.h"
+#include "tgl-crypto-pool.h"
+#include "tgl-inflate.h"
+#include "tgl-timer-wheel.h"
 
 #include "tgl.h"
 #include "auto.h"
@@ -94,7 +97,7 @@ static void increase_peer_size (struct tgl_state *TLS);
 char *tgls_default_create_print_name (struct tgl_state *TLS, tgl_peer_id_t id, const char *a1, const char *a2, const char *a3, const char *a4) {
   const char *d[4];
   d[0] = a1; d[1] = a2; d[2] = a3; d[3] = a4;
-  static char buf[10000];
+  char buf[10000];
   buf[0] = 0;
   int i;
   int p = 0;
@@ -441,7 +444,7 @@ struct tgl_secret_chat *tglf_fetch_alloc_encrypted_chat (struct tgl_state *TLS,
     return U;
   }
 
-  static unsigned char g_key[256];
+  unsigned char g_key[256];
   if (new) {
     if (DS_EC->magic != CODE_encrypted_chat_requested) {
       vlogprintf (E_WARNING, "Unknown chat. May be we forgot something...\n");
@@ -1619,69 +1622,95 @@ struct tgl_message *tglf_fetch_alloc_message (struct tgl_state *TLS, struct tl_d
   return M;
 }
 
-static int *decr_ptr;
-static int *decr_end;
+static TGL_THREAD int *decr_ptr;
+static TGL_THREAD int *decr_end;
+
+static int check_decrypted_message (int *msg_key, int *ptr, int *end) {
+  unsigned char sha1_buffer[20];
+  int x = *ptr;
+  if (x < 0 || (x & 3) || x + 4 > 4 * (end - ptr)) {
+    return -1;
+  }
+  TGLC_sha1 ((void *)ptr, 4 + x, sha1_buffer);
+
+  if (memcmp (sha1_buffer + 4, msg_key, 16)) {
+    return -1;
+  }
+  return 0;
+}
 
 static int decrypt_encrypted_message (struct tgl_secret_chat *E) {
   int *msg_key = decr_ptr;
   decr_ptr += 4;
   assert (decr_ptr < decr_end);
-  static unsigned char sha1a_buffer[20];
-  static unsigned char sha1b_buffer[20];
-  static unsigned char sha1c_buffer[20];
-  static unsigned char sha1d_buffer[20];
- 
-  static unsigned char buf[64];
 
   int *e_key = E->exchange_state != tgl_sce_committed ? E->key : E->exchange_key;
 
-  memcpy (buf, msg_key, 16);
-  memcpy (buf + 16, e_key, 32);
-  TGLC_sha1 (buf, 48, sha1a_buffer);
-  
-  memcpy (buf, e_key + 8, 16);
-  memcpy (buf + 16, msg_key, 16);
-  memcpy (buf + 32, e_key + 12, 16);
-  TGLC_sha1 (buf, 48, sha1b_buffer);
-  
-  memcpy (buf, e_key + 16, 32);
-  memcpy (buf + 32, msg_key, 16);
-  TGLC_sha1 (buf, 48, sha1c_buffer);
-  
-  memcpy (buf, msg_key, 16);
-  memcpy (buf + 16, e_key + 24, 32);
-  TGLC_sha1 (buf, 48, sha1d_buffer);
-
-  static unsigned char key[32];
-  memcpy (key, sha1a_buffer + 0, 8);
-  memcpy (key + 8, sha1b_buffer + 8, 12);
-  memcpy (key + 20, sha1c_buffer + 4, 12);
-
-  static unsigned char iv[32];
-  memcpy (iv, sha1a_buffer + 8, 12);
-  memcpy (iv + 12, sha1b_buffer + 0, 8);
-  memcpy (iv + 20, sha1c_buffer + 16, 4);
-  memcpy (iv + 24, sha1d_buffer + 0, 8);
-
-  TGLC_aes_key aes_key;
-  TGLC_aes_set_decrypt_key (key, 256, &aes_key);
-  TGLC_aes_ige_encrypt ((void *)decr_ptr, (void *)decr_ptr, 4 * (decr_end - decr_ptr), &aes_key, iv, 0);
-  memset (&aes_key, 0, sizeof (aes_key));
-
-  int x = *(decr_ptr);
-  if (x < 0 || (x & 3)) {
-    return -1;
+  // key and iv are derived as in MTProto, with secret chat key as auth_key
+  struct tgl_aes_job J;
+  tgl_init_aes_auth_job (&J, (void *)e_key, (void *)msg_key, 0);
+  J.data = (void *)decr_ptr;
+  J.len = 4 * (decr_end - decr_ptr);
+  tgl_pad_aes_decrypt_many (&J, 1);
+  memset (&J.key, 0, sizeof (J.key));
+
+  return check_decrypted_message (msg_key, decr_ptr, decr_end);
+}
+
+/*
+ * Decrypts in place messages which key is known without processing of previous messages,
+ * all at once. For every message res is set to 1 if it is decrypted, to -1 if it is
+ * decrypted but broken, and to 0 if it is left to fetch_encrypted_message.
+ * Key is chosen by fingerprint, so it is the same key fetch_encrypted_message would use.
+ */
+static void decrypt_encrypted_messages (struct tgl_state *TLS, struct tl_ds_encrypted_message **DS_EM, int n, int *res) {
+  struct tgl_aes_job *J = talloc (n * sizeof (*J));
+  int *pos = talloc (n * sizeof (int));
+  int i, k = 0;
+  for (i = 0; i < n; i++) {
+    res[i] = 0;
+    struct tl_ds_encrypted_message *D = DS_EM[i];
+    if (!D) { continue; }
+    tgl_peer_t *P = tgl_peer_get (TLS, TGL_MK_ENCR_CHAT (DS_LVAL (D->chat_id)));
+    if (!P || P->encr_chat.state != sc_ok) { continue; }
+    // key_fingerprint, msg_key, at least one block
+    int len = D->bytes->len;
+    if (len < 40 || ((len - 24) & 15)) { continue; }
+
+    tgl_message_id_t msg_id = tgl_peer_id_to_msg_id (P->id, DS_LVAL (D->random_id));
+    struct tgl_message *M = tgl_message_get (TLS, &msg_id);
+    if (M && (M->flags & TGLMF_CREATED)) { continue; }
+
+    struct tgl_secret_chat *E = &P->encr_chat;
+    long long key_fingerprint = *(long long *)D->bytes->data;
+    int *e_key;
+    if (E->exchange_state != tgl_sce_committed && key_fingerprint == E->key_fingerprint) {
+      e_key = E->key;
+    } else if (E->exchange_state == tgl_sce_committed && key_fingerprint == E->exchange_key_fingerprint) {
+      e_key = E->exchange_key;
+    } else {
+      // unknown key or key exchange to be confirmed first
+      continue;
+    }
+    tgl_init_aes_auth_job (&J[k], (void *)e_key, D->bytes->data + 8, 0);
+    J[k].data = D->bytes->data + 24;
+    J[k].len = len - 24;
+    pos[k ++] = i;
   }
-  assert (x >= 0 && !(x & 3));
-  TGLC_sha1 ((void *)decr_ptr, 4 + x, sha1a_buffer);
 
-  if (memcmp (sha1a_buffer + 4, msg_key, 16)) {
-    return -1;
+  tgl_pad_aes_decrypt_many (J, k);
+
+  for (i = 0; i < k; i++) {
+    struct tl_ds_encrypted_message *D = DS_EM[pos[i]];
+    memset (&J[i].key, 0, sizeof (J[i].key));
+    int *ptr = (void *)(D->bytes->data + 24);
+    res[pos[i]] = check_decrypted_message ((void *)(D->bytes->data + 8), ptr, ptr + (D->bytes->len - 24) / 4) < 0 ? -1 : 1;
   }
-  return 0;
+  tfree (J, n * sizeof (*J));
+  tfree (pos, n * sizeof (int));
 }
 
-struct tgl_message *tglf_fetch_encrypted_message (struct tgl_state *TLS, struct tl_ds_encrypted_message *DS_EM) {
+static struct tgl_message *fetch_encrypted_message (struct tgl_state *TLS, struct tl_ds_encrypted_message *DS_EM, int decrypted) {
   if (!DS_EM) { return NULL; }
   
   tgl_peer_t *P = tgl_peer_get (TLS, TGL_MK_ENCR_CHAT (DS_LVAL (DS_EM->chat_id)));
@@ -1721,7 +1750,11 @@ struct tgl_message *tglf_fetch_encrypted_message (struct tgl_state *TLS, struct
   
   decr_ptr += 2;
 
-  if (decrypt_encrypted_message (&P->encr_chat) < 0) {
+  if (decrypted) {
+    // done by decrypt_encrypted_messages with the key of this fingerprint
+    decr_ptr += 4;
+  }
+  if (decrypted < 0 || (!decrypted && decrypt_encrypted_message (&P->encr_chat) < 0)) {
     vlogprintf (E_WARNING, "can not decrypt message\n");
     return M;
   }
@@ -1853,8 +1886,12 @@ static void increase_peer_size (struct tgl_state *TLS) {
   }
 }
 
-struct tgl_message *tglf_fetch_alloc_encrypted_message (struct tgl_state *TLS, struct tl_ds_encrypted_message *DS_EM) {
-  struct tgl_message *M = tglf_fetch_encrypted_message (TLS, DS_EM);
+struct tgl_message *tglf_fetch_encrypted_message (struct tgl_state *TLS, struct tl_ds_encrypted_message *DS_EM) {
+  return fetch_encrypted_message (TLS, DS_EM, 0);
+}
+
+static struct tgl_message *fetch_alloc_encrypted_message (struct tgl_state *TLS, struct tl_ds_encrypted_message *DS_EM, int decrypted) {
+  struct tgl_message *M = fetch_encrypted_message (TLS, DS_EM, decrypted);
   if (!M) { return M; }
 
   if (M->flags & TGLMF_CREATED) {
@@ -1912,6 +1949,21 @@ struct tgl_message *tglf_fetch_alloc_encrypted_message (struct tgl_state *TLS, s
   return M;
 }
 
+struct tgl_message *tglf_fetch_alloc_encrypted_message (struct tgl_state *TLS, struct tl_ds_encrypted_message *DS_EM) {
+  return fetch_alloc_encrypted_message (TLS, DS_EM, 0);
+}
+
+void tglf_fetch_alloc_encrypted_messages (struct tgl_state *TLS, struct tl_ds_encrypted_message **DS_EM, int n, struct tgl_message **EL) {
+  if (!n) { return; }
+  int *res = talloc (n * sizeof (int));
+  decrypt_encrypted_messages (TLS, DS_EM, n, res);
+  int i;
+  for (i = 0; i < n; i++) {
+    EL[i] = fetch_alloc_encrypted_message (TLS, DS_EM[i], res[i]);
+  }
+  tfree (res, n * sizeof (int));
+}
+
 struct tgl_bot_info *tglf_fetch_alloc_bot_info (struct tgl_state *TLS, struct tl_ds_bot_info *DS_BI) {
   if (!DS_BI || DS_BI->magic == CODE_bot_info_empty) { return NULL; }
   struct tgl_bot_info *B = talloc (sizeof (*B));
@@ -2221,7 +2273,7 @@ void tgls_free_user (struct tgl_state *TLS, struct tgl_user *U) {
   if (U->username) { tfree_str (U->username); }
   if (U->real_first_name) { tfree_str (U->real_first_name); }
   if (U->real_last_name) { tfree_str (U->real_last_name); }
-  if (U->status.ev) { tgl_remove_status_expire (TLS, U); }
+  if (tglw_timer_pending (&U->status.ev)) { tgl_remove_status_expire (TLS, U); }
   if (U->photo) { tgls_free_photo (TLS, U->photo); }
   if (U->bot_info) { tgls_free_bot_info (TLS, U->bot_info); }
   tfree (U, sizeof (tgl_peer_t));
@@ -2451,7 +2503,7 @@ void tglp_peer_delete_name (struct tgl_state *TLS, tgl_peer_t *P) {
 }
 
 tgl_peer_t *tgl_peer_get (struct tgl_state *TLS, tgl_peer_id_t id) {
-  static tgl_peer_t U;
+  tgl_peer_t U;
   U.id = id;
   return tree_lookup_peer (TLS->peer_tree, &U);
 }
@@ -2471,7 +2523,7 @@ struct tgl_message *tgl_message_get (struct tgl_state *TLS, tgl_message_id_t *ms
 }
 
 tgl_peer_t *tgl_peer_get_by_name (struct tgl_state *TLS, const char *s) {
-  static tgl_peer_t P;
+  tgl_peer_t P;
   P.print_name = (void *)s;
   tgl_peer_t *R = tree_lookup_peer_by_name (TLS->peer_by_name_tree, &P);
   return R;
@@ -2605,6 +2657,12 @@ void tgl_free_all (struct tgl_state *TLS) {
   for (i = 0; i <= TLS->max_dc_num; i++) if (TLS->DC_list[i]) {
     tgls_free_dc (TLS, TLS->DC_list[i]);
   }
+  if (TLS->crypto_pool) {
+    tgl_crypto_pool_free (TLS->crypto_pool);
+    TLS->crypto_pool = NULL;
+  }
+  tgl_inflate_free (TLS);
+  tglw_free (TLS);
   TGLC_bn_ctx_free (TLS->TGLC_bn_ctx);
   tgls_free_pubkey (TLS);
 
@@ -2612,6 +2670,9 @@ void tgl_free_all (struct tgl_state *TLS) {
   if (TLS->online_updates_timer) { TLS->timer_methods->free (TLS->online_updates_timer); }
 
   tfree (TLS->Peers, TLS->peer_size * sizeof (void *));
+  if (TLS->connections_size) {
+    tfree (TLS->Connections, TLS->connections_size * sizeof (void *));
+  }
   tfree (TLS, sizeof (*TLS));
 }
 
@@ -2621,12 +2682,14 @@ int tgl_print_stat (struct tgl_state *TLS, char *s, int len) {
     "chats_allocated\t%d\n"
     "encr_chats_allocated\t%d\n"
     "peer_num\t%d\n"
-    "messages_allocated\t%d\n",
+    "messages_allocated\t%d\n"
+    "connections\t%d\n",
     TLS->users_allocated,
     TLS->chats_allocated,
     TLS->encr_chats_allocated,
     TLS->peer_num,
-    TLS->messages_allocated
+    TLS->messages_allocated,
+    TLS->connections_num
     );
 }
 
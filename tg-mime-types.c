@@ -4,7 +4,7 @@
 
 #include "mime-types.c"
   
-static int mime_initialized;
+static volatile int mime_initialized;
 static int mime_type_number;
 static char *mime_type_names[MAX_MIME_TYPES_NUM];
 static char *mime_type_extensions[MAX_MIME_TYPES_NUM];
@@ -12,7 +12,6 @@ static char *mime_type_extensions[MAX_MIME_TYPES_NUM];
 static void mime_init (void) {
   char *start = (char *)mime_types;
   char *end = start + mime_types_len;
-  mime_initialized = 1;
   char *c = start;
   while (c < end) {
     if (*c == '#') {
@@ -60,10 +59,24 @@ static void mime_init (void) {
   }
 }
 
-char *tg_extension_by_mime (const char *mime_type) {
-  if (!mime_initialized) {
+/* table is parsed in place, so only one thread may do it; others wait for it */
+static void mime_check_init (void) {
+  if (mime_initialized == 2) {
+    return;
+  }
+  if (__sync_bool_compare_and_swap (&mime_initialized, 0, 1)) {
     mime_init ();
+    __sync_synchronize ();
+    mime_initialized = 2;
+  } else {
+    while (mime_initialized != 2) {
+      __sync_synchronize ();
+    }
   }
+}
+
+char *tg_extension_by_mime (const char *mime_type) {
+  mime_check_init ();
   int i;
   for (i = 0; i < mime_type_number; i++) {
     if (!strcmp (mime_type_names[i], mime_type)) {
@@ -81,15 +94,13 @@ char *tg_mime_by_filename (const char *filename) {
   }
   p ++;
 
-  if (!mime_initialized) {
-    mime_init ();
-  }
+  mime_check_init ();
 
   static char *def = "application/octet-stream";
   if (strlen (p) > 10) {
     return def;
   }
-  static char s[11];
+  char s[11];
   strcpy (s, p);
   char *q = s;
   while (*q) {
@@ -0,0 +1,175 @@
+/* 
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Vitaly Valtman 2013-2015
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+
+#include "tools.h"
+#include "tgl-crypto-pool.h"
+
+#define JOB_QUEUED 0
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+
+#ifndef WIN32
+#include <pthread.h>
+
+struct tgl_crypto_pool {
+  pthread_mutex_t lock;
+  // queue is not empty or pool is stopped
+  pthread_cond_t queued;
+  // some job is done
+  pthread_cond_t done;
+  struct tgl_crypto_job *head;
+  struct tgl_crypto_job *tail;
+  int stop;
+  int threads_num;
+  int threads_size;
+  pthread_t *threads;
+};
+
+static void *crypto_worker (void *arg) {
+  struct tgl_crypto_pool *P = arg;
+  pthread_mutex_lock (&P->lock);
+  while (1) {
+    while (!P->head && !P->stop) {
+      pthread_cond_wait (&P->queued, &P->lock);
+    }
+    if (!P->head) { break; }
+    struct tgl_crypto_job *J = P->head;
+    P->head = J->next;
+    if (!P->head) { P->tail = NULL; }
+    J->state = JOB_RUNNING;
+    pthread_mutex_unlock (&P->lock);
+
+    J->run (J);
+
+    pthread_mutex_lock (&P->lock);
+    J->state = JOB_DONE;
+    pthread_cond_broadcast (&P->done);
+  }
+  pthread_mutex_unlock (&P->lock);
+  return NULL;
+}
+
+struct tgl_crypto_pool *tgl_crypto_pool_alloc (int threads) {
+  assert (threads > 0);
+  struct tgl_crypto_pool *P = talloc0 (sizeof (*P));
+  pthread_mutex_init (&P->lock, NULL);
+  pthread_cond_init (&P->queued, NULL);
+  pthread_cond_init (&P->done, NULL);
+  P->threads_size = threads;
+  P->threads = talloc (threads * sizeof (pthread_t));
+  int i;
+  for (i = 0; i < threads; i++) {
+    if (pthread_create (&P->threads[i], NULL, crypto_worker, P)) {
+      break;
+    }
+  }
+  P->threads_num = i;
+  if (!i) {
+    tgl_crypto_pool_free (P);
+    return NULL;
+  }
+  return P;
+}
+
+void tgl_crypto_pool_submit (struct tgl_crypto_pool *P, struct tgl_crypto_job *J) {
+  J->next = NULL;
+  J->state = JOB_QUEUED;
+  if (!P) {
+    J->run (J);
+    J->state = JOB_DONE;
+    return;
+  }
+  pthread_mutex_lock (&P->lock);
+  if (P->tail) {
+    P->tail->next = J;
+  } else {
+    P->head = J;
+  }
+  P->tail = J;
+  pthread_cond_signal (&P->queued);
+  pthread_mutex_unlock (&P->lock);
+}
+
+void tgl_crypto_pool_wait (struct tgl_crypto_pool *P, struct tgl_crypto_job *J) {
+  if (!P) {
+    assert (J->state == JOB_DONE);
+    return;
+  }
+  pthread_mutex_lock (&P->lock);
+  if (J->state == JOB_QUEUED) {
+    // nobody took it yet, so it is done here instead of waiting for a worker
+    struct tgl_crypto_job **p = &P->head, *prev = NULL;
+    while (*p != J) {
+      prev = *p;
+      p = &(*p)->next;
+    }
+    *p = J->next;
+    if (P->tail == J) { P->tail = prev; }
+    J->state = JOB_RUNNING;
+    pthread_mutex_unlock (&P->lock);
+    J->run (J);
+    J->state = JOB_DONE;
+    return;
+  }
+  while (J->state != JOB_DONE) {
+    pthread_cond_wait (&P->done, &P->lock);
+  }
+  pthread_mutex_unlock (&P->lock);
+}
+
+void tgl_crypto_pool_free (struct tgl_crypto_pool *P) {
+  pthread_mutex_lock (&P->lock);
+  assert (!P->head);
+  P->stop = 1;
+  pthread_cond_broadcast (&P->queued);
+  pthread_mutex_unlock (&P->lock);
+  int i;
+  for (i = 0; i < P->threads_num; i++) {
+    pthread_join (P->threads[i], NULL);
+  }
+  tfree (P->threads, P->threads_size * sizeof (pthread_t));
+  pthread_cond_destroy (&P->done);
+  pthread_cond_destroy (&P->queued);
+  pthread_mutex_destroy (&P->lock);
+  tfree (P, sizeof (*P));
+}
+#else
+struct tgl_crypto_pool *tgl_crypto_pool_alloc (int threads) {
+  return NULL;
+}
+
+void tgl_crypto_pool_submit (struct tgl_crypto_pool *P, struct tgl_crypto_job *J) {
+  J->next = NULL;
+  J->run (J);
+  J->state = JOB_DONE;
+}
+
+void tgl_crypto_pool_wait (struct tgl_crypto_pool *P, struct tgl_crypto_job *J) {
+  assert (J->state == JOB_DONE);
+}
+
+void tgl_crypto_pool_free (struct tgl_crypto_pool *P) {
+}
+#endif
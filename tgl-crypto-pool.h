@@ -0,0 +1,45 @@
+/* 
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Vitaly Valtman 2013-2015
+*/
+
+#ifndef __TGL_CRYPTO_POOL_H__
+#define __TGL_CRYPTO_POOL_H__
+
+/*
+ * Worker threads for crypto work of the event loop.
+ * Jobs are taken by the workers in submission order and may complete in any order.
+ * The loop thread collects a job with tgl_crypto_pool_wait, which runs the job
+ * in place if no worker has taken it yet.
+ * run must not touch anything but the job itself.
+ */
+struct tgl_crypto_job {
+  void (*run) (struct tgl_crypto_job *J);
+  struct tgl_crypto_job *next;
+  int state;
+};
+
+struct tgl_crypto_pool;
+
+// returns NULL if threads are not supported; jobs then run in tgl_crypto_pool_submit
+struct tgl_crypto_pool *tgl_crypto_pool_alloc (int threads);
+void tgl_crypto_pool_submit (struct tgl_crypto_pool *P, struct tgl_crypto_job *J);
+void tgl_crypto_pool_wait (struct tgl_crypto_pool *P, struct tgl_crypto_job *J);
+// all submitted jobs must be waited for
+void tgl_crypto_pool_free (struct tgl_crypto_pool *P);
+#endif
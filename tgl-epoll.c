@@ -0,0 +1,449 @@
+/* 
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Vitaly Valtman 2013-2015
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+#include "tgl-net-inner.h"
+#include "tgl-epoll.h"
+#include "tgl.h"
+#include "tools.h"
+#ifdef IO_URING
+#include "tgl-uring.h"
+#endif
+
+#define EPOLL_MAX_EVENTS 256
+// timers may fire late by this fraction of their timeout (at most TIMER_SLACK_MAX seconds),
+// so that periodic timers of many connections share a wakeup; a timer with small slack
+// behind the heap top may be delayed up to the slack of the top
+#define TIMER_SLACK_RATIO 0.01
+#define TIMER_SLACK_MAX 0.05
+
+struct tgl_timer {
+  struct tgl_epoll_loop *L;
+  struct tgl_state *TLS;
+  void (*cb)(struct tgl_state *TLS, void *arg);
+  void *arg;
+  double expire;
+  double slack;
+  // position in heap, -1 if not inserted
+  int pos;
+};
+
+struct tgl_epoll_loop {
+  int epfd;
+  int timerfd;
+  struct tgl_timer **heap;
+  int heap_size;
+  int heap_max;
+  // absolute time timerfd is armed for, 0 if disarmed
+  double armed;
+  // connections with output to write at the end of the iteration
+  struct connection *ready;
+  // current batch, detach drops events of the connection from it
+  struct epoll_event events[EPOLL_MAX_EVENTS];
+  int events_pos;
+  int events_cnt;
+#ifdef IO_URING
+  // created on first uring connection, uring_failed is set if kernel does not support it
+  struct tgl_uring *uring;
+  int uring_failed;
+#endif
+  long long wakeups;
+  long long events_total;
+  long long timers_fired;
+  long long ready_writes;
+};
+
+static double get_monotonic_time (void) {
+  struct timespec tv;
+  clock_gettime (CLOCK_MONOTONIC, &tv);
+  return tv.tv_sec + 1e-9 * tv.tv_nsec;
+}
+
+/* timers */
+
+static void heap_set (struct tgl_epoll_loop *L, int i, struct tgl_timer *t) {
+  L->heap[i] = t;
+  t->pos = i;
+}
+
+static void heap_sift_up (struct tgl_epoll_loop *L, int i) {
+  struct tgl_timer *t = L->heap[i];
+  while (i > 0) {
+    int p = (i - 1) / 2;
+    if (L->heap[p]->expire <= t->expire) { break; }
+    heap_set (L, i, L->heap[p]);
+    i = p;
+  }
+  heap_set (L, i, t);
+}
+
+static void heap_sift_down (struct tgl_epoll_loop *L, int i) {
+  struct tgl_timer *t = L->heap[i];
+  while (1) {
+    int j = 2 * i + 1;
+    if (j >= L->heap_size) { break; }
+    if (j + 1 < L->heap_size && L->heap[j + 1]->expire < L->heap[j]->expire) { j ++; }
+    if (t->expire <= L->heap[j]->expire) { break; }
+    heap_set (L, i, L->heap[j]);
+    i = j;
+  }
+  heap_set (L, i, t);
+}
+
+static void heap_remove (struct tgl_epoll_loop *L, struct tgl_timer *t) {
+  int i = t->pos;
+  assert (i >= 0 && i < L->heap_size && L->heap[i] == t);
+  t->pos = -1;
+  struct tgl_timer *last = L->heap[-- L->heap_size];
+  if (last == t) { return; }
+  heap_set (L, i, last);
+  heap_sift_up (L, i);
+  heap_sift_down (L, last->pos);
+}
+
+static void arm_timerfd_at (struct tgl_epoll_loop *L, double e) {
+  struct itimerspec it;
+  memset (&it, 0, sizeof (it));
+  L->armed = e;
+  if (e > 0) {
+    it.it_value.tv_sec = (time_t)e;
+    it.it_value.tv_nsec = (long)((e - (time_t)e) * 1e9);
+    if (!it.it_value.tv_sec && !it.it_value.tv_nsec) {
+      it.it_value.tv_nsec = 1;
+    }
+  }
+  timerfd_settime (L->timerfd, TFD_TIMER_ABSTIME, &it, 0);
+}
+
+static void arm_timerfd (struct tgl_epoll_loop *L) {
+  arm_timerfd_at (L, L->heap_size ? L->heap[0]->expire + L->heap[0]->slack : 0);
+}
+
+static struct tgl_timer *epoll_timer_alloc (struct tgl_state *TLS, void (*cb)(struct tgl_state *TLS, void *arg), void *arg) {
+  assert (TLS->ev_base);
+  struct tgl_timer *t = talloc0 (sizeof (*t));
+  t->L = TLS->ev_base;
+  t->TLS = TLS;
+  t->cb = cb;
+  t->arg = arg;
+  t->pos = -1;
+  return t;
+}
+
+static void epoll_timer_insert (struct tgl_timer *t, double timeout) {
+  struct tgl_epoll_loop *L = t->L;
+  if (t->pos >= 0) {
+    heap_remove (L, t);
+  }
+  if (timeout < 0) { timeout = 0; }
+  t->expire = get_monotonic_time () + timeout;
+  t->slack = timeout * TIMER_SLACK_RATIO;
+  if (t->slack > TIMER_SLACK_MAX) { t->slack = TIMER_SLACK_MAX; }
+  if (L->heap_size == L->heap_max) {
+    int n = L->heap_max ? 2 * L->heap_max : 64;
+    struct tgl_timer **h = talloc (n * sizeof (void *));
+    if (L->heap_size) {
+      memcpy (h, L->heap, L->heap_size * sizeof (void *));
+      tfree (L->heap, L->heap_max * sizeof (void *));
+    }
+    L->heap = h;
+    L->heap_max = n;
+  }
+  heap_set (L, L->heap_size ++, t);
+  heap_sift_up (L, t->pos);
+  if (!L->armed || t->expire + t->slack < L->armed) {
+    arm_timerfd_at (L, t->expire + t->slack);
+  }
+}
+
+static void epoll_timer_remove (struct tgl_timer *t) {
+  if (t->pos >= 0) {
+    heap_remove (t->L, t);
+  }
+}
+
+static void epoll_timer_free (struct tgl_timer *t) {
+  epoll_timer_remove (t);
+  tfree (t, sizeof (*t));
+}
+
+static void run_timers (struct tgl_epoll_loop *L) {
+  double now = get_monotonic_time ();
+  // timers reinserted with zero timeout from callback fire on the next iteration
+  int cnt = L->heap_size;
+  while (cnt -- > 0 && L->heap_size && L->heap[0]->expire <= now) {
+    struct tgl_timer *t = L->heap[0];
+    heap_remove (L, t);
+    L->timers_fired ++;
+    t->cb (t->TLS, t->arg);
+  }
+  arm_timerfd (L);
+}
+
+struct tgl_timer_methods tgl_epoll_timers = {
+  .alloc = epoll_timer_alloc,
+  .insert = epoll_timer_insert,
+  .remove = epoll_timer_remove,
+  .free = epoll_timer_free
+};
+
+/* connections */
+
+static void epoll_attach (struct connection *c) {
+  struct tgl_epoll_loop *L = c->TLS->ev_base;
+  struct epoll_event ev;
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = c;
+  assert (epoll_ctl (L->epfd, EPOLL_CTL_ADD, c->fd, &ev) >= 0);
+}
+
+static void remove_ready (struct tgl_epoll_loop *L, struct connection *c) {
+  if (c->flags & CONN_FLAG_WRITE_QUEUED) {
+    struct connection **p = &L->ready;
+    while (*p != c) {
+      p = &(*p)->next_ready;
+    }
+    *p = c->next_ready;
+    c->next_ready = 0;
+    c->flags &= ~CONN_FLAG_WRITE_QUEUED;
+  }
+}
+
+static void epoll_detach (struct connection *c) {
+  struct tgl_epoll_loop *L = c->TLS->ev_base;
+  epoll_ctl (L->epfd, EPOLL_CTL_DEL, c->fd, 0);
+  remove_ready (L, c);
+  int i;
+  for (i = L->events_pos; i < L->events_cnt; i++) {
+    if (L->events[i].data.ptr == c) {
+      L->events[i].data.ptr = 0;
+    }
+  }
+}
+
+/*
+ * Writes are not done right away: connection is put on the ready list
+ * and all output queued during the iteration goes out at its end.
+ * Blocked connections wait for EPOLLOUT edge instead, as well as connecting ones.
+ */
+static void epoll_want_write (struct connection *c) {
+  if (c->state != conn_ready || (c->flags & (CONN_FLAG_WRITE_BLOCKED | CONN_FLAG_WRITE_QUEUED))) {
+    return;
+  }
+  struct tgl_epoll_loop *L = c->TLS->ev_base;
+  c->flags |= CONN_FLAG_WRITE_QUEUED;
+  c->next_ready = L->ready;
+  L->ready = c;
+}
+
+struct connection_io_methods tgl_epoll_io = {
+  .attach = epoll_attach,
+  .detach = epoll_detach,
+  .want_write = epoll_want_write
+};
+
+#ifdef IO_URING
+static void uring_attach (struct connection *c) {
+  struct tgl_epoll_loop *L = c->TLS->ev_base;
+  if (!L->uring && !L->uring_failed) {
+    L->uring = tgl_uring_new ();
+    if (L->uring) {
+      struct epoll_event ev;
+      memset (&ev, 0, sizeof (ev));
+      ev.events = EPOLLIN;
+      ev.data.ptr = L->uring;
+      assert (epoll_ctl (L->epfd, EPOLL_CTL_ADD, tgl_uring_fd (L->uring), &ev) >= 0);
+    } else {
+      L->uring_failed = 1;
+    }
+  }
+  if (!L->uring || tgl_uring_attach (L->uring, c) < 0) {
+    // fall back to poll-based path
+    c->io = &tgl_epoll_io;
+    epoll_attach (c);
+  }
+}
+
+static void uring_detach (struct connection *c) {
+  struct tgl_epoll_loop *L = c->TLS->ev_base;
+  tgl_uring_detach (L->uring, c);
+  remove_ready (L, c);
+}
+
+// no edges here: send request itself waits for space in socket buffer
+static void uring_want_write (struct connection *c) {
+  if (c->state != conn_ready || (c->flags & CONN_FLAG_WRITE_QUEUED)) {
+    return;
+  }
+  struct tgl_epoll_loop *L = c->TLS->ev_base;
+  c->flags |= CONN_FLAG_WRITE_QUEUED;
+  c->next_ready = L->ready;
+  L->ready = c;
+}
+
+struct connection_io_methods tgl_uring_io = {
+  .attach = uring_attach,
+  .detach = uring_detach,
+  .want_write = uring_want_write
+};
+#endif
+
+static void flush_ready (struct tgl_epoll_loop *L) {
+  while (L->ready) {
+    struct connection *c = L->ready;
+#ifdef IO_URING
+    if (c->io == &tgl_uring_io) {
+      if (tgl_uring_send (L->uring, c) < 0) {
+        // SQ ring is full, c and the rest stay queued till the next iteration
+        break;
+      }
+      // completions reaped by tgl_uring_send may have detached c and changed the list
+      if (L->ready == c) {
+        L->ready = c->next_ready;
+        c->next_ready = 0;
+        c->flags &= ~CONN_FLAG_WRITE_QUEUED;
+      }
+      L->ready_writes ++;
+      continue;
+    }
+#endif
+    L->ready = c->next_ready;
+    c->next_ready = 0;
+    c->flags &= ~CONN_FLAG_WRITE_QUEUED;
+    L->ready_writes ++;
+    tgln_conn_writable (c);
+  }
+#ifdef IO_URING
+  // all sends prepared during the iteration go with one syscall
+  if (L->uring) {
+    tgl_uring_submit (L->uring);
+  }
+#endif
+}
+
+/* loop */
+
+struct tgl_epoll_loop *tgl_epoll_loop_new (void) {
+  struct tgl_epoll_loop *L = talloc0 (sizeof (*L));
+  L->epfd = epoll_create1 (EPOLL_CLOEXEC);
+  L->timerfd = timerfd_create (CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (L->epfd < 0 || L->timerfd < 0) {
+    if (L->epfd >= 0) { close (L->epfd); }
+    if (L->timerfd >= 0) { close (L->timerfd); }
+    tfree (L, sizeof (*L));
+    return 0;
+  }
+  struct epoll_event ev;
+  memset (&ev, 0, sizeof (ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = L;
+  assert (epoll_ctl (L->epfd, EPOLL_CTL_ADD, L->timerfd, &ev) >= 0);
+  return L;
+}
+
+void tgl_epoll_loop_free (struct tgl_epoll_loop *L) {
+#ifdef IO_URING
+  if (L->uring) {
+    tgl_uring_free (L->uring);
+  }
+#endif
+  close (L->timerfd);
+  close (L->epfd);
+  if (L->heap_max) {
+    tfree (L->heap, L->heap_max * sizeof (void *));
+  }
+  tfree (L, sizeof (*L));
+}
+
+int tgl_epoll_loop_fd (struct tgl_epoll_loop *L) {
+  return L->epfd;
+}
+
+int tgl_epoll_loop_run (struct tgl_epoll_loop *L, int timeout) {
+  flush_ready (L);
+  int n = epoll_wait (L->epfd, L->events, EPOLL_MAX_EVENTS, timeout);
+  if (n < 0) {
+    return errno == EINTR ? 0 : -1;
+  }
+  L->wakeups ++;
+  L->events_cnt = n;
+  for (L->events_pos = 0; L->events_pos < L->events_cnt; L->events_pos ++) {
+    struct epoll_event *e = &L->events[L->events_pos];
+    if (!e->data.ptr) { continue; }
+    if (e->data.ptr == L) {
+      unsigned long long x;
+      while (read (L->timerfd, &x, sizeof (x)) > 0);
+      continue;
+    }
+#ifdef IO_URING
+    if (L->uring && e->data.ptr == L->uring) {
+      tgl_uring_process (L->uring);
+      continue;
+    }
+#endif
+    struct connection *c = e->data.ptr;
+    L->events_total ++;
+    if (e->events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+      tgln_conn_readable (c);
+    }
+    // connection may be already detached (or freed) here
+    if (e->data.ptr && (e->events & EPOLLOUT)) {
+      tgln_conn_writable (c);
+    }
+  }
+  L->events_pos = L->events_cnt = 0;
+  run_timers (L);
+  flush_ready (L);
+  return n;
+}
+
+int tgl_epoll_print_stat (struct tgl_epoll_loop *L, char *s, int len) {
+  int pos = tsnprintf (s, len,
+    "epoll_wakeups\t%lld\n"
+    "epoll_events\t%lld\n"
+    "epoll_timers\t%d\n"
+    "epoll_timers_fired\t%lld\n"
+    "epoll_ready_writes\t%lld\n",
+    L->wakeups,
+    L->events_total,
+    L->heap_size,
+    L->timers_fired,
+    L->ready_writes
+    );
+#ifdef IO_URING
+  if (L->uring && pos < len) {
+    pos += tgl_uring_print_stat (L->uring, s + pos, len - pos);
+  }
+#endif
+  return pos;
+}
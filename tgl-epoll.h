@@ -0,0 +1,55 @@
+/* 
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Vitaly Valtman 2013-2015
+*/
+#ifndef __TGL_EPOLL_H__
+#define __TGL_EPOLL_H__
+
+#include "tgl.h"
+
+/*
+ * Event loop without libevent: edge-triggered epoll for connections,
+ * timerfd driven heap for timers.
+ * Usage:
+ *   L = tgl_epoll_loop_new ();
+ *   tgl_set_ev_base (TLS, L);
+ *   tgl_set_net_methods (TLS, &tgl_epoll_conn_methods);
+ *   tgl_set_timer_methods (TLS, &tgl_epoll_timers);
+ *   while (1) { tgl_epoll_loop_run (L, 1000); }
+ * With --enable-io-uring tgl_uring_conn_methods can be used instead of
+ * tgl_epoll_conn_methods: connections then do io through io_uring,
+ * falling back to epoll if the kernel lacks support.
+ */
+struct tgl_epoll_loop;
+struct connection_io_methods;
+
+extern struct tgl_net_methods tgl_epoll_conn_methods;
+extern struct tgl_timer_methods tgl_epoll_timers;
+extern struct connection_io_methods tgl_epoll_io;
+extern struct tgl_net_methods tgl_uring_conn_methods;
+extern struct connection_io_methods tgl_uring_io;
+
+struct tgl_epoll_loop *tgl_epoll_loop_new (void);
+void tgl_epoll_loop_free (struct tgl_epoll_loop *L);
+// single fd to be watched for reading if loop is embedded into another one
+int tgl_epoll_loop_fd (struct tgl_epoll_loop *L);
+// waits up to timeout milliseconds (-1 = forever) and processes one batch of events
+int tgl_epoll_loop_run (struct tgl_epoll_loop *L, int timeout);
+int tgl_epoll_print_stat (struct tgl_epoll_loop *L, char *s, int len);
+
+#endif
@@ -33,6 +33,8 @@ struct tgl_message *tglf_fetch_alloc_message (struct tgl_state *TLS, struct tl_d
 struct tgl_message *tglf_fetch_alloc_message_short_buf (struct tgl_state *TLS);
 struct tgl_message *tglf_fetch_alloc_message_short_chat_buf (struct tgl_state *TLS);
 struct tgl_message *tglf_fetch_alloc_encrypted_message (struct tgl_state *TLS, struct tl_ds_encrypted_message *DS_EM);
+// same for a list, which is decrypted all at once
+void tglf_fetch_alloc_encrypted_messages (struct tgl_state *TLS, struct tl_ds_encrypted_message **DS_EM, int n, struct tgl_message **EL);
 tgl_peer_id_t tglf_fetch_peer_id (struct tgl_state *TLS, struct tl_ds_peer *DS_P);
 long long tglf_fetch_user_photo (struct tgl_state *TLS, struct tgl_user *U, struct tl_ds_user_profile_photo *DS_UPP);
 
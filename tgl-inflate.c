@@ -0,0 +1,190 @@
+/* 
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Vitaly Valtman 2013-2015
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "tgl.h"
+#include "tgl-inner.h"
+#include "tools.h"
+#include "tgl-inflate.h"
+
+#define INFLATE_MIN_SIZE (1 << 16)
+// bound for memory taken by one object
+#define INFLATE_MAX_SIZE (1 << 28)
+// released buffers kept for reuse, larger ones go back to the allocator
+#define INFLATE_POOL_SIZE 4
+#define INFLATE_POOL_MAX_SIZE (1 << 22)
+#define INFLATE_STATS 64
+
+struct inflate_stat {
+  const char *name;
+  long long count;
+  long long in_bytes;
+  long long out_bytes;
+  double time;
+};
+
+struct tgl_inflater {
+  z_stream strm;
+  struct tgl_inflate_buf *free_list;
+  int free_cnt;
+  int stats_num;
+  struct inflate_stat stats[INFLATE_STATS];
+};
+
+static struct tgl_inflater *get_inflater (struct tgl_state *TLS) {
+  struct tgl_inflater *I = TLS->inflater;
+  if (I) {
+    assert (inflateReset (&I->strm) == Z_OK);
+    return I;
+  }
+  I = talloc0 (sizeof (*I));
+  assert (inflateInit2 (&I->strm, 16 + MAX_WBITS) == Z_OK);
+  TLS->inflater = I;
+  return I;
+}
+
+static struct tgl_inflate_buf *alloc_buf (struct tgl_inflater *I, int size) {
+  struct tgl_inflate_buf **P = &I->free_list;
+  while (*P) {
+    struct tgl_inflate_buf *B = *P;
+    if (B->size >= size) {
+      *P = B->next;
+      I->free_cnt --;
+      return B;
+    }
+    P = &B->next;
+  }
+  struct tgl_inflate_buf *B = talloc (sizeof (*B) + size);
+  B->data = (void *)(B + 1);
+  B->size = size;
+  return B;
+}
+
+static void free_buf (struct tgl_inflate_buf *B) {
+  tfree (B, sizeof (*B) + B->size);
+}
+
+struct tgl_inflate_buf *tgl_inflate_packed (struct tgl_state *TLS, void *input, int ilen) {
+  struct tgl_inflater *I = get_inflater (TLS);
+  double start = tglt_get_double_time ();
+
+  int size = INFLATE_MIN_SIZE;
+  while (size < 4 * ilen && size < INFLATE_MAX_SIZE) {
+    size *= 2;
+  }
+  struct tgl_inflate_buf *B = alloc_buf (I, size);
+  I->strm.next_in = input;
+  I->strm.avail_in = ilen;
+  I->strm.next_out = (void *)B->data;
+  I->strm.avail_out = B->size;
+  while (1) {
+    int err = inflate (&I->strm, Z_FINISH);
+    if (err == Z_STREAM_END) {
+      break;
+    }
+    if ((err == Z_OK || err == Z_BUF_ERROR) && !I->strm.avail_out && B->size < INFLATE_MAX_SIZE) {
+      int old_size = B->size;
+      B = trealloc (B, sizeof (*B) + old_size, sizeof (*B) + 2 * old_size);
+      B->data = (void *)(B + 1);
+      B->size = 2 * old_size;
+      I->strm.next_out = (unsigned char *)B->data + old_size;
+      I->strm.avail_out = old_size;
+      continue;
+    }
+    vlogprintf (E_WARNING, "inflate error = %d, inflated %d bytes\n", err, (int)I->strm.total_out);
+    tgl_inflate_release (TLS, B);
+    return NULL;
+  }
+  B->len = I->strm.total_out;
+  B->in_len = ilen;
+  B->time = tglt_get_double_time () - start;
+  vlogprintf (E_DEBUG, "inflated %d bytes to %d\n", ilen, B->len);
+  return B;
+}
+
+void tgl_inflate_account (struct tgl_state *TLS, const char *name, struct tgl_inflate_buf *B) {
+  struct tgl_inflater *I = TLS->inflater;
+  int i;
+  for (i = 0; i < I->stats_num; i++) {
+    if (I->stats[i].name == name) { break; }
+  }
+  if (i == I->stats_num) {
+    if (i == INFLATE_STATS) {
+      // the last slot collects everything that does not fit
+      i --;
+      I->stats[i].name = "other";
+    } else {
+      I->stats[i].name = name;
+      I->stats_num ++;
+    }
+  }
+  I->stats[i].count ++;
+  I->stats[i].in_bytes += B->in_len;
+  I->stats[i].out_bytes += B->len;
+  I->stats[i].time += B->time;
+}
+
+void tgl_inflate_release (struct tgl_state *TLS, struct tgl_inflate_buf *B) {
+  struct tgl_inflater *I = TLS->inflater;
+  if (I->free_cnt == INFLATE_POOL_SIZE || B->size > INFLATE_POOL_MAX_SIZE) {
+    free_buf (B);
+    return;
+  }
+  B->next = I->free_list;
+  I->free_list = B;
+  I->free_cnt ++;
+}
+
+int tgl_print_inflate_stat (struct tgl_state *TLS, char *s, int len) {
+  struct tgl_inflater *I = TLS->inflater;
+  int pos = 0;
+  int i;
+  for (i = 0; I && i < I->stats_num && pos < len; i++) {
+    struct inflate_stat *S = &I->stats[i];
+    pos += tsnprintf (s + pos, len - pos,
+      "inflate_count[%s]\t%lld\n"
+      "inflate_ratio[%s]\t%.2f\n"
+      "inflate_time[%s]\t%.6f\n",
+      S->name, S->count,
+      S->name, S->in_bytes ? (double)S->out_bytes / S->in_bytes : 0.0,
+      S->name, S->time
+      );
+  }
+  return pos;
+}
+
+void tgl_inflate_free (struct tgl_state *TLS) {
+  struct tgl_inflater *I = TLS->inflater;
+  if (!I) { return; }
+  while (I->free_list) {
+    struct tgl_inflate_buf *B = I->free_list;
+    I->free_list = B->next;
+    free_buf (B);
+  }
+  inflateEnd (&I->strm);
+  tfree (I, sizeof (*I));
+  TLS->inflater = NULL;
+}
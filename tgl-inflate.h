@@ -0,0 +1,47 @@
+/* 
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Vitaly Valtman 2013-2015
+*/
+
+#ifndef __TGL_INFLATE_H__
+#define __TGL_INFLATE_H__
+
+struct tgl_state;
+
+/*
+ * gzip_packed objects are inflated by one zlib stream per state, which is reset
+ * rather than initialised anew. Output buffers grow on demand and are kept
+ * for reuse after release. Objects may be nested, each one gets its own buffer.
+ */
+struct tgl_inflate_buf {
+  struct tgl_inflate_buf *next;
+  int *data;
+  int size;
+  // inflated and packed lengths in bytes, time spent in inflate
+  int len;
+  int in_len;
+  double time;
+};
+
+// returns NULL if the stream is bad or inflates to more than the limit
+struct tgl_inflate_buf *tgl_inflate_packed (struct tgl_state *TLS, void *input, int ilen);
+// adds B to inflate statistics of name, which is compared by pointer
+void tgl_inflate_account (struct tgl_state *TLS, const char *name, struct tgl_inflate_buf *B);
+void tgl_inflate_release (struct tgl_state *TLS, struct tgl_inflate_buf *B);
+void tgl_inflate_free (struct tgl_state *TLS);
+#endif
@@ -139,17 +139,47 @@ enum tgl_dc_state {
   st_error
 };
 
+struct tgl_state;
+// timer of the wheel in tgl-timer-wheel.c, embedded into its owner
+struct tgl_wheel_timer {
+  struct tgl_wheel_timer *next, *prev;
+  long long expire;
+  void (*cb)(struct tgl_state *TLS, void *arg);
+  void *arg;
+};
+
 #define MAX_DC_SESSIONS 3
 
+#define TGLSF_MEDIA 1
+// session negotiating the next temporary key, see next_temp_* fields of tgl_dc
+#define TGLSF_NEXT_TEMP_KEY 2
+
 struct tgl_session {
   struct tgl_dc *dc;
+  int flags;
   long long session_id;
   long long last_msg_id;
   int seq_no;
   int received_messages;
   struct connection *c;
-  struct tree_long *ack_tree;
-  struct tgl_timer *ev;
+  // msg_ids of server messages to be acknowledged
+  long long *acks;
+  int acks_num;
+  int acks_size;
+  struct tgl_wheel_timer ev;
+  // queries currently placed on this session
+  struct query *queries;
+  int queries_num;
+  int bulk_queries_num;
+  // messages to be sent in one container at the end of loop iteration
+  int *batch;
+  int batch_ints;
+  int batch_num;
+  struct tgl_timer *batch_ev;
+  // received messages being decrypted by the crypto pool
+  struct rpc_frame *in_head;
+  struct rpc_frame *in_tail;
+  struct tgl_timer *in_ev;
 };
 
 struct tgl_dc_option {
@@ -167,6 +197,8 @@ struct tgl_dc {
   //char *ip;
   //char *user;
   struct tgl_session *sessions[MAX_DC_SESSIONS];
+  // queries sent to this DC, linked by dc_next
+  struct query *queries;
   char auth_key[256];
   char temp_auth_key[256];
   char nonce[256];
@@ -179,11 +211,30 @@ struct tgl_dc {
   long long server_salt;
   struct tgl_timer *ev;
 
+  // next temporary key, negotiated and bound in background before the current one expires
+  struct tgl_session *next_temp_session;
+  enum tgl_dc_state next_temp_state;
+  int next_temp_bound;
+  char next_temp_auth_key[256];
+  long long next_temp_auth_key_id;
+  long long next_temp_server_salt;
+  long long next_temp_bind_query_id;
+
   int server_time_delta;
   double server_time_udelta;
 
   // ipv4, ipv6, ipv4_media, ipv6_media
   struct tgl_dc_option *options[4];
+
+  // endpoint of the last successful connect: [0] for main options, [1] for media ones
+  struct tgl_dc_option *connected_option[2];
+  int connected_port[2];
+
+  // reconnect stats, maintained by net methods
+  int reconnects;
+  int connect_failures;
+  int reconnects_throttled;
+  double reconnect_delay;
 };
 
 enum tgl_message_entity_type {
@@ -323,7 +374,7 @@ struct tgl_encr_document {
 struct tgl_user_status {
   int online;
   int when;
-  struct tgl_timer *ev;
+  struct tgl_wheel_timer ev;
 };
 
 struct tgl_bot_command {
@@ -36,6 +36,38 @@ enum conn_state {
   conn_stopped
 };
 
+// io->want_write is called and tgln_conn_writable has not been called yet
+#define CONN_FLAG_WRITE_PENDING 1
+// last write was short, socket buffer is full
+#define CONN_FLAG_WRITE_BLOCKED 2
+// fd is watched by io methods
+#define CONN_FLAG_ATTACHED 4
+// connection is on the ready list of the epoll loop
+#define CONN_FLAG_WRITE_QUEUED 8
+
+struct connection;
+
+// parallel connect: at most CONNECT_PROBES attempts are in flight
+#define CONNECT_PROBES 4
+#define MAX_CONNECT_ENDPOINTS 32
+
+struct connect_endpoint {
+  struct tgl_dc_option *option;
+  const char *ip;
+  int port;
+};
+
+/*
+ * Way the connection fd is watched by the event loop.
+ * attach starts watching c->fd, detach stops it (it is called before c->fd is closed),
+ * want_write asks to call tgln_conn_writable once the fd is writable.
+ */
+struct connection_io_methods {
+  void (*attach) (struct connection *c);
+  void (*detach) (struct connection *c);
+  void (*want_write) (struct connection *c);
+};
+
 struct connection {
   int fd;
   char *ip;
@@ -53,28 +85,54 @@ struct connection {
   int out_packet_num;
   int last_connect_time;
   int in_fail_timer;
+  // failed connects in a row, reset when data is received
+  int fail_count;
   struct mtproto_methods *methods;
   struct tgl_state *TLS;
   struct tgl_session *session;
   struct tgl_dc *dc;
   void *extra;
-  struct event *ping_ev;
-  struct event *fail_ev;
+  struct connection_io_methods *io;
+  struct tgl_timer *ping_ev;
+  struct tgl_timer *fail_ev;
   struct event *read_ev;
   struct event *write_ev;
+  struct connection *next_ready;
+  int io_slot;
   double last_receive_time;
+  // connect attempts of this connection, owner is set on attempts themselves
+  struct connection *owner;
+  struct connection *probes[CONNECT_PROBES];
+  int probes_num;
+  // endpoints to try; for an attempt race_next is index of its endpoint in owner->race
+  struct connect_endpoint race[MAX_CONNECT_ENDPOINTS];
+  int race_num;
+  int race_next;
+  struct tgl_timer *race_ev;
 };
 
 //extern struct connection *Connections[];
 
 int tgln_write_out (struct connection *c, const void *data, int len);
+void *tgln_reserve_out (struct connection *c, int len);
 void tgln_flush_out (struct connection *c);
 int tgln_read_in (struct connection *c, void *data, int len);
 int tgln_read_in_lookup (struct connection *c, void *data, int len);
+void *tgln_read_in_ptr (struct connection *c, int len);
+void tgln_conn_readable (struct connection *c);
+void tgln_conn_writable (struct connection *c);
+struct iovec;
+int tgln_out_iovec (struct connection *c, struct iovec *iov, int max, int *total);
+struct connection_buffer *tgln_take_out (struct connection *c);
+void tgln_free_buffers (struct connection_buffer *b);
+void tgln_conn_sent (struct connection *c, int r);
+void tgln_conn_received (struct connection *c, const void *data, int len);
 
 //void tgln_insert_msg_id (struct tgl_session *S, long long id);
 
 extern struct tgl_net_methods tgl_conn_methods;
+extern struct tgl_net_methods tgl_epoll_conn_methods;
+extern struct tgl_net_methods tgl_uring_conn_methods;
 
 //void create_all_outbound_connections (void);
 
@@ -82,6 +140,7 @@ extern struct tgl_net_methods tgl_conn_methods;
 //struct tgl_dc *tgln_alloc_dc (int id, char *ip, int port);
 //void tgln_dc_create_session (struct tgl_dc *DC, struct mtproto_methods *methods);
 struct connection *tgln_create_connection (struct tgl_state *TLS, const char *host, int port, struct tgl_session *session, struct tgl_dc *dc, struct mtproto_methods *methods);
+struct connection *tgln_create_connection_io (struct tgl_state *TLS, const char *host, int port, struct tgl_session *session, struct tgl_dc *dc, struct mtproto_methods *methods, struct connection_io_methods *io);
 
 #define GET_DC(c) (c->session->dc)
 #endif
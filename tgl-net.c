@@ -36,11 +36,13 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <poll.h>
+#include <sys/uio.h>
+#include <pthread.h>
 #include "crypto/rand.h"
 #include <arpa/inet.h>
-#ifdef EVENT_V2
+#if defined(EVENT_V2)
 #include <event2/event.h>
-#else
+#elif defined(EVENT_V1)
 #include <event.h>
 #include "event-old.h"
 #endif
@@ -56,6 +58,9 @@
 #include "tree.h"
 #include "tools.h"
 #include "mtproto-client.h"
+#ifdef EPOLL
+#include "tgl-epoll.h"
+#endif
 
 #ifndef POLLRDHUP
 #define POLLRDHUP 0
@@ -69,10 +74,16 @@ static void fail_connection (struct connection *c);
 
 #define PING_TIMEOUT 10
 
+// max number of buffers gathered into one writev
+#define MAX_WRITE_IOVEC 64
+
 static void start_ping_timer (struct connection *c);
-static void ping_alarm (evutil_socket_t fd, short what, void *arg) {
+/*
+ * Ping timer is periodic and is not touched by reads,
+ * it only looks at last_receive_time
+ */
+static void ping_alarm (struct tgl_state *TLS, void *arg) {
   struct connection *c = arg;
-  struct tgl_state *TLS = c->TLS;
   vlogprintf (E_DEBUG + 2,"ping alarm\n");
   assert (c->state == conn_ready || c->state == conn_connecting);
   if (tglt_get_double_time () - c->last_receive_time > 6 * PING_TIMEOUT) {
@@ -88,18 +99,94 @@ static void ping_alarm (evutil_socket_t fd, short what, void *arg) {
 }
 
 static void stop_ping_timer (struct connection *c) {
-  event_del (c->ping_ev);
+  c->TLS->timer_methods->remove (c->ping_ev);
 }
 
 static void start_ping_timer (struct connection *c) {
-  static struct timeval ptimeout = { PING_TIMEOUT, 0};
-  event_add (c->ping_ev, &ptimeout);
+  c->TLS->timer_methods->insert (c->ping_ev, PING_TIMEOUT);
 }
 
 static void restart_connection (struct connection *c);
 
-static void fail_alarm (evutil_socket_t fd, short what, void *arg) {
+/*
+ * Reconnects are scheduled with capped exponential backoff and jitter,
+ * so connections that failed together do not come back in lock-step.
+ * On top of that every connect of the process, the first one included,
+ * passes a token bucket shared by all threads and states.
+ */
+#define RECONNECT_BASE 0.5
+#define RECONNECT_MAX 60
+// reconnects per second and burst of the token bucket
+#define RECONNECT_RATE 5
+#define RECONNECT_BURST 10
+
+static struct reconnect_bucket {
+  double tokens;
+  double last;
+  long long taken;
+  long long throttled;
+} reconnect_bucket = { RECONNECT_BURST, 0, 0, 0 };
+static pthread_mutex_t reconnect_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// random number in [0, 1). rand () is shared with the application and is not thread-safe
+static double drand (void) {
+  static TGL_THREAD unsigned long long x;
+  if (!x) {
+    tglt_secure_random (&x, 8);
+    x |= 1;
+  }
+  x ^= x << 13;
+  x ^= x >> 7;
+  x ^= x << 17;
+  return (x >> 11) * (1.0 / (1ull << 53));
+}
+
+static double reconnect_delay (struct connection *c) {
+  double d = RECONNECT_BASE;
+  int i;
+  for (i = 0; i < c->fail_count && d < RECONNECT_MAX; i++) {
+    d *= 2;
+  }
+  if (d > RECONNECT_MAX) { d = RECONNECT_MAX; }
+  // half of the delay is random
+  return d / 2 + d / 2 * drand ();
+}
+
+// returns 0 if token is taken, otherwise time until next one
+static double reconnect_take_token (int count_throttled) {
+  struct reconnect_bucket *B = &reconnect_bucket;
+  double now = tglt_get_double_time ();
+  double wait = 0;
+  pthread_mutex_lock (&reconnect_lock);
+  if (B->last && now > B->last) {
+    B->tokens += (now - B->last) * RECONNECT_RATE;
+    if (B->tokens > RECONNECT_BURST) { B->tokens = RECONNECT_BURST; }
+  }
+  B->last = now;
+  if (B->tokens >= 1) {
+    B->tokens -= 1;
+    B->taken ++;
+  } else {
+    wait = (1 - B->tokens) / RECONNECT_RATE;
+    B->throttled += count_throttled;
+  }
+  pthread_mutex_unlock (&reconnect_lock);
+  return wait;
+}
+
+static void fail_alarm (struct tgl_state *TLS, void *arg) {
   struct connection *c = arg;
+  // throttled connect is counted once, not on every retry
+  double wait = reconnect_take_token (c->in_fail_timer == 1);
+  if (wait > 0) {
+    if (c->in_fail_timer == 1) {
+      c->in_fail_timer = 2;
+      if (c->dc) { c->dc->reconnects_throttled ++; }
+    }
+    // spread the waiting ones so that they do not hit the bucket at once
+    TLS->timer_methods->insert (c->fail_ev, wait * (1 + drand ()));
+    return;
+  }
   c->in_fail_timer = 0;
   restart_connection (c);
 }
@@ -108,11 +195,70 @@ static void start_fail_timer (struct connection *c) {
   if (c->in_fail_timer) { return; }
   c->in_fail_timer = 1;  
 
-  static struct timeval ptimeout = { 10, 0};
-  event_add (c->fail_ev, &ptimeout);
+  double delay = reconnect_delay (c);
+  c->fail_count ++;
+  if (c->dc) {
+    c->dc->reconnect_delay = delay;
+  }
+  c->TLS->timer_methods->insert (c->fail_ev, delay);
+}
+
+/*
+ * Connection buffers are taken from a per-thread pool split into size classes.
+ * A buffer of the smallest class that fits the requested size is handed out,
+ * so idle connections (and the single 0xef framing byte) no longer pin 1MiB chunks.
+ * Released buffers are kept on per-class free lists up to a watermark,
+ * everything above it is returned to the allocator.
+ */
+#define BUFFER_CLASSES 3
+
+static const int buffer_class_size[BUFFER_CLASSES] = { 1 << 12, 1 << 16, 1 << 20 };
+static const int buffer_class_watermark[BUFFER_CLASSES] = { 256, 64, 4 };
+
+static TGL_THREAD struct buffer_class {
+  struct connection_buffer *free_list;
+  int free_cnt;
+  int used_cnt;
+  long long allocated;
+  long long reused;
+  long long reclaimed;
+} buffer_pool[BUFFER_CLASSES];
+
+static int buffer_class_by_size (int size) {
+  int i;
+  for (i = 0; i < BUFFER_CLASSES - 1; i++) {
+    if (size <= buffer_class_size[i]) {
+      return i;
+    }
+  }
+  return BUFFER_CLASSES - 1;
 }
 
 static struct connection_buffer *new_connection_buffer (int size) {
+  int c = buffer_class_by_size (size);
+  struct buffer_class *P = &buffer_pool[c];
+  struct connection_buffer *b = P->free_list;
+  if (b) {
+    P->free_list = b->next;
+    P->free_cnt --;
+    P->reused ++;
+  } else {
+    b = talloc (sizeof (*b));
+    b->start = talloc (buffer_class_size[c]);
+    b->end = b->start + buffer_class_size[c];
+    P->allocated ++;
+  }
+  b->rptr = b->wptr = b->start;
+  b->next = 0;
+  P->used_cnt ++;
+  return b;
+}
+
+// buffers larger than the biggest class are allocated exactly and never pooled
+static struct connection_buffer *new_connection_buffer_exact (int size) {
+  if (size <= buffer_class_size[BUFFER_CLASSES - 1]) {
+    return new_connection_buffer (size);
+  }
   struct connection_buffer *b = talloc0 (sizeof (*b));
   b->start = talloc (size);
   b->end = b->start + size;
@@ -121,8 +267,77 @@ static struct connection_buffer *new_connection_buffer (int size) {
 }
 
 static void delete_connection_buffer (struct connection_buffer *b) {
-  tfree (b->start, b->end - b->start);
-  tfree (b, sizeof (*b));
+  int size = b->end - b->start;
+  if (size > buffer_class_size[BUFFER_CLASSES - 1]) {
+    tfree (b->start, size);
+    tfree (b, sizeof (*b));
+    return;
+  }
+  int c = buffer_class_by_size (size);
+  assert (buffer_class_size[c] == size);
+  struct buffer_class *P = &buffer_pool[c];
+  assert (P->used_cnt > 0);
+  P->used_cnt --;
+  if (P->free_cnt >= buffer_class_watermark[c]) {
+    P->reclaimed ++;
+    tfree (b->start, size);
+    tfree (b, sizeof (*b));
+    return;
+  }
+  b->next = P->free_list;
+  P->free_list = b;
+  P->free_cnt ++;
+}
+
+int tgln_print_buffer_pool_stat (char *s, int len) {
+  int i;
+  int pos = 0;
+  for (i = 0; i < BUFFER_CLASSES && pos < len; i++) {
+    struct buffer_class *P = &buffer_pool[i];
+    pos += tsnprintf (s + pos, len - pos,
+      "buffers_%d_used\t%d\n"
+      "buffers_%d_free\t%d\n"
+      "buffers_%d_allocated\t%lld\n"
+      "buffers_%d_reused\t%lld\n"
+      "buffers_%d_reclaimed\t%lld\n",
+      buffer_class_size[i], P->used_cnt,
+      buffer_class_size[i], P->free_cnt,
+      buffer_class_size[i], P->allocated,
+      buffer_class_size[i], P->reused,
+      buffer_class_size[i], P->reclaimed
+      );
+  }
+  return pos;
+}
+
+int tgln_print_reconnect_stat (struct tgl_state *TLS, char *s, int len) {
+  pthread_mutex_lock (&reconnect_lock);
+  struct reconnect_bucket B = reconnect_bucket;
+  pthread_mutex_unlock (&reconnect_lock);
+  int pos = tsnprintf (s, len,
+    "reconnect_tokens\t%.2f\n"
+    "reconnects_taken\t%lld\n"
+    "reconnects_throttled\t%lld\n",
+    B.tokens,
+    B.taken,
+    B.throttled
+    );
+  int i;
+  for (i = 0; i <= TLS->max_dc_num && pos < len; i++) {
+    struct tgl_dc *DC = TLS->DC_list[i];
+    if (!DC) { continue; }
+    pos += tsnprintf (s + pos, len - pos,
+      "dc_%d_reconnects\t%d\n"
+      "dc_%d_connect_failures\t%d\n"
+      "dc_%d_reconnects_throttled\t%d\n"
+      "dc_%d_reconnect_delay\t%.3f\n",
+      DC->id, DC->reconnects,
+      DC->id, DC->connect_failures,
+      DC->id, DC->reconnects_throttled,
+      DC->id, DC->reconnect_delay
+      );
+  }
+  return pos;
 }
 
 int tgln_write_out (struct connection *c, const void *_data, int len) {
@@ -132,11 +347,8 @@ int tgln_write_out (struct connection *c, const void *_data, int len) {
   if (!len) { return 0; }
   assert (len > 0);
   int x = 0;
-  if (!c->out_bytes) {
-    event_add (c->write_ev, 0);
-  }
   if (!c->out_head) {
-    struct connection_buffer *b = new_connection_buffer (1 << 20);
+    struct connection_buffer *b = new_connection_buffer (len);
     c->out_head = c->out_tail = b;
   }
   while (len) {
@@ -149,12 +361,14 @@ int tgln_write_out (struct connection *c, const void *_data, int len) {
       int y = c->out_tail->end - c->out_tail->wptr;
       assert (y < len);
       memcpy (c->out_tail->wptr, data, y);
+      c->out_tail->wptr += y;
       x += y;
       len -= y;
       data += y;
-      struct connection_buffer *b = new_connection_buffer (1 << 20);
+      // long writes move on to the next size class, like reads do
+      int size = c->out_tail->end - c->out_tail->start + 1;
+      struct connection_buffer *b = new_connection_buffer (len > size ? len : size);
       c->out_tail->next = b;
-      b->next = 0;
       c->out_tail = b;
       c->out_bytes += y;
     }
@@ -162,6 +376,26 @@ int tgln_write_out (struct connection *c, const void *_data, int len) {
   return x;
 }
 
+/*
+ * Appends len bytes to the output chain and returns them contiguous,
+ * so that a packet can be serialized and encrypted right there.
+ * Tail of the current buffer is left unused if the data does not fit in it.
+ */
+void *tgln_reserve_out (struct connection *c, int len) {
+  assert (len > 0);
+  if (!c->out_head) {
+    c->out_head = c->out_tail = new_connection_buffer_exact (len);
+  } else if (c->out_tail->end - c->out_tail->wptr < len) {
+    struct connection_buffer *b = new_connection_buffer_exact (len);
+    c->out_tail->next = b;
+    c->out_tail = b;
+  }
+  void *r = c->out_tail->wptr;
+  c->out_tail->wptr += len;
+  c->out_bytes += len;
+  return r;
+}
+
 int tgln_read_in (struct connection *c, void *_data, int len) {
   unsigned char *data = _data;
   if (!len) { return 0; }
@@ -219,62 +453,190 @@ int tgln_read_in_lookup (struct connection *c, void *_data, int len) {
   return x;
 }
 
+static void release_read_buffers (struct connection *c) {
+  while (c->in_head && c->in_head->rptr == c->in_head->wptr) {
+    struct connection_buffer *b = c->in_head;
+    c->in_head = b->next;
+    if (!c->in_head) {
+      c->in_tail = 0;
+    }
+    delete_connection_buffer (b);
+  }
+}
+
+/*
+ * Returns pointer to next len bytes of input and consumes them.
+ * Data is returned in place when it lies in one buffer, otherwise it is linearised
+ * into a new buffer put at the head of the chain. Consumed buffers are not released
+ * until the next read, so the data may be modified in place (i.e. decrypted) until then.
+ * Failing or freeing the connection releases them at once and the buffers may be handed
+ * to another connection, so the data must not be touched after that.
+ */
+void *tgln_read_in_ptr (struct connection *c, int len) {
+  assert (len > 0 && len <= c->in_bytes);
+  release_read_buffers (c);
+  struct connection_buffer *b = c->in_head;
+#if defined(__i386__) || defined(__x86_64__)
+  if (b->wptr - b->rptr < len) {
+#else
+  // frames are parsed as ints, so they have to be aligned here
+  if (b->wptr - b->rptr < len || ((long)b->rptr & 3)) {
+#endif
+    b = new_connection_buffer_exact (len);
+    assert (tgln_read_in (c, b->wptr, len) == len);
+    b->wptr += len;
+    b->next = c->in_head;
+    c->in_head = b;
+    if (!c->in_tail) {
+      c->in_tail = b;
+    }
+    c->in_bytes += len;
+  }
+  void *r = b->rptr;
+  b->rptr += len;
+  c->in_bytes -= len;
+  return r;
+}
+
+/*
+ * tgln_write_out only appends to the output chain (the connection stays corked).
+ * tgln_flush_out uncorks it: everything queued up to the next writable event
+ * of the loop is sent with a single writev.
+ */
 void tgln_flush_out (struct connection *c) {
+  if (!c->out_bytes || (c->flags & CONN_FLAG_WRITE_PENDING)) {
+    return;
+  }
+  if (c->state != conn_ready && c->state != conn_connecting) {
+    return;
+  }
+  // still racing connect attempts, output goes once one of them wins
+  if (!(c->flags & CONN_FLAG_ATTACHED)) {
+    return;
+  }
+  c->flags |= CONN_FLAG_WRITE_PENDING;
+  c->io->want_write (c);
 }
 
-#define MAX_CONNECTIONS 100
-static struct connection *Connections[MAX_CONNECTIONS];
-static int max_connection_fd;
+static void register_connection (struct connection *c) {
+  struct tgl_state *TLS = c->TLS;
+  if (c->fd >= TLS->connections_size) {
+    int new_size = TLS->connections_size ? 2 * TLS->connections_size : 16;
+    while (new_size <= c->fd) {
+      new_size *= 2;
+    }
+    int old_size = TLS->connections_size;
+    if (old_size) {
+      TLS->Connections = trealloc (TLS->Connections, old_size * sizeof (void *), new_size * sizeof (void *));
+    } else {
+      TLS->Connections = talloc (new_size * sizeof (void *));
+    }
+    memset (TLS->Connections + old_size, 0, (new_size - old_size) * sizeof (void *));
+    TLS->connections_size = new_size;
+  }
+  assert (!TLS->Connections[c->fd]);
+  TLS->Connections[c->fd] = c;
+  TLS->connections_num ++;
+}
 
-static void rotate_port (struct connection *c) {
-  switch (c->port) {
-  case 443:
-    c->port = 80;
-    break;
-  case 80:
-    c->port = 25;
-    break;
-  case 25:
-    c->port = 443;
-    break;
+static void unregister_connection (struct connection *c) {
+  struct tgl_state *TLS = c->TLS;
+  if (c->fd >= 0 && c->fd < TLS->connections_size && TLS->Connections[c->fd] == c) {
+    TLS->Connections[c->fd] = 0;
+    TLS->connections_num --;
   }
 }
 
 static void try_read (struct connection *c);
 static void try_write (struct connection *c);
+static void probe_event (struct connection *p, int err);
 
-static void conn_try_read (evutil_socket_t fd, short what, void *arg) {
-  struct connection *c = arg;
+void tgln_conn_readable (struct connection *c) {
   struct tgl_state *TLS = c->TLS;
+  if (c->owner) {
+    probe_event (c, 0);
+    return;
+  }
   vlogprintf (E_DEBUG + 1, "Try read. Fd = %d\n", c->fd);
   try_read (c);
 }
-static void conn_try_write (evutil_socket_t fd, short what, void *arg) {
-  struct connection *c = arg;
+
+void tgln_conn_writable (struct connection *c) {
   struct tgl_state *TLS = c->TLS;
+  if (c->owner) {
+    probe_event (c, 0);
+    return;
+  }
+  c->flags &= ~(CONN_FLAG_WRITE_PENDING | CONN_FLAG_WRITE_BLOCKED);
   if (c->state == conn_connecting) {
     c->state = conn_ready;
     c->methods->ready (TLS, c);
   }
   try_write (c);
-  if (c->out_bytes) {
-    event_add (c->write_ev, 0);
+  tgln_flush_out (c);
+}
+
+#if defined(EVENT_V2) || defined(EVENT_V1)
+static void conn_try_read (evutil_socket_t fd, short what, void *arg) {
+  struct connection *c = arg;
+  #ifdef EVENT_V1
+    struct timeval tv = {5, 0};
+    event_add (c->read_ev, &tv);
+  #endif
+  tgln_conn_readable (c);
+}
+
+static void conn_try_write (evutil_socket_t fd, short what, void *arg) {
+  tgln_conn_writable (arg);
+}
+
+static void libevent_attach (struct connection *c) {
+  struct tgl_state *TLS = c->TLS;
+  c->write_ev = event_new (TLS->ev_base, c->fd, EV_WRITE, conn_try_write, c);
+
+  struct timeval tv = {5, 0};
+  c->read_ev = event_new (TLS->ev_base, c->fd, EV_READ | EV_PERSIST, conn_try_read, c);
+  event_add (c->read_ev, &tv);
+}
+
+static void libevent_detach (struct connection *c) {
+  if (c->write_ev) { event_free (c->write_ev); }
+  if (c->read_ev) { event_free (c->read_ev); }
+  c->write_ev = c->read_ev = 0;
+}
+
+static void libevent_want_write (struct connection *c) {
+  event_add (c->write_ev, 0);
+}
+
+static struct connection_io_methods libevent_io = {
+  .attach = libevent_attach,
+  .detach = libevent_detach,
+  .want_write = libevent_want_write
+};
+#endif
+
+static void attach_connection (struct connection *c) {
+  assert (!(c->flags & CONN_FLAG_ATTACHED));
+  c->io->attach (c);
+  c->flags |= CONN_FLAG_ATTACHED;
+}
+
+static void detach_connection (struct connection *c) {
+  if (c->flags & CONN_FLAG_ATTACHED) {
+    c->io->detach (c);
+    c->flags &= ~CONN_FLAG_ATTACHED;
   }
 }
   
-static int my_connect (struct connection *c, const char *host) {
+static int my_connect (struct connection *c, const char *host, int port) {
   struct tgl_state *TLS = c->TLS;
-  int v6 = TLS->ipv6_enabled;
+  int v6 = strchr (host, ':') != NULL;
   int fd = socket (v6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
   if (fd < 0) {
     vlogprintf (E_ERROR, "Can not create socket: %s\n", strerror(errno));
-    start_fail_timer (c);
     return -1;
   }
-  assert (fd >= 0 && fd < MAX_CONNECTIONS);
-  if (fd > max_connection_fd) {
-    max_connection_fd = fd;
-  }
   int flags = -1;
   setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &flags, sizeof (flags));
   setsockopt (fd, SOL_SOCKET, SO_KEEPALIVE, &flags, sizeof (flags));
@@ -286,7 +648,7 @@ static int my_connect (struct connection *c, const char *host) {
   memset (&addr6, 0, sizeof (addr6));
   if (v6) {
     addr6.sin6_family = AF_INET6; 
-    addr6.sin6_port = htons (c->port);
+    addr6.sin6_port = htons (port);
     if (inet_pton (AF_INET6, host, &addr6.sin6_addr.s6_addr) != 1) {    
       vlogprintf (E_ERROR, "Bad ipv6 %s\n", host);
       close (fd);
@@ -294,7 +656,7 @@ static int my_connect (struct connection *c, const char *host) {
     }
   } else {
     addr.sin_family = AF_INET; 
-    addr.sin_port = htons (c->port);
+    addr.sin_port = htons (port);
     if (inet_pton (AF_INET, host, &addr.sin_addr.s_addr) != 1) {
       vlogprintf (E_ERROR, "Bad ipv4 %s\n", host);
       close (fd);
@@ -306,88 +668,332 @@ static int my_connect (struct connection *c, const char *host) {
 
   if (connect (fd, (struct sockaddr *) (v6 ? (void *)&addr6 : (void *)&addr), v6 ? sizeof (addr6) : sizeof (addr)) == -1) {
     if (errno != EINPROGRESS) {
+      int err = errno;
       close (fd);
+      errno = err;
       return -1;
     }
   }
   return fd;
 }
 
-struct connection *tgln_create_connection (struct tgl_state *TLS, const char *host, int port, struct tgl_session *session, struct tgl_dc *dc, struct mtproto_methods *methods) {
-  struct connection *c = talloc0 (sizeof (*c));
-  c->TLS = TLS;
-  c->ip = tstrdup (host);
-  c->port = port;
-  
-  int fd = my_connect (c, c->ip);
+/*
+ * Connect is raced over all known endpoints of the DC: both address families and all ports.
+ * A new attempt is started every CONNECT_STAGGER seconds, or at once when one fails.
+ * The first socket that connects is taken by the connection, the other attempts are closed.
+ * Winning endpoint is remembered in the DC and goes first on the next reconnect.
+ */
+#define CONNECT_STAGGER 0.25
+// the oldest attempt is dropped to make room for a new one only after this time
+#define CONNECT_PROBE_TIMEOUT 3
+// time given to the last attempts before the whole connect fails
+#define CONNECT_TIMEOUT 10
+
+static const int race_ports[] = { 0, 443, 80, 25 };
+
+static void race_add (struct connection *c, struct tgl_dc_option *O, const char *ip, int port) {
+  if (c->race_num == MAX_CONNECT_ENDPOINTS) { return; }
+  int i;
+  for (i = 0; i < c->race_num; i++) {
+    if (c->race[i].port == port && !strcmp (c->race[i].ip, ip)) { return; }
+  }
+  struct connect_endpoint *E = &c->race[c->race_num ++];
+  E->option = O;
+  E->ip = ip;
+  E->port = port;
+}
+
+static void race_build (struct connection *c) {
+  struct tgl_state *TLS = c->TLS;
+  struct tgl_dc *DC = c->dc;
+  c->race_num = 0;
+  c->race_next = 0;
+
+  // only options of the same kind (main or media) as c->ip are used
+  struct tgl_dc_option *own = 0;
+  int base = 0;
+  int i;
+  if (DC) {
+    for (i = 0; i < 4 && !own; i++) {
+      struct tgl_dc_option *O = DC->options[i];
+      while (O && strcmp (O->ip, c->ip)) {
+        O = O->next;
+      }
+      if (O) {
+        own = O;
+        base = i & 2;
+      }
+    }
+    struct tgl_dc_option *L = DC->connected_option[base >> 1];
+    if (L) {
+      race_add (c, L, L->ip, DC->connected_port[base >> 1]);
+    }
+  }
+  race_add (c, own, c->ip, c->port);
+
+  int pref = TLS->ipv6_enabled ? 1 : 0;
+  for (i = 0; i < (int)(sizeof (race_ports) / sizeof (race_ports[0])); i++) {
+    int port = race_ports[i];
+    // address families are interleaved, preferred one goes first
+    struct tgl_dc_option *A = DC ? DC->options[base + pref] : 0;
+    struct tgl_dc_option *B = DC ? DC->options[base + 1 - pref] : 0;
+    while (A || B) {
+      if (A) {
+        race_add (c, A, A->ip, port ? port : A->port);
+        A = A->next;
+      }
+      if (B) {
+        race_add (c, B, B->ip, port ? port : B->port);
+        B = B->next;
+      }
+    }
+    race_add (c, own, c->ip, port ? port : c->port);
+  }
+}
+
+static void race_drop (struct connection *c, int i, int close_fd) {
+  struct connection *p = c->probes[i];
+  detach_connection (p);
+  if (close_fd) {
+    close (p->fd);
+  }
+  tfree (p, sizeof (*p));
+  c->probes_num --;
+  memmove (c->probes + i, c->probes + i + 1, (c->probes_num - i) * sizeof (void *));
+}
+
+static void race_stop (struct connection *c) {
+  while (c->probes_num) {
+    race_drop (c, c->probes_num - 1, 1);
+  }
+  if (c->race_ev) {
+    c->TLS->timer_methods->remove (c->race_ev);
+  }
+}
+
+// drops all input and output, output starts anew with the abridged transport byte
+static void reset_connection_buffers (struct connection *c) {
+  struct connection_buffer *b = c->out_head;
+  while (b) {
+    struct connection_buffer *d = b;
+    b = b->next;
+    delete_connection_buffer (d);
+  }
+  b = c->in_head;
+  while (b) {
+    struct connection_buffer *d = b;
+    b = b->next;
+    delete_connection_buffer (d);
+  }
+  c->out_head = c->out_tail = c->in_head = c->in_tail = 0;
+  c->out_bytes = c->in_bytes = 0;
+  char byte = 0xef;
+  assert (tgln_write_out (c, &byte, 1) == 1);
+}
+
+static void race_fail (struct connection *c) {
+  struct tgl_state *TLS = c->TLS;
+  vlogprintf (E_WARNING, "Can not connect to %s:%d (%d endpoints tried)\n", c->ip, c->port, c->race_next);
+  if (c->dc) {
+    c->dc->connect_failures ++;
+  }
+  race_stop (c);
+  stop_ping_timer (c);
+  // queued queries are resent by the session
+  reset_connection_buffers (c);
+  c->state = conn_failed;
+  start_fail_timer (c);
+}
+
+static int race_probe (struct connection *c, struct connect_endpoint *E) {
+  struct tgl_state *TLS = c->TLS;
+  vlogprintf (E_DEBUG, "Trying %s:%d\n", E->ip, E->port);
+  int fd = my_connect (c, E->ip, E->port);
   if (fd < 0) {
-    vlogprintf (E_ERROR, "Can not connect to %s:%d %s\n", host, port, strerror(errno));
-    tfree (c, sizeof (*c));
-    return 0;
+    vlogprintf (E_NOTICE, "Can not connect to %s:%d %s\n", E->ip, E->port, strerror(errno));
+    return -1;
+  }
+  struct connection *p = talloc0 (sizeof (*p));
+  p->TLS = TLS;
+  p->io = c->io;
+  p->fd = fd;
+  p->state = conn_connecting;
+  p->owner = c;
+  p->race_next = E - c->race;
+  // start time of the attempt
+  p->last_receive_time = tglt_get_double_time ();
+  c->probes[c->probes_num ++] = p;
+  attach_connection (p);
+  p->io->want_write (p);
+  return 0;
+}
+
+static void race_launch (struct connection *c) {
+  double wait = CONNECT_STAGGER;
+  while (c->race_next < c->race_num) {
+    if (c->probes_num == CONNECT_PROBES) {
+      double left = c->probes[0]->last_receive_time + CONNECT_PROBE_TIMEOUT - tglt_get_double_time ();
+      if (left > 0) {
+        wait = left;
+        break;
+      }
+      race_drop (c, 0, 1);
+    }
+    if (race_probe (c, &c->race[c->race_next ++]) >= 0) {
+      break;
+    }
   }
+  if (!c->probes_num) {
+    race_fail (c);
+    return;
+  }
+  if (c->race_next == c->race_num) {
+    wait = CONNECT_TIMEOUT;
+  }
+  c->TLS->timer_methods->insert (c->race_ev, wait);
+}
 
-  c->fd = fd;
+static void race_alarm (struct tgl_state *TLS, void *arg) {
+  struct connection *c = arg;
+  if (c->race_next == c->race_num) {
+    race_fail (c);
+  } else {
+    race_launch (c);
+  }
+}
+
+static void race_start (struct connection *c) {
   c->state = conn_connecting;
   c->last_receive_time = tglt_get_double_time ();
-  c->flags = 0;
-  assert (!Connections[fd]);
-  Connections[fd] = c;
- 
-  c->ping_ev = evtimer_new (TLS->ev_base, ping_alarm, c);
-  c->fail_ev = evtimer_new (TLS->ev_base, fail_alarm, c);
-  c->write_ev = event_new (TLS->ev_base, c->fd, EV_WRITE, conn_try_write, c);
+  start_ping_timer (c);
+  race_build (c);
+  race_launch (c);
+}
 
-  struct timeval tv = {5, 0};
-  c->read_ev = event_new (TLS->ev_base, c->fd, EV_READ | EV_PERSIST, conn_try_read, c);
-  event_add (c->read_ev, &tv);
+static void race_win (struct connection *c, int i) {
+  struct tgl_state *TLS = c->TLS;
+  struct connection *p = c->probes[i];
+  struct connect_endpoint *E = &c->race[p->race_next];
+  struct tgl_dc_option *O = E->option;
+  char *ip = tstrdup (E->ip);
+  int port = E->port;
+  int fd = p->fd;
+  race_drop (c, i, 0);
+  race_stop (c);
 
-  start_ping_timer (c);
+  tfree_str (c->ip);
+  c->ip = ip;
+  c->port = port;
+  if (c->dc && O) {
+    int media = 0;
+    int k;
+    for (k = 2; k < 4; k++) {
+      struct tgl_dc_option *T = c->dc->options[k];
+      while (T && T != O) {
+        T = T->next;
+      }
+      if (T) { media = 1; }
+    }
+    c->dc->connected_option[media] = O;
+    c->dc->connected_port[media] = port;
+  }
+  vlogprintf (E_NOTICE, "Connected to %s:%d\n", c->ip, c->port);
+
+  c->fd = fd;
+  register_connection (c);
+  attach_connection (c);
+  tgln_conn_writable (c);
+}
+
+static void probe_event (struct connection *p, int err) {
+  struct connection *c = p->owner;
+  struct tgl_state *TLS = c->TLS;
+  int i = 0;
+  while (c->probes[i] != p) {
+    i ++;
+  }
+  if (!err) {
+    socklen_t len = sizeof (err);
+    if (getsockopt (p->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) {
+      err = errno;
+    }
+  }
+  if (!err) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof (addr);
+    if (getpeername (p->fd, (struct sockaddr *)&addr, &len) >= 0) {
+      race_win (c, i);
+      return;
+    }
+    if (errno == ENOTCONN) {
+      // still connecting
+      p->io->want_write (p);
+      return;
+    }
+    err = errno;
+  }
+  struct connect_endpoint *E = &c->race[p->race_next];
+  vlogprintf (E_NOTICE, "Can not connect to %s:%d %s\n", E->ip, E->port, strerror(err));
+  race_drop (c, i, 1);
+  if (c->race_next < c->race_num || !c->probes_num) {
+    race_launch (c);
+  }
+}
+
+struct connection *tgln_create_connection_io (struct tgl_state *TLS, const char *host, int port, struct tgl_session *session, struct tgl_dc *dc, struct mtproto_methods *methods, struct connection_io_methods *io) {
+  struct connection *c = talloc0 (sizeof (*c));
+  c->TLS = TLS;
+  c->io = io;
+  c->ip = tstrdup (host);
+  c->port = port;
+  c->fd = -1;
+  c->flags = 0;
 
   c->dc = dc;
   c->session = session;
   c->methods = methods;
+ 
+  c->ping_ev = TLS->timer_methods->alloc (TLS, ping_alarm, c);
+  c->fail_ev = TLS->timer_methods->alloc (TLS, fail_alarm, c);
+  c->race_ev = TLS->timer_methods->alloc (TLS, race_alarm, c);
 
-  char byte = 0xef;
-  assert (tgln_write_out (c, &byte, 1) == 1);
-  tgln_flush_out (c);
+  reset_connection_buffers (c);
 
+  // the first connect passes the reconnect bucket too and waits in the fail timer if throttled
+  c->state = conn_failed;
+  c->in_fail_timer = 1;
+  fail_alarm (TLS, c);
   return c;
 }
 
+#if defined(EVENT_V2) || defined(EVENT_V1)
+struct connection *tgln_create_connection (struct tgl_state *TLS, const char *host, int port, struct tgl_session *session, struct tgl_dc *dc, struct mtproto_methods *methods) {
+  return tgln_create_connection_io (TLS, host, port, session, dc, methods, &libevent_io);
+}
+#endif
+
+#ifdef EPOLL
+static struct connection *epoll_create_connection (struct tgl_state *TLS, const char *host, int port, struct tgl_session *session, struct tgl_dc *dc, struct mtproto_methods *methods) {
+  return tgln_create_connection_io (TLS, host, port, session, dc, methods, &tgl_epoll_io);
+}
+#endif
+
+#ifdef IO_URING
+static struct connection *uring_create_connection (struct tgl_state *TLS, const char *host, int port, struct tgl_session *session, struct tgl_dc *dc, struct mtproto_methods *methods) {
+  return tgln_create_connection_io (TLS, host, port, session, dc, methods, &tgl_uring_io);
+}
+#endif
+
 static void restart_connection (struct connection *c) {
-  struct tgl_state *TLS = c->TLS;
-  if (c->last_connect_time == time (0)) {
-    start_fail_timer (c);
-    return;
-  }
-  
   /*if (strcmp (c->ip, c->dc->ip)) {
     tfree_str (c->ip);
     c->ip = tstrdup (c->dc->ip);
   }*/
-  c->last_connect_time = time (0);
-  int fd = my_connect (c, c->ip);
-  if (fd < 0) {
-    vlogprintf (E_WARNING, "Can not connect to %s:%d %s\n", c->ip, c->port, strerror(errno));
-    start_fail_timer (c);
-    return;
+  if (c->dc && c->last_connect_time) {
+    c->dc->reconnects ++;
   }
-
-  c->fd = fd;
-  c->state = conn_connecting;
-  c->last_receive_time = tglt_get_double_time ();
-  start_ping_timer (c);
-  Connections[fd] = c;
-  
-  c->write_ev = event_new (TLS->ev_base, c->fd, EV_WRITE, conn_try_write, c);
-
-  struct timeval tv = {5, 0};
-  c->read_ev = event_new (TLS->ev_base, c->fd, EV_READ | EV_PERSIST, conn_try_read, c);
-  event_add (c->read_ev, &tv);
-  
-  char byte = 0xef;
-  assert (tgln_write_out (c, &byte, 1) == 1);
-  tgln_flush_out (c);
+  c->last_connect_time = time (0);
+  race_start (c);
 }
 
 static void fail_connection (struct connection *c) {
@@ -395,29 +1001,68 @@ static void fail_connection (struct connection *c) {
   if (c->state == conn_ready || c->state == conn_connecting) {
     stop_ping_timer (c);
   }
-  event_free (c->write_ev);
-  event_free (c->read_ev);
-  
-  rotate_port (c);
+  race_stop (c);
+  detach_connection (c);
+  c->flags &= ~(CONN_FLAG_WRITE_PENDING | CONN_FLAG_WRITE_BLOCKED);
+  reset_connection_buffers (c);
+  c->state = conn_failed;
+  unregister_connection (c);
+  if (c->fd >= 0) {
+    close (c->fd);
+  }
+  c->fd = -1;
+  vlogprintf (E_NOTICE, "Lost connection to server... %s:%d\n", c->ip, c->port);
+  start_fail_timer (c);
+}
+
+// takes the whole output away from c, it is to be freed with tgln_free_buffers
+struct connection_buffer *tgln_take_out (struct connection *c) {
   struct connection_buffer *b = c->out_head;
+  c->out_head = c->out_tail = 0;
+  c->out_bytes = 0;
+  return b;
+}
+
+void tgln_free_buffers (struct connection_buffer *b) {
   while (b) {
     struct connection_buffer *d = b;
     b = b->next;
     delete_connection_buffer (d);
   }
-  b = c->in_head;
-  while (b) {
-    struct connection_buffer *d = b;
+}
+
+/*
+ * Fills iov with the queued output, at most max buffers.
+ * Returns number of iovecs, *total is set to number of bytes in them.
+ */
+int tgln_out_iovec (struct connection *c, struct iovec *iov, int max, int *total) {
+  int n = 0;
+  *total = 0;
+  struct connection_buffer *b = c->out_head;
+  while (b && n < max) {
+    iov[n].iov_base = b->rptr;
+    iov[n].iov_len = b->wptr - b->rptr;
+    *total += iov[n].iov_len;
+    n ++;
     b = b->next;
-    delete_connection_buffer (d);
   }
-  c->out_head = c->out_tail = c->in_head = c->in_tail = 0;
-  c->state = conn_failed;
-  c->out_bytes = c->in_bytes = 0;
-  close (c->fd);
-  Connections[c->fd] = 0;
-  vlogprintf (E_NOTICE, "Lost connection to server... %s:%d\n", c->ip, c->port);
-  restart_connection (c);
+  return n;
+}
+
+static void consume_out (struct connection *c, int y) {
+  c->out_bytes -= y;
+  while (c->out_head && y >= c->out_head->wptr - c->out_head->rptr) {
+    y -= c->out_head->wptr - c->out_head->rptr;
+    struct connection_buffer *b = c->out_head;
+    c->out_head = b->next;
+    if (!c->out_head) {
+      c->out_tail = 0;
+    }
+    delete_connection_buffer (b);
+  }
+  if (y) {
+    c->out_head->rptr += y;
+  }
 }
 
 //extern FILE *log_net_f;
@@ -426,31 +1071,46 @@ static void try_write (struct connection *c) {
   vlogprintf (E_DEBUG, "try write: fd = %d\n", c->fd);
   int x = 0;
   while (c->out_head) {
-    int r = write (c->fd, c->out_head->rptr, c->out_head->wptr - c->out_head->rptr);
+    struct iovec iov[MAX_WRITE_IOVEC];
+    int total;
+    int n = tgln_out_iovec (c, iov, MAX_WRITE_IOVEC, &total);
+    int r = writev (c->fd, iov, n);
     if (r >= 0) {
       x += r;
-      c->out_head->rptr += r;
-      if (c->out_head->rptr != c->out_head->wptr) {
+      consume_out (c, r);
+      if (r != total) {
+        c->flags |= CONN_FLAG_WRITE_BLOCKED;
         break;
       }
-      struct connection_buffer *b = c->out_head;
-      c->out_head = b->next;
-      if (!c->out_head) {
-        c->out_tail = 0;
-      }
-      delete_connection_buffer (b);
     } else {
       if (errno != EAGAIN && errno != EWOULDBLOCK) {
         vlogprintf (E_NOTICE, "fail_connection: write_error %s\n", strerror(errno));
         fail_connection (c);
         return;
       } else {
+        c->flags |= CONN_FLAG_WRITE_BLOCKED;
         break;
       }
     }
   }
   vlogprintf (E_DEBUG, "Sent %d bytes to %d\n", x, c->fd);
-  c->out_bytes -= x;
+}
+
+/*
+ * Completion of asynchronous send of the output gathered by tgln_out_iovec.
+ * r is number of bytes sent or -errno
+ */
+void tgln_conn_sent (struct connection *c, int r) {
+  struct tgl_state *TLS = c->TLS;
+  if (r < 0) {
+    vlogprintf (E_NOTICE, "fail_connection: write_error %s\n", strerror(-r));
+    fail_connection (c);
+    return;
+  }
+  vlogprintf (E_DEBUG, "Sent %d bytes to %d\n", r, c->fd);
+  consume_out (c, r);
+  c->flags &= ~CONN_FLAG_WRITE_PENDING;
+  tgln_flush_out (c);
 }
 
 static void try_rpc_read (struct connection *c) {
@@ -458,56 +1118,56 @@ static void try_rpc_read (struct connection *c) {
   struct tgl_state *TLS = c->TLS;
 
   while (1) {
-    if (c->in_bytes < 1) { return; }
-    unsigned len = 0;
-    unsigned t = 0;
-    assert (tgln_read_in_lookup (c, &len, 1) == 1);
-    if (len >= 1 && len <= 0x7e) {
-      if (c->in_bytes < (int)(1 + 4 * len)) { return; }
+    if (c->in_bytes < 1) { break; }
+    unsigned char header[8];
+    int l = tgln_read_in_lookup (c, header, 8);
+    unsigned len;
+    int header_len;
+    if (header[0] >= 1 && header[0] <= 0x7e) {
+      len = header[0];
+      header_len = 1;
     } else {
-      if (c->in_bytes < 4) { return; }
-      assert (tgln_read_in_lookup (c, &len, 4) == 4);
+      if (l < 4) { break; }
+      memcpy (&len, header, 4);
       len = (len >> 8);
-      if (c->in_bytes < (int)(4 + 4 * len)) { return; }
-      len = 0x7f;
+      header_len = 4;
     }
+    if (c->in_bytes < (int)(header_len + 4 * len)) { break; }
+    assert (len >= 1);
+    assert (l >= header_len + 4);
 
-    if (len >= 1 && len <= 0x7e) {
-      assert (tgln_read_in (c, &t, 1) == 1);    
-      assert (t == len);
-      assert (len >= 1);
-    } else {
-      assert (len == 0x7f);
-      assert (tgln_read_in (c, &len, 4) == 4);
-      len = (len >> 8);
-      assert (len >= 1);
-    }
-    len *= 4;
     int op;
-    assert (tgln_read_in_lookup (c, &op, 4) == 4);
-    if (c->methods->execute (TLS, c, op, len) < 0) {
+    memcpy (&op, header + header_len, 4);
+    assert (tgln_read_in (c, header, header_len) == header_len);
+    if (c->methods->execute (TLS, c, op, 4 * len) < 0) {
+      // connection may be already freed
       return;
     }
   }
+  release_read_buffers (c);
 }
 
 static void try_read (struct connection *c) {
   struct tgl_state *TLS = c->TLS;
   vlogprintf (E_DEBUG, "try read: fd = %d\n", c->fd);
   if (!c->in_tail) {
-    c->in_head = c->in_tail = new_connection_buffer (1 << 20);
+    c->in_head = c->in_tail = new_connection_buffer (0);
+  } else if (c->in_tail->wptr == c->in_tail->end) {
+    struct connection_buffer *b = new_connection_buffer (0);
+    c->in_tail->next = b;
+    c->in_tail = b;
   }
-  #ifdef EVENT_V1
-    struct timeval tv = {5, 0};
-    event_add (c->read_ev, &tv);
-  #endif
   int x = 0;
   while (1) {
     int r = read (c->fd, c->in_tail->wptr, c->in_tail->end - c->in_tail->wptr);
     if (r > 0) {
       c->last_receive_time = tglt_get_double_time ();
-      stop_ping_timer (c);
-      start_ping_timer (c);
+      c->fail_count = 0;
+    }
+    if (!r) {
+      vlogprintf (E_NOTICE, "fail_connection: closed by server\n");
+      fail_connection (c);
+      return;
     }
     if (r >= 0) {
       c->in_tail->wptr += r;
@@ -515,7 +1175,8 @@ static void try_read (struct connection *c) {
       if (c->in_tail->wptr != c->in_tail->end) {
         break;
       }
-      struct connection_buffer *b = new_connection_buffer (1 << 20);
+      // buffer filled up, so the next one is taken from the next size class
+      struct connection_buffer *b = new_connection_buffer (c->in_tail->end - c->in_tail->start + 1);
       c->in_tail->next = b;
       c->in_tail = b;
     } else {
@@ -535,6 +1196,50 @@ static void try_read (struct connection *c) {
   }
 }
 
+/*
+ * Data received asynchronously into buffers owned by io methods.
+ * len is number of bytes, 0 on eof or -errno
+ */
+void tgln_conn_received (struct connection *c, const void *_data, int len) {
+  struct tgl_state *TLS = c->TLS;
+  const unsigned char *data = _data;
+  if (c->owner) {
+    // nothing but errors can come before connect
+    probe_event (c, len < 0 ? -len : ECONNRESET);
+    return;
+  }
+  if (len <= 0) {
+    if (len) {
+      vlogprintf (E_NOTICE, "fail_connection: read_error %s\n", strerror(-len));
+    } else {
+      vlogprintf (E_NOTICE, "fail_connection: closed by server\n");
+    }
+    fail_connection (c);
+    return;
+  }
+  vlogprintf (E_DEBUG, "Received %d bytes from %d\n", len, c->fd);
+  c->last_receive_time = tglt_get_double_time ();
+  c->fail_count = 0;
+  if (!c->in_tail) {
+    c->in_head = c->in_tail = new_connection_buffer (len);
+  }
+  c->in_bytes += len;
+  while (len) {
+    int y = c->in_tail->end - c->in_tail->wptr;
+    if (y > len) { y = len; }
+    memcpy (c->in_tail->wptr, data, y);
+    c->in_tail->wptr += y;
+    data += y;
+    len -= y;
+    if (c->in_tail->wptr == c->in_tail->end) {
+      struct connection_buffer *b = new_connection_buffer (c->in_tail->end - c->in_tail->start + 1);
+      c->in_tail->next = b;
+      c->in_tail = b;
+    }
+  }
+  try_rpc_read (c);
+}
+
 static void incr_out_packet_num (struct connection *c) {
   c->out_packet_num ++;
 }
@@ -548,11 +1253,13 @@ static struct tgl_session *get_session (struct connection *c) {
 }
 
 static void tgln_free (struct connection *c) {
+  struct tgl_state *TLS = c->TLS;
   if (c->ip) { tfree_str (c->ip); }
-  if (c->ping_ev) { event_free (c->ping_ev); }
-  if (c->fail_ev) { event_free (c->fail_ev); }
-  if (c->read_ev) { event_free (c->read_ev); }
-  if (c->write_ev) { event_free (c->write_ev); }
+  if (c->ping_ev) { TLS->timer_methods->free (c->ping_ev); }
+  if (c->fail_ev) { TLS->timer_methods->free (c->fail_ev); }
+  race_stop (c);
+  if (c->race_ev) { TLS->timer_methods->free (c->race_ev); }
+  detach_connection (c);
 
   struct connection_buffer *b = c->out_head;
   while (b) {
@@ -567,14 +1274,17 @@ static void tgln_free (struct connection *c) {
     delete_connection_buffer (d);
   }
 
-  if (c->fd >= 0) { Connections[c->fd] = 0; close (c->fd); }
+  if (c->fd >= 0) { unregister_connection (c); close (c->fd); }
   tfree (c, sizeof (*c));
 }
 
+#if defined(EVENT_V2) || defined(EVENT_V1)
 struct tgl_net_methods tgl_conn_methods = {
   .write_out = tgln_write_out,
   .read_in = tgln_read_in,
   .read_in_lookup = tgln_read_in_lookup,
+  .read_in_ptr = tgln_read_in_ptr,
+  .reserve_out = tgln_reserve_out,
   .flush_out = tgln_flush_out,
   .incr_out_packet_num = incr_out_packet_num,
   .get_dc = get_dc,
@@ -582,3 +1292,36 @@ struct tgl_net_methods tgl_conn_methods = {
   .create_connection = tgln_create_connection,
   .free = tgln_free
 };
+#endif
+
+#ifdef EPOLL
+struct tgl_net_methods tgl_epoll_conn_methods = {
+  .write_out = tgln_write_out,
+  .read_in = tgln_read_in,
+  .read_in_lookup = tgln_read_in_lookup,
+  .read_in_ptr = tgln_read_in_ptr,
+  .reserve_out = tgln_reserve_out,
+  .flush_out = tgln_flush_out,
+  .incr_out_packet_num = incr_out_packet_num,
+  .get_dc = get_dc,
+  .get_session = get_session,
+  .create_connection = epoll_create_connection,
+  .free = tgln_free
+};
+#endif
+
+#ifdef IO_URING
+struct tgl_net_methods tgl_uring_conn_methods = {
+  .write_out = tgln_write_out,
+  .read_in = tgln_read_in,
+  .read_in_lookup = tgln_read_in_lookup,
+  .read_in_ptr = tgln_read_in_ptr,
+  .reserve_out = tgln_reserve_out,
+  .flush_out = tgln_flush_out,
+  .incr_out_packet_num = incr_out_packet_num,
+  .get_dc = get_dc,
+  .get_session = get_session,
+  .create_connection = uring_create_connection,
+  .free = tgln_free
+};
+#endif
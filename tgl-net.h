@@ -20,5 +20,12 @@
 #ifndef __NET_H__
 #define __NET_H__
 
+struct tgl_state;
+
 extern struct tgl_net_methods tgl_conn_methods;
+extern struct tgl_net_methods tgl_epoll_conn_methods;
+extern struct tgl_net_methods tgl_uring_conn_methods;
+
+int tgln_print_buffer_pool_stat (char *s, int len);
+int tgln_print_reconnect_stat (struct tgl_state *TLS, char *s, int len);
 #endif
@@ -0,0 +1,269 @@
+/* 
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Vitaly Valtman 2013-2015
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <assert.h>
+#include <time.h>
+
+#include "tgl.h"
+#include "tools.h"
+#include "tgl-timer-wheel.h"
+
+#define TICKS_PER_SEC 100
+
+// 256 slots of one tick, then 3 levels of 64 slots, up to 2^26 ticks (about 7 days)
+#define L0_BITS 8
+#define LN_BITS 6
+#define LN_NUM 3
+#define L0_SIZE (1 << L0_BITS)
+#define LN_SIZE (1 << LN_BITS)
+
+struct tgl_timer_wheel {
+  // list heads
+  struct tgl_wheel_timer l0[L0_SIZE];
+  struct tgl_wheel_timer ln[LN_NUM][LN_SIZE];
+  // next tick to be processed
+  long long tick;
+  // tick the backend timer is armed for, -1 if it is not
+  long long armed;
+  int count;
+  int running;
+  struct tgl_timer *ev;
+};
+
+static double now_time (void) {
+  struct timespec T;
+  tgl_my_clock_gettime (CLOCK_MONOTONIC, &T);
+  return T.tv_sec + (double) T.tv_nsec * 1e-9;
+}
+
+static long long now_tick (void) {
+  return (long long)(now_time () * TICKS_PER_SEC);
+}
+
+static void list_init (struct tgl_wheel_timer *h) {
+  h->next = h->prev = h;
+}
+
+static int list_empty (struct tgl_wheel_timer *h) {
+  return h->next == h;
+}
+
+static void list_add (struct tgl_wheel_timer *h, struct tgl_wheel_timer *t) {
+  t->next = h;
+  t->prev = h->prev;
+  h->prev->next = t;
+  h->prev = t;
+}
+
+static void list_del (struct tgl_wheel_timer *t) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+}
+
+// moves all timers of h to the empty list w
+static void list_splice (struct tgl_wheel_timer *h, struct tgl_wheel_timer *w) {
+  list_init (w);
+  if (list_empty (h)) { return; }
+  w->next = h->next;
+  w->prev = h->prev;
+  w->next->prev = w;
+  w->prev->next = w;
+  list_init (h);
+}
+
+static void add_timer (struct tgl_timer_wheel *W, struct tgl_wheel_timer *t) {
+  long long e = t->expire;
+  long long d = e - W->tick;
+  if (d < 0) {
+    list_add (&W->l0[W->tick & (L0_SIZE - 1)], t);
+    return;
+  }
+  if (d < L0_SIZE) {
+    list_add (&W->l0[e & (L0_SIZE - 1)], t);
+    return;
+  }
+  int l;
+  for (l = 0; l < LN_NUM; l++) {
+    int shift = L0_BITS + l * LN_BITS;
+    long long range = 1LL << (shift + LN_BITS);
+    if (d < range || l == LN_NUM - 1) {
+      if (d >= range) {
+        // farther than the wheel goes, placed again when reached
+        e = W->tick + range - 1;
+      }
+      list_add (&W->ln[l][(e >> shift) & (LN_SIZE - 1)], t);
+      return;
+    }
+  }
+}
+
+// returns index of the slot, 0 means that the upper level is to be cascaded too
+static int cascade (struct tgl_timer_wheel *W, int l) {
+  int idx = (W->tick >> (L0_BITS + l * LN_BITS)) & (LN_SIZE - 1);
+  struct tgl_wheel_timer w;
+  list_splice (&W->ln[l][idx], &w);
+  while (w.next != &w) {
+    struct tgl_wheel_timer *t = w.next;
+    list_del (t);
+    add_timer (W, t);
+  }
+  return idx;
+}
+
+static int l0_empty (struct tgl_timer_wheel *W) {
+  int i;
+  for (i = 0; i < L0_SIZE; i++) {
+    if (!list_empty (&W->l0[i])) { return 0; }
+  }
+  return 1;
+}
+
+static void arm (struct tgl_state *TLS, struct tgl_timer_wheel *W) {
+  if (!W->count) {
+    if (W->armed >= 0) {
+      TLS->timer_methods->remove (W->ev);
+      W->armed = -1;
+    }
+    return;
+  }
+  // next non-empty slot of the lowest level, or its end where upper levels are cascaded.
+  // At the very start of a round they are not cascaded yet
+  long long t = W->tick;
+  if (t & (L0_SIZE - 1)) {
+    long long end = (t | (L0_SIZE - 1)) + 1;
+    while (t < end && list_empty (&W->l0[t & (L0_SIZE - 1)])) {
+      t ++;
+    }
+  }
+  // rounds with nothing to cascade are slept through
+  if (!(t & (L0_SIZE - 1)) && l0_empty (W)) {
+    while (1) {
+      int idx = (t >> L0_BITS) & (LN_SIZE - 1);
+      if (!idx || !list_empty (&W->ln[0][idx])) { break; }
+      t += L0_SIZE;
+    }
+  }
+  if (W->armed == t) { return; }
+  W->armed = t;
+  TLS->timer_methods->insert (W->ev, (double)t / TICKS_PER_SEC - now_time ());
+}
+
+static void run_timers (struct tgl_state *TLS, void *arg) {
+  struct tgl_timer_wheel *W = arg;
+  long long now = now_tick ();
+  W->armed = -1;
+  W->running = 1;
+  while (W->tick <= now && W->count) {
+    int idx = W->tick & (L0_SIZE - 1);
+    if (!idx) {
+      int l;
+      for (l = 0; l < LN_NUM && !cascade (W, l); l++) {}
+    }
+    struct tgl_wheel_timer w;
+    list_splice (&W->l0[idx], &w);
+    W->tick ++;
+    // callbacks may remove any timer, so the list is taken apart one by one
+    while (w.next != &w) {
+      struct tgl_wheel_timer *t = w.next;
+      list_del (t);
+      if (t->expire >= W->tick) {
+        add_timer (W, t);
+        continue;
+      }
+      W->count --;
+      t->cb (TLS, t->arg);
+    }
+  }
+  if (!W->count) {
+    W->tick = now + 1;
+  }
+  W->running = 0;
+  arm (TLS, W);
+}
+
+static struct tgl_timer_wheel *get_wheel (struct tgl_state *TLS) {
+  struct tgl_timer_wheel *W = TLS->timer_wheel;
+  if (W) { return W; }
+  W = talloc0 (sizeof (*W));
+  int i, l;
+  for (i = 0; i < L0_SIZE; i++) {
+    list_init (&W->l0[i]);
+  }
+  for (l = 0; l < LN_NUM; l++) {
+    for (i = 0; i < LN_SIZE; i++) {
+      list_init (&W->ln[l][i]);
+    }
+  }
+  W->tick = now_tick ();
+  W->armed = -1;
+  W->ev = TLS->timer_methods->alloc (TLS, run_timers, W);
+  TLS->timer_wheel = W;
+  return W;
+}
+
+void tglw_timer_init (struct tgl_wheel_timer *t, void (*cb)(struct tgl_state *TLS, void *arg), void *arg) {
+  t->next = t->prev = NULL;
+  t->cb = cb;
+  t->arg = arg;
+}
+
+void tglw_timer_insert (struct tgl_state *TLS, struct tgl_wheel_timer *t, double timeout) {
+  struct tgl_timer_wheel *W = get_wheel (TLS);
+  assert (t->cb);
+  if (t->next) {
+    list_del (t);
+    W->count --;
+  }
+  double now = now_time ();
+  if (!W->count && !W->running) {
+    // nothing is pending, so the wheel is moved over the idle time at once
+    W->tick = (long long)(now * TICKS_PER_SEC);
+  }
+  if (timeout < 0) { timeout = 0; }
+  // rounded up, so the timer never fires before its time
+  t->expire = (long long)((now + timeout) * TICKS_PER_SEC) + 1;
+  add_timer (W, t);
+  W->count ++;
+  if (!W->running && (W->armed < 0 || t->expire < W->armed)) {
+    arm (TLS, W);
+  }
+}
+
+void tglw_timer_remove (struct tgl_state *TLS, struct tgl_wheel_timer *t) {
+  if (!t->next) { return; }
+  list_del (t);
+  TLS->timer_wheel->count --;
+}
+
+int tglw_timer_pending (struct tgl_wheel_timer *t) {
+  return t->next != NULL;
+}
+
+void tglw_free (struct tgl_state *TLS) {
+  struct tgl_timer_wheel *W = TLS->timer_wheel;
+  if (!W) { return; }
+  TLS->timer_methods->free (W->ev);
+  tfree (W, sizeof (*W));
+  TLS->timer_wheel = NULL;
+}
@@ -0,0 +1,41 @@
+/* 
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Vitaly Valtman 2013-2015
+*/
+
+#ifndef __TGL_TIMER_WHEEL_H__
+#define __TGL_TIMER_WHEEL_H__
+
+#include "tgl-layout.h"
+
+struct tgl_state;
+
+/*
+ * Hashed hierarchical timer wheel for timers the library keeps in bulk:
+ * query deadlines, acks and user status expiry. Timers are embedded into their owners
+ * and cost no allocation, insert and remove are O(1). The wheel is driven by a single
+ * timer of TLS->timer_methods, resolution is 10 ms.
+ * Callback is called with the timer already removed, so it may insert it again.
+ */
+void tglw_timer_init (struct tgl_wheel_timer *t, void (*cb)(struct tgl_state *TLS, void *arg), void *arg);
+void tglw_timer_insert (struct tgl_state *TLS, struct tgl_wheel_timer *t, double timeout);
+// removing a timer that is not pending is a no-op
+void tglw_timer_remove (struct tgl_state *TLS, struct tgl_wheel_timer *t);
+int tglw_timer_pending (struct tgl_wheel_timer *t);
+void tglw_free (struct tgl_state *TLS);
+#endif
@@ -0,0 +1,585 @@
+/* 
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Vitaly Valtman 2013-2015
+*/
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <endian.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+#include "tgl-net-inner.h"
+#include "tgl-uring.h"
+#include "tools.h"
+
+#define URING_ENTRIES 256
+#define URING_MAX_FILES 4096
+#define URING_MAX_IOVEC 64
+
+// provided buffers for multishot recv, data is copied to connection buffers at once
+#define URING_BUF_GROUP 0
+#define URING_BUF_CNT 256
+#define URING_BUF_SIZE (1 << 14)
+
+enum uring_op {
+  uring_op_cancel,
+  uring_op_poll,
+  uring_op_recv,
+  uring_op_send
+};
+
+struct uring_slot {
+  struct connection *c;
+  int gen;
+  int is_free;
+  // number of submitted requests without final completion
+  int inflight;
+  int recv_armed;
+  int send_armed;
+  // multishot recv could not be rearmed for lack of sqes, it is retried in tgl_uring_submit
+  int recv_wanted;
+  // output of a detached connection, the kernel may read it until the send completes
+  struct connection_buffer *held_out;
+  struct msghdr msg;
+  struct iovec iov[URING_MAX_IOVEC];
+};
+
+struct tgl_uring {
+  int fd;
+  void *ring;
+  size_t ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_flags;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  unsigned to_submit;
+
+  struct io_uring_buf_ring *br;
+  size_t br_size;
+  unsigned short br_tail;
+  unsigned char *bufs;
+
+  struct uring_slot *slots;
+  int *free_slots;
+  int free_cnt;
+  int recv_wanted_cnt;
+  // completions are being handled, they are not reaped from get_sqe then
+  int processing;
+
+  long long submits;
+  long long sqes_total;
+  long long cqes_total;
+  long long sends;
+  long long recv_rearms;
+  long long sqe_shortages;
+};
+
+static int sys_io_uring_setup (unsigned entries, struct io_uring_params *p) {
+  return syscall (__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter (int fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+  return syscall (__NR_io_uring_enter, fd, to_submit, min_complete, flags, 0, 0);
+}
+
+static int sys_io_uring_register (int fd, unsigned opcode, void *arg, unsigned nr_args) {
+  return syscall (__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static unsigned long long make_user_data (int slot, int gen, enum uring_op op) {
+  return ((unsigned long long)slot << 32) | ((unsigned)gen << 8) | op;
+}
+
+// connection c is still attached to the slot it had when request was submitted
+#define SLOT_ALIVE(S,c,g) ((c) && (S)->c == (c) && (S)->gen == (g))
+
+/* submission */
+
+static void submit_sqes (struct tgl_uring *U) {
+  if (*U->sq_flags & IORING_SQ_CQ_OVERFLOW) {
+    sys_io_uring_enter (U->fd, 0, 0, IORING_ENTER_GETEVENTS);
+  }
+  while (U->to_submit) {
+    int r = sys_io_uring_enter (U->fd, U->to_submit, 0, 0);
+    if (r < 0) {
+      if (errno == EINTR) { continue; }
+      // EAGAIN/EBUSY: retry on the next iteration, after completions are reaped
+      break;
+    }
+    U->submits ++;
+    U->to_submit -= r;
+    if (!r) { break; }
+  }
+}
+
+static int sq_full (struct tgl_uring *U) {
+  return *U->sq_tail - __atomic_load_n (U->sq_head, __ATOMIC_ACQUIRE) >= U->sq_entries;
+}
+
+/*
+ * Returns 0 if the SQ ring stays full after submit. With reap set completions
+ * are handled first, so the kernel accepts the submission again;
+ * connections may be failed or freed meanwhile.
+ */
+static struct io_uring_sqe *get_sqe (struct tgl_uring *U, int reap) {
+  unsigned tail = *U->sq_tail;
+  if (sq_full (U)) {
+    submit_sqes (U);
+    if (sq_full (U) && reap && !U->processing) {
+      tgl_uring_process (U);
+      submit_sqes (U);
+    }
+    if (sq_full (U)) {
+      U->sqe_shortages ++;
+      return 0;
+    }
+  }
+  struct io_uring_sqe *sqe = &U->sqes[tail & U->sq_mask];
+  memset (sqe, 0, sizeof (*sqe));
+  return sqe;
+}
+
+static void push_sqe (struct tgl_uring *U) {
+  __atomic_store_n (U->sq_tail, *U->sq_tail + 1, __ATOMIC_RELEASE);
+  U->to_submit ++;
+  U->sqes_total ++;
+}
+
+static int arm_recv (struct tgl_uring *U, int slot) {
+  struct uring_slot *S = &U->slots[slot];
+  struct io_uring_sqe *sqe = get_sqe (U, 0);
+  if (!sqe) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = slot;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->buf_group = URING_BUF_GROUP;
+  sqe->user_data = make_user_data (slot, S->gen, uring_op_recv);
+  push_sqe (U);
+  S->recv_armed = 1;
+  S->inflight ++;
+  if (S->recv_wanted) {
+    S->recv_wanted = 0;
+    U->recv_wanted_cnt --;
+  }
+  return 0;
+}
+
+static void rearm_recv_later (struct tgl_uring *U, int slot) {
+  struct uring_slot *S = &U->slots[slot];
+  if (!S->recv_wanted) {
+    S->recv_wanted = 1;
+    U->recv_wanted_cnt ++;
+  }
+}
+
+static void rearm_wanted (struct tgl_uring *U) {
+  int i;
+  for (i = 0; i < URING_MAX_FILES && U->recv_wanted_cnt; i++) {
+    if (U->slots[i].recv_wanted && arm_recv (U, i) < 0) {
+      return;
+    }
+  }
+}
+
+void tgl_uring_submit (struct tgl_uring *U) {
+  rearm_wanted (U);
+  submit_sqes (U);
+}
+
+// nonblocking connect is in progress, wait for it with poll
+static int arm_connect_poll (struct tgl_uring *U, int slot) {
+  struct uring_slot *S = &U->slots[slot];
+  struct io_uring_sqe *sqe = get_sqe (U, 0);
+  if (!sqe) {
+    return -1;
+  }
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = slot;
+  sqe->flags = IOSQE_FIXED_FILE;
+#if __BYTE_ORDER == __BIG_ENDIAN
+  sqe->poll32_events = ((unsigned)POLLOUT << 16) | ((unsigned)POLLOUT >> 16);
+#else
+  sqe->poll32_events = POLLOUT;
+#endif
+  sqe->user_data = make_user_data (slot, S->gen, uring_op_poll);
+  push_sqe (U);
+  S->inflight ++;
+  return 0;
+}
+
+int tgl_uring_send (struct tgl_uring *U, struct connection *c) {
+  struct uring_slot *S = &U->slots[c->io_slot];
+  assert (S->c == c);
+  if (S->send_armed) {
+    // CONN_FLAG_WRITE_PENDING stays set, so the rest goes out on completion
+    return 0;
+  }
+  struct io_uring_sqe *sqe = get_sqe (U, 1);
+  if (S->c != c) {
+    // c is detached (or freed) by completions reaped in get_sqe
+    return 0;
+  }
+  if (!sqe) {
+    return -1;
+  }
+  int total;
+  int n = tgln_out_iovec (c, S->iov, URING_MAX_IOVEC, &total);
+  if (!total) {
+    c->flags &= ~CONN_FLAG_WRITE_PENDING;
+    return 0;
+  }
+  memset (&S->msg, 0, sizeof (S->msg));
+  S->msg.msg_iov = S->iov;
+  S->msg.msg_iovlen = n;
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = c->io_slot;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->addr = (unsigned long)&S->msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL;
+  sqe->user_data = make_user_data (c->io_slot, S->gen, uring_op_send);
+  push_sqe (U);
+  S->send_armed = 1;
+  S->inflight ++;
+  U->sends ++;
+  return 0;
+}
+
+/* slots */
+
+static int update_file (struct tgl_uring *U, int slot, int fd) {
+  struct io_uring_files_update up;
+  memset (&up, 0, sizeof (up));
+  up.offset = slot;
+  up.fds = (unsigned long)&fd;
+  return sys_io_uring_register (U->fd, IORING_REGISTER_FILES_UPDATE, &up, 1) == 1 ? 0 : -1;
+}
+
+static void release_slot (struct tgl_uring *U, int slot) {
+  struct uring_slot *S = &U->slots[slot];
+  if (!S->c && !S->inflight && !S->is_free) {
+    S->is_free = 1;
+    U->free_slots[U->free_cnt ++] = slot;
+  }
+}
+
+int tgl_uring_attach (struct tgl_uring *U, struct connection *c) {
+  if (!U->free_cnt) {
+    return -1;
+  }
+  int slot = U->free_slots[-- U->free_cnt];
+  if (update_file (U, slot, c->fd) < 0) {
+    U->free_slots[U->free_cnt ++] = slot;
+    return -1;
+  }
+  struct uring_slot *S = &U->slots[slot];
+  S->c = c;
+  S->gen = (S->gen + 1) & 0xffffff;
+  S->is_free = 0;
+  c->io_slot = slot;
+  if ((c->state == conn_connecting ? arm_connect_poll (U, slot) : arm_recv (U, slot)) < 0) {
+    S->c = 0;
+    update_file (U, slot, -1);
+    release_slot (U, slot);
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Requests in flight are cancelled, but one already running is not stopped by that:
+ * output of the connection is kept in the slot till the send completes,
+ * and the socket is shut down, so that the send does not wait for the peer.
+ * The slot is reused after all completions arrive.
+ */
+void tgl_uring_detach (struct tgl_uring *U, struct connection *c) {
+  int slot = c->io_slot;
+  struct uring_slot *S = &U->slots[slot];
+  assert (S->c == c);
+  S->c = 0;
+  if (S->recv_wanted) {
+    S->recv_wanted = 0;
+    U->recv_wanted_cnt --;
+  }
+  if (S->inflight) {
+    if (S->send_armed) {
+      assert (!S->held_out);
+      S->held_out = tgln_take_out (c);
+    }
+    struct io_uring_sqe *sqe = get_sqe (U, 0);
+    if (sqe) {
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = slot;
+      sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL | IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_FD_FIXED;
+      sqe->user_data = make_user_data (slot, S->gen, uring_op_cancel);
+      push_sqe (U);
+      submit_sqes (U);
+    }
+    if (!sqe || S->send_armed) {
+      shutdown (c->fd, SHUT_RDWR);
+    }
+  }
+  update_file (U, slot, -1);
+  release_slot (U, slot);
+}
+
+/* completions */
+
+static void recycle_buffer (struct tgl_uring *U, int bid) {
+  struct io_uring_buf *b = &U->br->bufs[U->br_tail & (URING_BUF_CNT - 1)];
+  b->addr = (unsigned long)(U->bufs + (long)bid * URING_BUF_SIZE);
+  b->len = URING_BUF_SIZE;
+  b->bid = bid;
+  U->br_tail ++;
+  __atomic_store_n (&U->br->tail, U->br_tail, __ATOMIC_RELEASE);
+}
+
+static void connect_done (struct connection *c, int res) {
+  if (res < 0 || (res & (POLLERR | POLLHUP))) {
+    int err = 0;
+    socklen_t len = sizeof (err);
+    if (res < 0) {
+      err = -res;
+    } else if (getsockopt (c->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || !err) {
+      err = ECONNREFUSED;
+    }
+    tgln_conn_received (c, 0, -err);
+    return;
+  }
+  tgln_conn_writable (c);
+}
+
+static void handle_cqe (struct tgl_uring *U, unsigned long long user_data, int res, unsigned flags) {
+  enum uring_op op = user_data & 0xff;
+  if (op == uring_op_cancel) {
+    return;
+  }
+  int slot = user_data >> 32;
+  int gen = (user_data >> 8) & 0xffffff;
+  struct uring_slot *S = &U->slots[slot];
+  struct connection *c = S->gen == gen ? S->c : 0;
+
+  switch (op) {
+  case uring_op_poll:
+    S->inflight --;
+    if (c) {
+      connect_done (c, res);
+      if (SLOT_ALIVE (S, c, gen) && c->state == conn_ready && arm_recv (U, slot) < 0) {
+        rearm_recv_later (U, slot);
+      }
+    }
+    break;
+  case uring_op_recv:
+    if (!(flags & IORING_CQE_F_MORE)) {
+      S->recv_armed = 0;
+      S->inflight --;
+    }
+    if (flags & IORING_CQE_F_BUFFER) {
+      int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+      if (c) {
+        tgln_conn_received (c, U->bufs + (long)bid * URING_BUF_SIZE, res);
+      }
+      recycle_buffer (U, bid);
+    } else if (c && res != -ENOBUFS) {
+      tgln_conn_received (c, 0, res);
+    }
+    // multishot recv stops when provided buffers run out
+    if (SLOT_ALIVE (S, c, gen) && !S->recv_armed) {
+      U->recv_rearms ++;
+      if (arm_recv (U, slot) < 0) {
+        rearm_recv_later (U, slot);
+      }
+    }
+    break;
+  case uring_op_send:
+    S->send_armed = 0;
+    S->inflight --;
+    if (S->held_out) {
+      tgln_free_buffers (S->held_out);
+      S->held_out = 0;
+    }
+    if (c) {
+      tgln_conn_sent (c, res);
+    }
+    break;
+  default:
+    assert (0);
+  }
+  release_slot (U, slot);
+}
+
+void tgl_uring_process (struct tgl_uring *U) {
+  U->processing ++;
+  while (1) {
+    unsigned head = *U->cq_head;
+    if (head == __atomic_load_n (U->cq_tail, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+    struct io_uring_cqe *cqe = &U->cqes[head & U->cq_mask];
+    unsigned long long user_data = cqe->user_data;
+    int res = cqe->res;
+    unsigned flags = cqe->flags;
+    __atomic_store_n (U->cq_head, head + 1, __ATOMIC_RELEASE);
+    U->cqes_total ++;
+    handle_cqe (U, user_data, res, flags);
+  }
+  U->processing --;
+}
+
+/* setup */
+
+struct tgl_uring *tgl_uring_new (void) {
+  struct io_uring_params p;
+  memset (&p, 0, sizeof (p));
+  // SINGLE_ISSUER is from 6.0 as multishot recv is, older kernels fail here
+  p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_CQSIZE;
+  p.cq_entries = 4 * URING_ENTRIES;
+  int fd = sys_io_uring_setup (URING_ENTRIES, &p);
+  if (fd < 0) {
+    return 0;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+    close (fd);
+    return 0;
+  }
+  struct tgl_uring *U = talloc0 (sizeof (*U));
+  U->fd = fd;
+  U->ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+  if (U->ring_size < p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe)) {
+    U->ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+  }
+  U->ring = mmap (0, U->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  U->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+  U->sqes = mmap (0, U->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  U->br_size = URING_BUF_CNT * sizeof (struct io_uring_buf);
+  U->br = mmap (0, U->br_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (U->ring == MAP_FAILED || U->sqes == MAP_FAILED || U->br == MAP_FAILED) {
+    goto fail;
+  }
+  unsigned char *r = U->ring;
+  U->sq_head = (void *)(r + p.sq_off.head);
+  U->sq_tail = (void *)(r + p.sq_off.tail);
+  U->sq_flags = (void *)(r + p.sq_off.flags);
+  U->sq_mask = *(unsigned *)(r + p.sq_off.ring_mask);
+  U->sq_entries = p.sq_entries;
+  unsigned *sq_array = (void *)(r + p.sq_off.array);
+  unsigned i;
+  for (i = 0; i < p.sq_entries; i++) {
+    sq_array[i] = i;
+  }
+  U->cq_head = (void *)(r + p.cq_off.head);
+  U->cq_tail = (void *)(r + p.cq_off.tail);
+  U->cq_mask = *(unsigned *)(r + p.cq_off.ring_mask);
+  U->cqes = (void *)(r + p.cq_off.cqes);
+
+  int *fds = talloc (URING_MAX_FILES * sizeof (int));
+  for (i = 0; i < URING_MAX_FILES; i++) {
+    fds[i] = -1;
+  }
+  int res = sys_io_uring_register (fd, IORING_REGISTER_FILES, fds, URING_MAX_FILES);
+  tfree (fds, URING_MAX_FILES * sizeof (int));
+  if (res < 0) {
+    goto fail;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset (&reg, 0, sizeof (reg));
+  reg.ring_addr = (unsigned long)U->br;
+  reg.ring_entries = URING_BUF_CNT;
+  reg.bgid = URING_BUF_GROUP;
+  if (sys_io_uring_register (fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    goto fail;
+  }
+  U->bufs = talloc ((long)URING_BUF_CNT * URING_BUF_SIZE);
+  for (i = 0; i < URING_BUF_CNT; i++) {
+    recycle_buffer (U, i);
+  }
+
+  U->slots = talloc0 (URING_MAX_FILES * sizeof (struct uring_slot));
+  U->free_slots = talloc (URING_MAX_FILES * sizeof (int));
+  for (i = 0; i < URING_MAX_FILES; i++) {
+    U->slots[i].is_free = 1;
+    U->free_slots[U->free_cnt ++] = URING_MAX_FILES - 1 - i;
+  }
+  return U;
+
+fail:
+  if (U->ring != MAP_FAILED && U->ring) { munmap (U->ring, U->ring_size); }
+  if (U->sqes != MAP_FAILED && U->sqes) { munmap (U->sqes, U->sqes_size); }
+  if (U->br != MAP_FAILED && U->br) { munmap (U->br, U->br_size); }
+  close (fd);
+  tfree (U, sizeof (*U));
+  return 0;
+}
+
+void tgl_uring_free (struct tgl_uring *U) {
+  // output held by slots is left as is: sends may still run after the ring is closed
+  close (U->fd);
+  munmap (U->ring, U->ring_size);
+  munmap (U->sqes, U->sqes_size);
+  munmap (U->br, U->br_size);
+  tfree (U->bufs, (long)URING_BUF_CNT * URING_BUF_SIZE);
+  tfree (U->slots, URING_MAX_FILES * sizeof (struct uring_slot));
+  tfree (U->free_slots, URING_MAX_FILES * sizeof (int));
+  tfree (U, sizeof (*U));
+}
+
+int tgl_uring_fd (struct tgl_uring *U) {
+  return U->fd;
+}
+
+int tgl_uring_print_stat (struct tgl_uring *U, char *s, int len) {
+  return tsnprintf (s, len,
+    "uring_submits\t%lld\n"
+    "uring_sqes\t%lld\n"
+    "uring_cqes\t%lld\n"
+    "uring_sends\t%lld\n"
+    "uring_recv_rearms\t%lld\n"
+    "uring_sqe_shortages\t%lld\n"
+    "uring_slots_used\t%d\n",
+    U->submits,
+    U->sqes_total,
+    U->cqes_total,
+    U->sends,
+    U->recv_rearms,
+    U->sqe_shortages,
+    URING_MAX_FILES - U->free_cnt
+    );
+}
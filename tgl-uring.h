@@ -0,0 +1,46 @@
+/* 
+    This file is part of tgl-library
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+
+    Copyright Vitaly Valtman 2013-2015
+*/
+#ifndef __TGL_URING_H__
+#define __TGL_URING_H__
+
+/*
+ * io_uring transport used by the epoll loop (see tgl-epoll.h).
+ * Each connection gets a registered fd slot with multishot recv
+ * into a provided buffer ring; sends are prepared by tgl_uring_send
+ * and go to the kernel with one tgl_uring_submit per loop iteration.
+ */
+struct tgl_uring;
+struct connection;
+
+// returns 0 if kernel lacks something needed
+struct tgl_uring *tgl_uring_new (void);
+void tgl_uring_free (struct tgl_uring *U);
+int tgl_uring_fd (struct tgl_uring *U);
+// returns -1 if there is no free fd slot
+int tgl_uring_attach (struct tgl_uring *U, struct connection *c);
+void tgl_uring_detach (struct tgl_uring *U, struct connection *c);
+// returns -1 if there is no free sqe, then it is to be retried on the next iteration
+int tgl_uring_send (struct tgl_uring *U, struct connection *c);
+void tgl_uring_submit (struct tgl_uring *U);
+// handles all posted completions
+void tgl_uring_process (struct tgl_uring *U);
+int tgl_uring_print_stat (struct tgl_uring *U, char *s, int len);
+
+#endif
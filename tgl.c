@@ -27,6 +27,8 @@
 #include "tools.h"
 #include "mtproto-client.h"
 #include "tgl-structures.h"
+#include "tgl-crypto-pool.h"
+#include "mtproto-utils.h"
 //#include "net.h"
 
 #include <assert.h>
@@ -140,6 +142,32 @@ void tgl_set_ev_base (struct tgl_state *TLS, void *ev_base) {
   TLS->ev_base = ev_base;
 }
 
+void tgl_set_dc_sessions (struct tgl_state *TLS, int num) {
+  if (num < 1) { num = 1; }
+  if (num > MAX_DC_SESSIONS) { num = MAX_DC_SESSIONS; }
+  TLS->dc_sessions = num;
+}
+
+void tgl_set_crypto_threads (struct tgl_state *TLS, int num) {
+  if (TLS->crypto_pool) {
+    // frames already submitted to the old pool must not be left there
+    tglmp_wait_rpc_frames (TLS);
+    tgl_crypto_pool_free (TLS->crypto_pool);
+    TLS->crypto_pool = NULL;
+  }
+  if (num > 0) {
+    TLS->crypto_pool = tgl_crypto_pool_alloc (num);
+  }
+}
+
+void tgl_set_gzip_threshold (struct tgl_state *TLS, int bytes) {
+  TLS->gzip_threshold = bytes;
+}
+
+void tgl_set_dh_cache_path (struct tgl_state *TLS, const char *path) {
+  tglmp_load_dh_cache (TLS, path);
+}
+
 void tgl_set_app_version (struct tgl_state *TLS, const char *app_version) {
   if (TLS->app_version) {
     tfree_str (TLS->app_version);
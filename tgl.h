@@ -133,6 +133,10 @@ struct tgl_net_methods {
   struct tgl_session *(*get_session) (struct connection *c);
 
   struct connection *(*create_connection) (struct tgl_state *TLS, const char *host, int port, struct tgl_session *session, struct tgl_dc *dc, struct mtproto_methods *methods);
+  // optional: consumes len bytes and returns them contiguous, valid until next read from c or until c fails or is freed
+  void *(*read_in_ptr) (struct connection *c, int len);
+  // optional: appends len bytes to output and returns them contiguous, must be filled before flush_out
+  void *(*reserve_out) (struct connection *c, int len);
 };
 
 struct mtproto_methods {
@@ -142,8 +146,12 @@ struct mtproto_methods {
 };
 
 struct tgl_timer;
+struct tgl_crypto_pool;
+struct tgl_inflater;
+struct tgl_timer_wheel;
 struct tree_random_id;
 struct tree_temp_id;
+struct tgl_query_slot;
 
 struct tgl_timer_methods {
   struct tgl_timer *(*alloc) (struct tgl_state *TLS, void (*cb)(struct tgl_state *TLS, void *arg), void *arg);
@@ -239,7 +247,10 @@ struct tgl_state {
 
   struct tgl_timer_methods *timer_methods;
 
-  struct tree_query *queries_tree;
+  // queries in flight by msg_id, see queries.c
+  struct tgl_query_slot *queries_index;
+  int queries_index_size;
+  int queries_index_num;
 
   char *base_path;
 
@@ -264,6 +275,18 @@ struct tgl_state {
   int is_bot;
 
   int last_temp_id;
+
+  // indexed by fd
+  struct connection **Connections;
+  int connections_size;
+  int connections_num;
+
+  int dc_sessions;
+
+  struct tgl_crypto_pool *crypto_pool;
+  struct tgl_inflater *inflater;
+  int gzip_threshold;
+  struct tgl_timer_wheel *timer_wheel;
 };
 #pragma pack(pop)
 //extern struct tgl_state tgl_state;
@@ -276,6 +299,8 @@ void tgl_reopen_binlog_for_writing (struct tgl_state *TLS);
 void tgl_replay_log (struct tgl_state *TLS);
 
 int tgl_print_stat (struct tgl_state *TLS, char *s, int len);
+// count, inflated to packed size ratio and time of gzip_packed answers per query type
+int tgl_print_inflate_stat (struct tgl_state *TLS, char *s, int len);
 tgl_peer_t *tgl_peer_get (struct tgl_state *TLS, tgl_peer_id_t id);
 tgl_peer_t *tgl_peer_get_by_name (struct tgl_state *TLS, const char *s);
 
@@ -341,6 +366,14 @@ void tgl_set_test_mode (struct tgl_state *TLS);
 void tgl_set_net_methods (struct tgl_state *TLS, struct tgl_net_methods *methods);
 void tgl_set_timer_methods (struct tgl_state *TLS, struct tgl_timer_methods *methods);
 void tgl_set_ev_base (struct tgl_state *TLS, void *ev_base);
+void tgl_set_dc_sessions (struct tgl_state *TLS, int num);
+// decrypt received messages on num worker threads, 0 to do it on the loop thread;
+// may be changed at any time from the loop thread, messages in flight are finished first
+void tgl_set_crypto_threads (struct tgl_state *TLS, int num);
+// queries of at least bytes are sent gzip_packed if that makes them smaller, 0 to disable
+void tgl_set_gzip_threshold (struct tgl_state *TLS, int bytes);
+// keep DH groups that passed the checks in the file, they are shared by all states in the process
+void tgl_set_dh_cache_path (struct tgl_state *TLS, const char *path);
 
 int tgl_authorized_dc (struct tgl_state *TLS, struct tgl_dc *DC);
 int tgl_signed_dc (struct tgl_state *TLS, struct tgl_dc *DC);
@@ -252,6 +252,21 @@ int tgl_inflate (void *input, int ilen, void *output, int olen) {
   return total_out;
 }
 
+// gzip with the fastest level; returns 0 if output does not fit in olen
+int tgl_deflate (void *input, int ilen, void *output, int olen) {
+  z_stream strm;
+  memset (&strm, 0, sizeof (strm));
+  assert (deflateInit2 (&strm, Z_BEST_SPEED, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+  strm.avail_in = ilen;
+  strm.next_in = input;
+  strm.avail_out = olen;
+  strm.next_out = output;
+  int err = deflate (&strm, Z_FINISH);
+  int total_out = err == Z_STREAM_END ? (int)strm.total_out : 0;
+  deflateEnd (&strm);
+  return total_out;
+}
+
 void tgl_check_debug (void) {
   int i;
   for (i = 0; i < used_blocks; i++) {
@@ -29,6 +29,13 @@
 #include "crypto/err.h"
 #include "crypto/rand.h"
 
+/* Scratch state is per thread, so that instances living on different threads do not share it */
+#if defined(_MSC_VER)
+#define TGL_THREAD __declspec(thread)
+#else
+#define TGL_THREAD __thread
+#endif
+
 struct tgl_allocator {
   void *(*alloc)(size_t size);
   void *(*realloc)(void *ptr, size_t old_size, size_t size);
@@ -56,6 +63,7 @@ extern struct tgl_allocator *tgl_allocator;
 double tglt_get_double_time (void);
 
 int tgl_inflate (void *input, int ilen, void *output, int olen);
+int tgl_deflate (void *input, int ilen, void *output, int olen);
 //void ensure (int r);
 //void ensure_ptr (void *p);
 
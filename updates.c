@@ -29,6 +29,7 @@
 #include "tgl-structures.h"
 #include "tgl-methods-in.h"
 #include "tree.h"
+#include "tgl-timer-wheel.h"
 
 #include <assert.h>
 
@@ -825,20 +826,17 @@ void tgl_insert_status_update (struct tgl_state *TLS, struct tgl_user *U) {
 
 static void user_expire (struct tgl_state *TLS, void *arg) {
   struct tgl_user *U = arg;
-  TLS->timer_methods->free (U->status.ev);
-  U->status.ev = 0;
   U->status.online = -1;
   U->status.when = tglt_get_double_time ();
   tgl_insert_status_update (TLS, U);
 }
 
 void tgl_insert_status_expire (struct tgl_state *TLS, struct tgl_user *U) {
-  assert (!U->status.ev);
-  U->status.ev = TLS->timer_methods->alloc (TLS, user_expire, U);
-  TLS->timer_methods->insert (U->status.ev, U->status.when - tglt_get_double_time ()); 
+  assert (!tglw_timer_pending (&U->status.ev));
+  tglw_timer_init (&U->status.ev, user_expire, U);
+  tglw_timer_insert (TLS, &U->status.ev, U->status.when - tglt_get_double_time ());
 }
 
 void tgl_remove_status_expire (struct tgl_state *TLS, struct tgl_user *U) {
-  TLS->timer_methods->free (U->status.ev);
-  U->status.ev = 0;
+  tglw_timer_remove (TLS, &U->status.ev);
 }